@@ -4,30 +4,207 @@
 #ifndef COMP_DECOMP_HPP_
 #define COMP_DECOMP_HPP_    4   // Version 4
 
-// int zlib_comp(std::string& output, const void *input, uInt input_size, int rate = 9);
-// int zlib_decomp(std::string& output, const void *input, uInt input_size);
+// class zlib_compressor;
+// class zlib_decompressor;
+// struct zlib_options;
+// int zlib_comp(T_BUFFER& output, const void *input, size_t input_size, int rate = 9,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, int rate = 9,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               const zlib_options& options, comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, const zlib_options& options,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                 size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// int zlib_decomp(void *output, size_t output_size, size_t& written,
+//                 const void *input, size_t input_size,
+//                 comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// size_t zlib_comp_bound(size_t input_size);
+// size_t zlib_comp_bound(size_t input_size, const zlib_options& options);
+// size_t zlib_expected_size(const void *input, size_t input_size);
+// int zlib_comp_mt(std::string& output, const void *input, size_t input_size,
+//                  int rate = 9, unsigned threads = 0, size_t block_size = 128 * 1024);
+// int zlib_comp_seekable(std::string& output, const void *input, size_t input_size,
+//                        int rate = 9, size_t block_size = 64 * 1024);
+// int zlib_decomp_range(T_BUFFER& output, const void *input, size_t input_size,
+//                       size_t offset, size_t length);
 // const char *zlib_errmsg(int ret);
 // bool zlib_unittest(void);
 #ifdef HAVE_ZLIB
     #include "comp_decomp_zlib.hpp"
 #endif  // def HAVE_ZLIB
 
-// int bzlib_comp(std::string& output, const void *input,
-//                unsigned int input_size, int rate = 9);
-// int bzlib_decomp(std::string& output, const void *input,
-//                  unsigned int input_size);
+// class bzlib_compressor;
+// class bzlib_decompressor;
+// struct bzlib_options;
+// int bzlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+//                int rate = 9, comp_decomp_allocator *allocator = NULL);
+// int bzlib_comp(void *output, size_t output_size, size_t& written,
+//                const void *input, size_t input_size, int rate = 9,
+//                comp_decomp_allocator *allocator = NULL);
+// int bzlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+//                const bzlib_options& options, comp_decomp_allocator *allocator = NULL);
+// int bzlib_comp(void *output, size_t output_size, size_t& written,
+//                const void *input, size_t input_size, const bzlib_options& options,
+//                comp_decomp_allocator *allocator = NULL);
+// int bzlib_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                  size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+//                  const comp_decomp_limits *limits = NULL);
+// int bzlib_decomp(void *output, size_t output_size, size_t& written,
+//                  const void *input, size_t input_size,
+//                  comp_decomp_allocator *allocator = NULL,
+//                  const comp_decomp_limits *limits = NULL);
+// size_t bzlib_comp_bound(size_t input_size);
+// int bzlib_comp_mt(std::string& output, const void *input, size_t input_size,
+//                   int rate = 9, unsigned threads = 0, size_t block_size = 0);
+// int bzlib_decomp_mt(std::string& output, const void *input,
+//                     size_t input_size, unsigned threads = 0);
 // const char *bzlib_errmsg(int ret);
 // bool bzlib_unittest(void);
 #ifdef HAVE_BZLIB
     #include "comp_decomp_bzlib.hpp"
 #endif  // def HAVE_BZLIB
 
-// lzma_ret lzma_comp(std::string& output, const void *input, size_t input_size, int rate = 9);
-// lzma_ret lzma_decomp(std::string& output, const void *input, size_t input_size);
-// const char *lzma_errmsg(lzma_ret ret);
+// class lzma_compressor;
+// class lzma_decompressor;
+// struct lzma_options;
+// int lzma_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               int rate = 9, comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, int rate = 9,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               const lzma_options& options, comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, const lzma_options& options,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                 size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// int lzma_decomp(void *output, size_t output_size, size_t& written,
+//                 const void *input, size_t input_size,
+//                 comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// size_t lzma_comp_bound(size_t input_size);
+// int lzma_store(T_BUFFER& output, const void *input, size_t input_size,
+//                lzma_check check = LZMA_CHECK_CRC64);
+// int lzma_store(void *output, size_t output_size, size_t& written,
+//                const void *input, size_t input_size,
+//                lzma_check check = LZMA_CHECK_CRC64);
+// int lzma_comp_mt(std::string& output, const void *input, size_t input_size,
+//                  int rate = 9, unsigned threads = 0, size_t block_size = 0);
+// int lzma_decomp_mt(std::string& output, const void *input,
+//                    size_t input_size, unsigned threads = 0);
+// int lzma_comp_seekable(std::string& output, const void *input, size_t input_size,
+//                        int rate = 9, size_t block_size = 1024 * 1024,
+//                        unsigned threads = 0);
+// int lzma_decomp_range(T_BUFFER& output, const void *input, size_t input_size,
+//                       size_t offset, size_t length);
+// lzma_ret lzma_decode_index(lzma_index **index, const void *input, size_t input_size);
+// size_t lzma_expected_size(const void *input, size_t input_size);
+// const char *lzma_errmsg(int ret);
 // bool lzma_unittest(void);
 #ifdef HAVE_LZMA
     #include "comp_decomp_lzma.hpp"
 #endif  // def HAVE_LZMA
 
+// struct comp_decomp_file_options;
+// comp_decomp_codec comp_decomp_codec_from_name(const char *filename);
+// int comp_file(const char *src, const char *dst,
+//               comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE, int rate = 9,
+//               const comp_decomp_file_options& options = comp_decomp_file_options());
+// int decomp_file(const char *src, const char *dst,
+//                 comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+//                 const comp_decomp_file_options& options = comp_decomp_file_options());
+// const char *comp_decomp_errmsg(comp_decomp_codec codec, int ret);
+// bool file_unittest(void);
+#include "comp_decomp_file.hpp"
+
+// struct auto_policy;
+// class auto_cache;
+// class auto_compressor;
+// int auto_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               const auto_policy& policy = auto_policy(), const char *data_class = NULL);
+// int auto_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                 size_t size_hint = 0);
+// bool auto_unittest(void);
+#include "comp_decomp_auto.hpp"
+
+// struct comp_decomp_span;
+// struct comp_decomp_batch;
+// int comp_decomp_comp_batch(T_COMPRESSOR& compressor, size_t (*bound)(size_t),
+//                            comp_decomp_batch& output,
+//                            const comp_decomp_span *inputs, size_t count);
+// int comp_decomp_decomp_batch(T_DECOMPRESSOR& decompressor, comp_decomp_batch& output,
+//                              const comp_decomp_batch& input);
+// int zlib_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+//                     size_t count, int rate = 9);
+// int zlib_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input);
+// int bzlib_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+//                      size_t count, int rate = 9);
+// int bzlib_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input);
+// int lzma_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+//                     size_t count, int rate = 9);
+// int lzma_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input);
+// bool batch_unittest(void);
+#include "comp_decomp_batch.hpp"
+
+// class comp_decomp_ring<T>;
+// struct comp_decomp_pipeline_options;
+// struct comp_decomp_pipeline_stats;
+// int comp_file_pipelined(const char *src, const char *dst,
+//                         comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE, int rate = 9,
+//                         const comp_decomp_pipeline_options& options = ...,
+//                         comp_decomp_pipeline_stats *stats = NULL);
+// int decomp_file_pipelined(const char *src, const char *dst,
+//                           comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+//                           const comp_decomp_pipeline_options& options = ...,
+//                           comp_decomp_pipeline_stats *stats = NULL);
+// bool pipeline_unittest(void);
+#include "comp_decomp_pipeline.hpp"
+
+// struct comp_decomp_verify_options;
+// struct comp_decomp_verify_result;
+// uint32_t comp_decomp_crc32(uint32_t crc, const void *data, size_t size);
+// int comp_decomp_verify(comp_decomp_codec codec, const void *input, size_t input_size,
+//                        comp_decomp_verify_result& result,
+//                        const comp_decomp_verify_options& options = ...);
+// int verify_file(const char *src, comp_decomp_verify_result& result,
+//                 comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+//                 const comp_decomp_verify_options& options = ...);
+// int verify_files(const std::vector<std::string>& srcs,
+//                  std::vector<comp_decomp_verify_result>& results,
+//                  const comp_decomp_verify_options& options = ...);
+// bool verify_unittest(void);
+#include "comp_decomp_verify.hpp"
+
+// enum comp_decomp_check;
+// struct comp_decomp_probe_result;
+// int comp_decomp_probe(const void *input, size_t input_size,
+//                       comp_decomp_probe_result& result);
+// int probe_file(const char *src, comp_decomp_probe_result& result);
+// bool probe_unittest(void);
+#include "comp_decomp_probe.hpp"
+
+// class comp_decomp_stepper<T_CODER>;
+// bool step_unittest(void);
+#include "comp_decomp_step.hpp"
+
 #endif  // ndef COMP_DECOMP_HPP_
@@ -0,0 +1,509 @@
+// comp_decomp_auto.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_AUTO_HPP_
+#define COMP_DECOMP_AUTO_HPP_
+
+#include "comp_decomp_common.hpp"
+#ifdef HAVE_ZLIB
+    #include "comp_decomp_zlib.hpp"
+#endif
+#ifdef HAVE_BZLIB
+    #include "comp_decomp_bzlib.hpp"
+#endif
+#ifdef HAVE_LZMA
+    #include "comp_decomp_lzma.hpp"
+#endif
+
+#include <chrono>
+#include <map>
+#include <mutex>
+
+// struct auto_policy;
+// class auto_cache;
+// class auto_compressor;
+// int auto_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               const auto_policy& policy = auto_policy(), const char *data_class = NULL);
+// int auto_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                 size_t size_hint = 0);
+// bool auto_unittest(void);
+
+// What auto_comp optimizes for. Among the candidates that keep the limits,
+// the one with the best ratio wins. If none does, the fastest one wins.
+struct auto_policy
+{
+    double min_speed;       // MB/s that compression must reach (0: any)
+    double max_time;        // milliseconds the whole input may take (0: any)
+    size_t sample_size;     // bytes of input to trial-compress
+
+    auto_policy() : min_speed(0), max_time(0), sample_size(64 * 1024)
+    {
+    }
+
+    // "at least mb_per_sec MB/s"
+    static auto_policy at_least(double mb_per_sec)
+    {
+        auto_policy policy;
+        policy.min_speed = mb_per_sec;
+        return policy;
+    }
+
+    // "best ratio within millisec ms"
+    static auto_policy within(double millisec)
+    {
+        auto_policy policy;
+        policy.max_time = millisec;
+        return policy;
+    }
+};
+
+// Compresses with codec at rate into the output_size bytes at output.
+inline int comp_decomp_comp(comp_decomp_codec codec, int rate,
+                            void *output, size_t output_size, size_t& written,
+                            const void *input, size_t input_size)
+{
+    written = 0;
+    switch (codec)
+    {
+#ifdef HAVE_ZLIB
+    case COMP_DECOMP_CODEC_ZLIB:
+        return zlib_comp(output, output_size, written, input, input_size, rate);
+#endif
+#ifdef HAVE_BZLIB
+    case COMP_DECOMP_CODEC_BZLIB:
+        return bzlib_comp(output, output_size, written, input, input_size, rate);
+#endif
+#ifdef HAVE_LZMA
+    case COMP_DECOMP_CODEC_LZMA:
+        return lzma_comp(output, output_size, written, input, input_size, rate);
+#endif
+    default:
+        return COMP_DECOMP_CODEC_ERROR;
+    }
+}
+
+// The most bytes comp_decomp_comp can write with codec, or 0.
+inline size_t comp_decomp_comp_bound(comp_decomp_codec codec, size_t input_size)
+{
+    switch (codec)
+    {
+#ifdef HAVE_ZLIB
+    case COMP_DECOMP_CODEC_ZLIB: return zlib_comp_bound(input_size);
+#endif
+#ifdef HAVE_BZLIB
+    case COMP_DECOMP_CODEC_BZLIB: return bzlib_comp_bound(input_size);
+#endif
+#ifdef HAVE_LZMA
+    case COMP_DECOMP_CODEC_LZMA: return lzma_comp_bound(input_size);
+#endif
+    default: return 0;
+    }
+}
+
+template <typename T_BUFFER>
+inline int comp_decomp_decomp(comp_decomp_codec codec, T_BUFFER& output,
+                              const void *input, size_t input_size, size_t size_hint = 0)
+{
+    switch (codec)
+    {
+#ifdef HAVE_ZLIB
+    case COMP_DECOMP_CODEC_ZLIB:
+        return zlib_decomp(output, input, input_size, size_hint);
+#endif
+#ifdef HAVE_BZLIB
+    case COMP_DECOMP_CODEC_BZLIB:
+        return bzlib_decomp(output, input, input_size, size_hint);
+#endif
+#ifdef HAVE_LZMA
+    case COMP_DECOMP_CODEC_LZMA:
+        return lzma_decomp(output, input, input_size, size_hint);
+#endif
+    default:
+        output.clear();
+        return COMP_DECOMP_CODEC_ERROR;
+    }
+}
+
+// Remembers the choices of auto_comp per data class. A choice is made again
+// after max_uses uses, so that the cache follows changes in the data.
+// An object can be shared by threads.
+class auto_cache
+{
+public:
+    explicit auto_cache(size_t max_uses = 100, size_t max_entries = 256)
+        : m_max_uses(max_uses), m_max_entries(max_entries), m_hits(0), m_misses(0)
+    {
+    }
+
+    bool find(const std::string& key, comp_decomp_codec& codec, int& rate)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::map<std::string, entry_t>::iterator it = m_entries.find(key);
+        if (it == m_entries.end() || it->second.uses >= m_max_uses)
+        {
+            ++m_misses;
+            return false;
+        }
+        ++it->second.uses;
+        ++m_hits;
+        codec = it->second.codec;
+        rate = it->second.rate;
+        return true;
+    }
+
+    void store(const std::string& key, comp_decomp_codec codec, int rate)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_entries.size() >= m_max_entries && !m_entries.count(key))
+            m_entries.clear();
+        entry_t& entry = m_entries[key];
+        entry.codec = codec;
+        entry.rate = rate;
+        entry.uses = 0;
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_entries.clear();
+    }
+
+    size_t hits() const
+    {
+        return m_hits;
+    }
+
+    size_t misses() const
+    {
+        return m_misses;
+    }
+
+protected:
+    struct entry_t
+    {
+        comp_decomp_codec codec;
+        int rate;
+        size_t uses;
+    };
+    std::mutex m_mutex;
+    std::map<std::string, entry_t> m_entries;
+    size_t m_max_uses;
+    size_t m_max_entries;
+    std::atomic<size_t> m_hits;
+    std::atomic<size_t> m_misses;
+
+private:
+    auto_cache(const auto_cache&) = delete;
+    auto_cache& operator=(const auto_cache&) = delete;
+};
+
+// The cache that auto_comp uses.
+inline auto_cache& auto_default_cache()
+{
+    static auto_cache s_cache;
+    return s_cache;
+}
+
+// Picks a codec and a rate for the data by trial-compressing a sample with
+// each candidate, and writes the output with a one-byte tag (the
+// comp_decomp_codec value) in front, for auto_decomp. Input that looks
+// incompressible is copied as is, under COMP_DECOMP_CODEC_NONE.
+// An object must not be used by two threads at once.
+class auto_compressor
+{
+public:
+    explicit auto_compressor(const auto_policy& policy = auto_policy(),
+                             auto_cache *cache = &auto_default_cache())
+        : m_policy(policy), m_cache(cache), m_codec(COMP_DECOMP_CODEC_NONE), m_rate(0)
+    {
+    }
+
+    // Data of the same data_class (if given) share one choice.
+    template <typename T_BUFFER>
+    int comp(T_BUFFER& output, const void *input, size_t input_size,
+             const char *data_class = NULL)
+    {
+        output.clear();
+
+        if (comp_decomp_incompressible(input, input_size))
+        {
+            m_codec = COMP_DECOMP_CODEC_NONE;
+            output.resize(1 + input_size);
+            output[0] = (char)m_codec;
+            memcpy(&output[1], input, input_size);
+            return 0;
+        }
+
+        std::string key;
+        if (data_class && m_cache)
+        {
+            char buf[64];
+            sprintf(buf, "/%g/%g/%lu", m_policy.min_speed, m_policy.max_time,
+                    (unsigned long)m_policy.sample_size);
+            key = data_class;
+            key += buf;
+        }
+        if (key.empty() || !m_cache->find(key, m_codec, m_rate))
+        {
+            choose(input, input_size);
+            if (!key.empty() && m_codec != COMP_DECOMP_CODEC_NONE)
+                m_cache->store(key, m_codec, m_rate);
+        }
+        if (m_codec == COMP_DECOMP_CODEC_NONE)
+            return COMP_DECOMP_CODEC_ERROR;
+
+        size_t bound = comp_decomp_comp_bound(m_codec, input_size);
+        output.resize(1 + bound);
+        output[0] = (char)m_codec;
+
+        size_t written;
+        int ret = comp_decomp_comp(m_codec, m_rate, &output[1], bound, written,
+                                   input, input_size);
+        output.resize(ret ? 0 : 1 + written);
+        return ret;
+    }
+
+    // The choice of the last comp().
+    comp_decomp_codec codec() const
+    {
+        return m_codec;
+    }
+
+    int rate() const
+    {
+        return m_rate;
+    }
+
+protected:
+    auto_policy m_policy;
+    auto_cache *m_cache;
+    comp_decomp_codec m_codec;
+    int m_rate;
+
+    // Samples a few slices spread over the input.
+    void make_sample(std::string& sample, const void *input, size_t input_size)
+    {
+        const char *ptr = (const char *)input;
+        if (input_size <= m_policy.sample_size)
+        {
+            sample.assign(ptr, input_size);
+            return;
+        }
+
+        const size_t slices = 4;
+        size_t slice = m_policy.sample_size / slices;
+        size_t step = (input_size - slice) / (slices - 1);
+        sample.clear();
+        for (size_t i = 0; i < slices; ++i)
+        {
+            sample.append(ptr + i * step, slice);
+        }
+    }
+
+    void choose(const void *input, size_t input_size)
+    {
+        static const struct
+        {
+            comp_decomp_codec codec;
+            int rate;
+        } candidates[] =
+        {
+            { COMP_DECOMP_CODEC_ZLIB, 1 },
+            { COMP_DECOMP_CODEC_ZLIB, 6 },
+            { COMP_DECOMP_CODEC_ZLIB, 9 },
+            { COMP_DECOMP_CODEC_BZLIB, 9 },
+            { COMP_DECOMP_CODEC_LZMA, 1 },
+            { COMP_DECOMP_CODEC_LZMA, 6 },
+        };
+
+        std::string sample, buffer;
+        make_sample(sample, input, input_size);
+        if (sample.empty())
+            sample.assign(1, 0);
+
+        double best_ratio = 0, best_speed = 0, fastest_speed = 0;
+        comp_decomp_codec slow_codec = COMP_DECOMP_CODEC_NONE;
+        m_codec = COMP_DECOMP_CODEC_NONE;
+        m_rate = 0;
+        comp_decomp_codec fastest_codec = COMP_DECOMP_CODEC_NONE;
+        int fastest_rate = 0;
+
+        for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); ++i)
+        {
+            comp_decomp_codec codec = candidates[i].codec;
+            int rate = candidates[i].rate;
+
+            // a higher rate of a codec that is already too slow won't do
+            if (codec == slow_codec)
+                continue;
+
+            size_t bound = comp_decomp_comp_bound(codec, sample.size());
+            if (bound == 0)
+                continue;
+            buffer.resize(bound);
+
+            size_t written;
+            std::chrono::steady_clock::time_point time1 = std::chrono::steady_clock::now();
+            int ret = comp_decomp_comp(codec, rate, &buffer[0], bound, written,
+                                       sample.data(), sample.size());
+            double sec = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - time1).count();
+            if (ret)
+                continue;
+
+            double speed = sample.size() / (1024.0 * 1024.0) / (sec > 1e-9 ? sec : 1e-9);
+            double ratio = (double)sample.size() / (written ? written : 1);
+            if (speed > fastest_speed)
+            {
+                fastest_speed = speed;
+                fastest_codec = codec;
+                fastest_rate = rate;
+            }
+
+            bool ok = true;
+            if (m_policy.min_speed > 0 && speed < m_policy.min_speed)
+                ok = false;
+            if (m_policy.max_time > 0 &&
+                input_size / (1024.0 * 1024.0) / speed * 1000 > m_policy.max_time)
+            {
+                ok = false;
+            }
+            if (!ok)
+            {
+                slow_codec = codec;
+                continue;
+            }
+
+            if (ratio > best_ratio || (ratio == best_ratio && speed > best_speed))
+            {
+                best_ratio = ratio;
+                best_speed = speed;
+                m_codec = codec;
+                m_rate = rate;
+            }
+        }
+
+        if (m_codec == COMP_DECOMP_CODEC_NONE)
+        {
+            m_codec = fastest_codec;
+            m_rate = fastest_rate;
+        }
+    }
+
+private:
+    auto_compressor(const auto_compressor&) = delete;
+    auto_compressor& operator=(const auto_compressor&) = delete;
+};
+
+template <typename T_BUFFER>
+inline int auto_comp(T_BUFFER& output, const void *input, size_t input_size,
+                     const auto_policy& policy = auto_policy(), const char *data_class = NULL)
+{
+    auto_compressor compressor(policy);
+    return compressor.comp(output, input, input_size, data_class);
+}
+
+// Decompresses the output of auto_comp with the codec its tag names, or
+// copies it for COMP_DECOMP_CODEC_NONE.
+// Returns COMP_DECOMP_CODEC_ERROR for an unknown tag.
+template <typename T_BUFFER>
+inline int auto_decomp(T_BUFFER& output, const void *input, size_t input_size,
+                       size_t size_hint = 0)
+{
+    const unsigned char *ptr = (const unsigned char *)input;
+    if (input_size == 0)
+    {
+        output.clear();
+        return COMP_DECOMP_CODEC_ERROR;
+    }
+    if (ptr[0] == COMP_DECOMP_CODEC_NONE)
+    {
+        output.resize(input_size - 1);
+        if (input_size > 1)
+            memcpy(&output[0], ptr + 1, input_size - 1);
+        return 0;
+    }
+    return comp_decomp_decomp((comp_decomp_codec)ptr[0], output, ptr + 1,
+                              input_size - 1, size_hint);
+}
+
+inline bool auto_test_entry(const std::string& original, const auto_policy& policy,
+                            const char *data_class)
+{
+    auto_compressor compressor(policy);
+    std::string encoded, decoded;
+    if (int ret = compressor.comp(encoded, original.data(), original.size(), data_class))
+    {
+        printf("auto_compressor failed (codec %d): %d\n", (int)compressor.codec(), ret);
+        return false;
+    }
+    if (int ret = auto_decomp(decoded, encoded.data(), encoded.size()))
+    {
+        printf("auto_decomp failed (codec %d): %d\n", (int)compressor.codec(), ret);
+        return false;
+    }
+    if (!(original == decoded) || encoded[0] != (char)compressor.codec())
+    {
+        printf("auto mismatch\n");
+        return false;
+    }
+    return true;
+}
+
+inline bool auto_unittest(void)
+{
+    std::string original;
+    for (size_t i = 0; i < 20000; ++i)
+    {
+        original += (char)('a' + std::rand() % 8);
+    }
+
+    // no candidate is that fast, so the fastest one is taken
+    if (!auto_test_entry(original, auto_policy::at_least(1e12), NULL))
+        return false;
+    if (!auto_test_entry(original, auto_policy::within(1e6), NULL))
+        return false;
+    if (!auto_test_entry(std::string(), auto_policy(), NULL))
+        return false;
+
+    // random data is stored under COMP_DECOMP_CODEC_NONE
+    std::string noise;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        noise += (char)std::rand();
+    }
+    if (!auto_test_entry(noise, auto_policy(), NULL))
+        return false;
+    auto_compressor stored;
+    std::string encoded;
+    if (stored.comp(encoded, noise.data(), noise.size()) ||
+        encoded.size() != 1 + noise.size() || stored.codec() != COMP_DECOMP_CODEC_NONE)
+    {
+        printf("auto_compressor did not store random data\n");
+        return false;
+    }
+
+    // the second call of a data class uses the cached choice
+    auto_cache& cache = auto_default_cache();
+    size_t hits = cache.hits();
+    if (!auto_test_entry(original, auto_policy::within(1e6), "auto_unittest"))
+        return false;
+    if (!auto_test_entry(original, auto_policy::within(1e6), "auto_unittest"))
+        return false;
+    if (cache.hits() != hits + 1)
+    {
+        printf("auto_cache missed\n");
+        return false;
+    }
+
+    std::string decoded;
+    const char bad[] = "\x7F" "data";
+    if (auto_decomp(decoded, bad, sizeof(bad) - 1) != COMP_DECOMP_CODEC_ERROR)
+    {
+        printf("auto_decomp accepted a bad tag\n");
+        return false;
+    }
+    return true;
+}
+
+#endif  // ndef COMP_DECOMP_AUTO_HPP_
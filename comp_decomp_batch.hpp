@@ -0,0 +1,282 @@
+// comp_decomp_batch.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_BATCH_HPP_
+#define COMP_DECOMP_BATCH_HPP_
+
+#include "comp_decomp_common.hpp"
+#ifdef HAVE_ZLIB
+    #include "comp_decomp_zlib.hpp"
+#endif
+#ifdef HAVE_BZLIB
+    #include "comp_decomp_bzlib.hpp"
+#endif
+#ifdef HAVE_LZMA
+    #include "comp_decomp_lzma.hpp"
+#endif
+
+// struct comp_decomp_span;
+// struct comp_decomp_batch;
+// int comp_decomp_comp_batch(T_COMPRESSOR& compressor, size_t (*bound)(size_t),
+//                            comp_decomp_batch& output,
+//                            const comp_decomp_span *inputs, size_t count);
+// int comp_decomp_decomp_batch(T_DECOMPRESSOR& decompressor, comp_decomp_batch& output,
+//                              const comp_decomp_batch& input);
+// int zlib_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+//                     size_t count, int rate = 9);
+// int zlib_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input);
+// int bzlib_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+//                      size_t count, int rate = 9);
+// int bzlib_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input);
+// int lzma_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+//                     size_t count, int rate = 9);
+// int lzma_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input);
+// bool batch_unittest(void);
+
+// A record to compress.
+struct comp_decomp_span
+{
+    const void *data;
+    size_t size;
+
+    comp_decomp_span() : data(NULL), size(0)
+    {
+    }
+
+    comp_decomp_span(const void *data_, size_t size_) : data(data_), size(size_)
+    {
+    }
+};
+
+// Records stored back to back in one buffer. Record i is the sizes[i]
+// bytes at offsets[i] in data.
+struct comp_decomp_batch
+{
+    std::string data;
+    std::vector<size_t> offsets;
+    std::vector<size_t> sizes;
+
+    size_t count() const
+    {
+        return sizes.size();
+    }
+
+    const char *record(size_t i) const
+    {
+        return data.data() + offsets[i];
+    }
+
+    void clear()
+    {
+        data.clear();
+        offsets.clear();
+        sizes.clear();
+    }
+};
+
+// Compresses count records with one compressor into output, each as a
+// stream of its own. The buffer is reserved once from the bounds of all the
+// records, so the records are compressed in place without copies. Returns
+// the codec's status; on failure output holds the records done before.
+template <typename T_COMPRESSOR>
+inline int comp_decomp_comp_batch(T_COMPRESSOR& compressor, size_t (*bound)(size_t),
+                                  comp_decomp_batch& output,
+                                  const comp_decomp_span *inputs, size_t count)
+{
+    output.clear();
+    output.offsets.reserve(count);
+    output.sizes.reserve(count);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        total += bound(inputs[i].size);
+    }
+    comp_decomp_reserve(output.data, total);
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        output.data.resize(used + bound(inputs[i].size));
+
+        size_t written;
+        int ret = (int)compressor.comp(&output.data[used], output.data.size() - used, written,
+                                       inputs[i].data, inputs[i].size);
+        if (ret != 0)
+        {
+            output.data.resize(used);
+            return ret;
+        }
+        output.offsets.push_back(used);
+        output.sizes.push_back(written);
+        used += written;
+    }
+    output.data.resize(used);
+    return 0;
+}
+
+// Decompresses the records of input with one decompressor into output.
+// The buffer starts at three times the input and doubles when a record
+// does not fit, which decodes that record again.
+template <typename T_DECOMPRESSOR>
+inline int comp_decomp_decomp_batch(T_DECOMPRESSOR& decompressor, comp_decomp_batch& output,
+                                    const comp_decomp_batch& input)
+{
+    output.clear();
+    output.offsets.reserve(input.count());
+    output.sizes.reserve(input.count());
+    output.data.resize(input.data.size() * 3 + COMP_DECOMP_BUFFSIZE);
+
+    size_t used = 0;
+    for (size_t i = 0; i < input.count(); ++i)
+    {
+        for (;;)
+        {
+            size_t written;
+            int ret = (int)decompressor.decomp(&output.data[used], output.data.size() - used,
+                                               written, input.record(i), input.sizes[i]);
+            if (ret == 0)
+            {
+                output.offsets.push_back(used);
+                output.sizes.push_back(written);
+                used += written;
+                break;
+            }
+            if (ret != COMP_DECOMP_SPACE_ERROR)
+            {
+                output.data.resize(used);
+                return ret;
+            }
+            COMP_DECOMP_COPIED(used);
+            output.data.resize(output.data.size() * 2);
+        }
+    }
+    output.data.resize(used);
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+    inline int zlib_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+                               size_t count, int rate = 9)
+    {
+        zlib_compressor compressor(rate);
+        return comp_decomp_comp_batch(compressor, zlib_comp_bound, output, inputs, count);
+    }
+
+    inline int zlib_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input)
+    {
+        zlib_decompressor decompressor;
+        return comp_decomp_decomp_batch(decompressor, output, input);
+    }
+#endif
+
+#ifdef HAVE_BZLIB
+    inline int bzlib_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+                                size_t count, int rate = 9)
+    {
+        bzlib_compressor compressor(rate);
+        return comp_decomp_comp_batch(compressor, bzlib_comp_bound, output, inputs, count);
+    }
+
+    inline int bzlib_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input)
+    {
+        bzlib_decompressor decompressor;
+        return comp_decomp_decomp_batch(decompressor, output, input);
+    }
+#endif
+
+#ifdef HAVE_LZMA
+    inline int lzma_comp_batch(comp_decomp_batch& output, const comp_decomp_span *inputs,
+                               size_t count, int rate = 9)
+    {
+        lzma_compressor compressor(rate);
+        return comp_decomp_comp_batch(compressor, lzma_comp_bound, output, inputs, count);
+    }
+
+    inline int lzma_decomp_batch(comp_decomp_batch& output, const comp_decomp_batch& input)
+    {
+        lzma_decompressor decompressor;
+        return comp_decomp_decomp_batch(decompressor, output, input);
+    }
+#endif
+
+template <typename T_COMP, typename T_DECOMP>
+inline bool batch_test_entry(const char *name, T_COMP comp, T_DECOMP decomp,
+                             const std::vector<std::string>& records)
+{
+    std::vector<comp_decomp_span> spans;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        spans.push_back(comp_decomp_span(records[i].data(), records[i].size()));
+    }
+
+    comp_decomp_batch encoded, decoded;
+    if (int ret = comp(encoded, spans.empty() ? NULL : &spans[0], spans.size()))
+    {
+        printf("%s batch compression failed: %d\n", name, ret);
+        return false;
+    }
+    if (int ret = decomp(decoded, encoded))
+    {
+        printf("%s batch decompression failed: %d\n", name, ret);
+        return false;
+    }
+    if (encoded.count() != records.size() || decoded.count() != records.size())
+    {
+        printf("%s batch count mismatch\n", name);
+        return false;
+    }
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        if (decoded.sizes[i] != records[i].size() ||
+            memcmp(decoded.record(i), records[i].data(), records[i].size()) != 0)
+        {
+            printf("%s batch mismatch at %d\n", name, (int)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool batch_unittest(void)
+{
+    // small records, an empty one and one that makes the output grow
+    std::vector<std::string> records;
+    for (size_t i = 0; i < 50; ++i)
+    {
+        std::string record;
+        size_t len = std::rand() % 200;
+        for (size_t k = 0; k < len; ++k)
+        {
+            record += (char)('a' + std::rand() % 4);
+        }
+        records.push_back(record);
+    }
+    records.push_back(std::string());
+    records.push_back(std::string(100000, 'A'));
+
+    bool ok = true;
+#ifdef HAVE_ZLIB
+    ok = ok && batch_test_entry("zlib", [](comp_decomp_batch& output,
+                                           const comp_decomp_span *inputs, size_t count) {
+        return zlib_comp_batch(output, inputs, count);
+    }, zlib_decomp_batch, records);
+#endif
+#ifdef HAVE_BZLIB
+    ok = ok && batch_test_entry("bzlib", [](comp_decomp_batch& output,
+                                            const comp_decomp_span *inputs, size_t count) {
+        return bzlib_comp_batch(output, inputs, count);
+    }, bzlib_decomp_batch, records);
+#endif
+#ifdef HAVE_LZMA
+    ok = ok && batch_test_entry("lzma", [](comp_decomp_batch& output,
+                                           const comp_decomp_span *inputs, size_t count) {
+        return lzma_comp_batch(output, inputs, count);
+    }, [](comp_decomp_batch& output, const comp_decomp_batch& input) {
+        return lzma_decomp_batch(output, input);
+    }, records);
+#endif
+    return ok;
+}
+
+#endif  // ndef COMP_DECOMP_BATCH_HPP_
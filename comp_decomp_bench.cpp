@@ -0,0 +1,563 @@
+// comp_decomp_bench.cpp --- benchmarks on generated corpora
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+//
+// usage: comp_decomp_bench [--sizes 1K,64K,1M] [--corpora text,json,binary,random,repeat]
+//                          [--codecs zlib,bzlib,lzma] [--levels 1,2,...,9]
+//                          [--buffsizes 8K,1M] [--min-time 0.2] [--out results.json]
+//
+// Every corpus is generated from a fixed seed, so two runs see the same
+// bytes. The results are written as JSON, one record per line in a fixed
+// key order, so that the outputs of two runs can be diffed. Build with
+// CMAKE_BUILD_TYPE=Release for meaningful numbers.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#ifdef __linux__
+    #include <fstream>
+#endif
+#ifndef _WIN32
+    #include <sys/resource.h>
+#endif
+
+// The mt rows copy from several threads at once.
+static std::atomic<size_t> g_copied(0);
+#define COMP_DECOMP_COPIED(size) (g_copied += (size))
+#include "comp_decomp.hpp"
+
+namespace cr = std::chrono;
+typedef cr::high_resolution_clock my_clock;
+
+//////////////////////////////////////////////////////////////////////////////
+// allocation counting
+
+static std::atomic<size_t> g_allocs(0);
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+    // glibc lets the program replace malloc and friends. This catches the
+    // allocations of zlib, bzip2 and liblzma as well as operator new.
+    extern "C"
+    {
+        void *__libc_malloc(size_t size);
+        void *__libc_calloc(size_t n, size_t size);
+        void *__libc_realloc(void *ptr, size_t size);
+        void __libc_free(void *ptr);
+
+        void *malloc(size_t size)
+        {
+            ++g_allocs;
+            return __libc_malloc(size);
+        }
+
+        void *calloc(size_t n, size_t size)
+        {
+            ++g_allocs;
+            return __libc_calloc(n, size);
+        }
+
+        void *realloc(void *ptr, size_t size)
+        {
+            ++g_allocs;
+            return __libc_realloc(ptr, size);
+        }
+
+        void free(void *ptr)
+        {
+            __libc_free(ptr);
+        }
+    }
+    #define ALLOCS_COUNTED true
+#else
+    #define ALLOCS_COUNTED false
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// peak RSS
+
+// Starts a new peak RSS measurement where the system allows it.
+static void reset_peak_rss(void)
+{
+#ifdef __linux__
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+// The peak RSS in KiB since reset_peak_rss (since the start, where it
+// cannot be reset).
+static size_t peak_rss_kb(void)
+{
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return (size_t)strtoul(line.c_str() + 6, NULL, 10);
+    }
+    return 0;
+#elif defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    #ifdef __APPLE__
+        return (size_t)usage.ru_maxrss / 1024;
+    #else
+        return (size_t)usage.ru_maxrss;
+    #endif
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// corpora
+
+struct xorshift
+{
+    uint64_t state;
+
+    explicit xorshift(uint64_t seed) : state(seed)
+    {
+    }
+
+    uint64_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+};
+
+static const char *s_words[] =
+{
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "compress",
+    "decompress", "stream", "buffer", "window", "block", "index", "level",
+    "of", "and", "a", "to", "in", "is", "that", "it", "for", "on", "with",
+};
+static const size_t s_word_count = sizeof(s_words) / sizeof(s_words[0]);
+
+static std::string make_text(size_t size)
+{
+    xorshift rng(2463534242U);
+    std::string ret;
+    ret.reserve(size + 64);
+    while (ret.size() < size)
+    {
+        uint64_t r = rng.next();
+        ret += s_words[(r >> 8) % s_word_count];
+        ret += ((r & 0x1F) == 0) ? ".\n" : ((r & 0x7) == 0) ? ", " : " ";
+    }
+    ret.resize(size);
+    return ret;
+}
+
+static std::string make_json(size_t size)
+{
+    xorshift rng(88172645463325252ULL);
+    std::string ret;
+    ret.reserve(size + 256);
+    ret += "[\n";
+    for (unsigned long id = 1; ret.size() < size; ++id)
+    {
+        uint64_t r = rng.next();
+        char buf[256];
+        sprintf(buf, "  {\"id\": %lu, \"name\": \"%s %s\", \"active\": %s, "
+                     "\"score\": %lu.%02lu, \"tags\": [\"%s\", \"%s\"]},\n",
+                id, s_words[r % s_word_count], s_words[(r >> 8) % s_word_count],
+                ((r >> 16) & 1) ? "true" : "false",
+                (unsigned long)((r >> 20) % 1000), (unsigned long)((r >> 32) % 100),
+                s_words[(r >> 40) % s_word_count], s_words[(r >> 48) % s_word_count]);
+        ret += buf;
+    }
+    ret.resize(size);
+    return ret;
+}
+
+// Records of a table dump: a counter, small numbers and floats.
+static std::string make_binary(size_t size)
+{
+    xorshift rng(1181783497276652981ULL);
+    std::string ret;
+    ret.reserve(size + 32);
+    for (uint32_t id = 0; ret.size() < size; ++id)
+    {
+        uint64_t r = rng.next();
+        uint32_t fields[4] = { id, (uint32_t)(r % 100), (uint32_t)(r >> 40) & 0xFFFF, 0 };
+        float value = (float)(r % 100000) / 100;
+        memcpy(&fields[3], &value, sizeof(value));
+        ret.append((const char *)fields, sizeof(fields));
+    }
+    ret.resize(size);
+    return ret;
+}
+
+static std::string make_random(size_t size)
+{
+    xorshift rng(0x9E3779B97F4A7C15ULL);
+    std::string ret(size, 0);
+    for (size_t i = 0; i < size; i += 8)
+    {
+        uint64_t r = rng.next();
+        memcpy(&ret[i], &r, (size - i < 8) ? size - i : 8);
+    }
+    return ret;
+}
+
+// A short line repeated, with a changing number now and then.
+static std::string make_repeat(size_t size)
+{
+    std::string ret;
+    ret.reserve(size + 64);
+    for (unsigned long i = 0; ret.size() < size; ++i)
+    {
+        ret += "GET /index.html HTTP/1.1 200 ";
+        if (i % 64 == 0)
+        {
+            char buf[32];
+            sprintf(buf, "%lu", i);
+            ret += buf;
+        }
+        ret += '\n';
+    }
+    ret.resize(size);
+    return ret;
+}
+
+struct corpus_t
+{
+    const char *name;
+    std::string (*make)(size_t size);
+};
+
+static const corpus_t s_corpora[] =
+{
+    { "text", make_text },
+    { "json", make_json },
+    { "binary", make_binary },
+    { "random", make_random },
+    { "repeat", make_repeat },
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// measurement
+
+struct measure_t
+{
+    double mb_per_sec;
+    size_t allocs;
+    size_t peak_rss_kb;
+    size_t copied;
+    bool ok;
+};
+
+// Runs fn until min_time seconds have passed. The allocations and copies
+// are those of the first (cold) call.
+template <typename T_FN>
+static measure_t measure(size_t bytes, double min_time, T_FN fn)
+{
+    measure_t m;
+    reset_peak_rss();
+
+    size_t allocs = g_allocs;
+    g_copied = 0;
+    auto time1 = my_clock::now();
+    m.ok = fn();
+    m.allocs = g_allocs - allocs;
+    m.copied = g_copied;
+
+    size_t count = 1;
+    double sec = cr::duration<double>(my_clock::now() - time1).count();
+    while (m.ok && sec < min_time)
+    {
+        m.ok = fn();
+        ++count;
+        sec = cr::duration<double>(my_clock::now() - time1).count();
+    }
+
+    m.mb_per_sec = (double)bytes * count / (sec * 1024 * 1024);
+    m.peak_rss_kb = peak_rss_kb();
+    return m;
+}
+
+struct options_t
+{
+    std::vector<size_t> sizes;
+    std::vector<std::string> corpora;
+    std::vector<std::string> codecs;
+    std::vector<int> levels;
+    std::vector<size_t> buffsizes;
+    double min_time;
+    FILE *out;
+};
+
+static bool wanted(const std::vector<std::string>& list, const char *name)
+{
+    for (size_t i = 0; i < list.size(); ++i)
+    {
+        if (list[i] == name)
+            return true;
+    }
+    return list.empty();
+}
+
+static void print_result(const options_t& opts, const char *corpus, size_t size,
+                         const char *codec, int level, const char *mode, size_t buffsize,
+                         size_t encoded, const measure_t& comp, const measure_t& decomp,
+                         size_t reallocs)
+{
+    static bool s_first = true;
+    fprintf(opts.out,
+        "%s\n  {\"corpus\": \"%s\", \"size\": %lu, \"codec\": \"%s\", \"level\": %d, "
+        "\"mode\": \"%s\", \"buffsize\": %lu, \"encoded\": %lu, \"ratio\": %.4f, "
+        "\"comp_mb_s\": %.2f, \"decomp_mb_s\": %.2f, "
+        "\"comp_allocs\": %lu, \"decomp_allocs\": %lu, "
+        "\"comp_peak_rss_kb\": %lu, \"decomp_peak_rss_kb\": %lu, "
+        "\"copied\": %lu, \"reallocs\": %lu, \"ok\": %s}",
+        s_first ? "" : ",", corpus, (unsigned long)size, codec, level, mode,
+        (unsigned long)buffsize, (unsigned long)encoded,
+        encoded ? (double)size / encoded : 0.0, comp.mb_per_sec, decomp.mb_per_sec,
+        (unsigned long)comp.allocs, (unsigned long)decomp.allocs,
+        (unsigned long)comp.peak_rss_kb, (unsigned long)decomp.peak_rss_kb,
+        (unsigned long)(comp.copied + decomp.copied), (unsigned long)reallocs,
+        (comp.ok && decomp.ok) ? "true" : "false");
+    fflush(opts.out);
+    s_first = false;
+
+    fprintf(stderr, "%-6s %-6s %9lu L%d %-7s %8lu  ratio %7.2f  comp %8.1f MB/s  "
+                    "decomp %8.1f MB/s%s\n",
+            corpus, codec, (unsigned long)size, level, mode, (unsigned long)buffsize,
+            encoded ? (double)size / encoded : 0.0, comp.mb_per_sec, decomp.mb_per_sec,
+            (comp.ok && decomp.ok) ? "" : "  FAILED");
+}
+
+// Benchmarks one codec at one level on one corpus: a one-shot call, the
+// streaming API with each buffer size, and the multithreaded functions.
+template <typename T_COMP, typename T_DECOMP, typename T_COMP_MT, typename T_DECOMP_MT>
+static void bench_codec(const options_t& opts, const char *corpus, const std::string& original,
+                        const char *codec, int level, T_COMP_MT comp_mt, T_DECOMP_MT decomp_mt)
+{
+    std::string encoded, decoded;
+
+    {
+        T_COMP compressor(level);
+        T_DECOMP decompressor;
+        measure_t comp = measure(original.size(), opts.min_time, [&]() {
+            return compressor.comp(encoded, original.data(), original.size()) == 0;
+        });
+        size_t reallocs = compressor.reallocs();
+        measure_t decomp = measure(original.size(), opts.min_time, [&]() {
+            return decompressor.decomp(decoded, encoded.data(), encoded.size()) == 0;
+        });
+        reallocs += decompressor.reallocs();
+        decomp.ok = decomp.ok && decoded == original;
+        print_result(opts, corpus, original.size(), codec, level, "oneshot", 0,
+                     encoded.size(), comp, decomp, reallocs);
+    }
+
+    for (size_t i = 0; i < opts.buffsizes.size(); ++i)
+    {
+        size_t buffsize = opts.buffsizes[i];
+        size_t encoded_size = 0, decoded_size = 0;
+        comp_decomp_sink count_encoded = [&](const void *, size_t size) {
+            encoded_size += size;
+            return true;
+        };
+        comp_decomp_sink count_decoded = [&](const void *, size_t size) {
+            decoded_size += size;
+            return true;
+        };
+
+        T_COMP compressor(level);
+        T_DECOMP decompressor;
+        measure_t comp = measure(original.size(), opts.min_time, [&]() {
+            encoded_size = 0;
+            return compressor.begin(count_encoded, buffsize) == 0 &&
+                   compressor.write(original.data(), original.size()) == 0 &&
+                   compressor.finish() == 0;
+        });
+        measure_t decomp = measure(original.size(), opts.min_time, [&]() {
+            decoded_size = 0;
+            return decompressor.begin(count_decoded, buffsize) == 0 &&
+                   decompressor.write(encoded.data(), encoded.size()) == 0 &&
+                   decompressor.finish() == 0;
+        });
+        decomp.ok = decomp.ok && decoded_size == original.size();
+        print_result(opts, corpus, original.size(), codec, level, "stream", buffsize,
+                     encoded_size, comp, decomp, 0);
+    }
+
+    {
+        measure_t comp = measure(original.size(), opts.min_time, [&]() {
+            return comp_mt(encoded, original, level) == 0;
+        });
+        measure_t decomp = measure(original.size(), opts.min_time, [&]() {
+            return decomp_mt(decoded, encoded) == 0;
+        });
+        decomp.ok = decomp.ok && decoded == original;
+        print_result(opts, corpus, original.size(), codec, level, "mt", 0,
+                     encoded.size(), comp, decomp, 0);
+    }
+}
+
+static void bench_corpus(const options_t& opts, const char *corpus, const std::string& original)
+{
+    for (size_t i = 0; i < opts.levels.size(); ++i)
+    {
+        int level = opts.levels[i];
+#ifdef HAVE_ZLIB
+        if (wanted(opts.codecs, "zlib"))
+        {
+            bench_codec<zlib_compressor, zlib_decompressor>(opts, corpus, original, "zlib", level,
+                [](std::string& output, const std::string& input, int rate) {
+                    return zlib_comp_mt(output, input.data(), input.size(), rate);
+                },
+                [](std::string& output, const std::string& input) {
+                    return zlib_decomp(output, input.data(), input.size());
+                });
+        }
+#endif
+#ifdef HAVE_BZLIB
+        if (wanted(opts.codecs, "bzlib"))
+        {
+            bench_codec<bzlib_compressor, bzlib_decompressor>(opts, corpus, original, "bzlib", level,
+                [](std::string& output, const std::string& input, int rate) {
+                    return bzlib_comp_mt(output, input.data(), input.size(), rate);
+                },
+                [](std::string& output, const std::string& input) {
+                    return bzlib_decomp_mt(output, input.data(), input.size());
+                });
+        }
+#endif
+#ifdef HAVE_LZMA
+        if (wanted(opts.codecs, "lzma"))
+        {
+            bench_codec<lzma_compressor, lzma_decompressor>(opts, corpus, original, "lzma", level,
+                [](std::string& output, const std::string& input, int rate) {
+                    return lzma_comp_mt(output, input.data(), input.size(), rate,
+                                        0, 1024 * 1024);
+                },
+                [](std::string& output, const std::string& input) {
+                    return lzma_decomp_mt(output, input.data(), input.size());
+                });
+        }
+#endif
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// "64K" -> 65536
+static size_t parse_size(const std::string& str)
+{
+    char *end;
+    size_t size = (size_t)strtoul(str.c_str(), &end, 10);
+    switch (*end)
+    {
+    case 'K': case 'k': return size << 10;
+    case 'M': case 'm': return size << 20;
+    case 'G': case 'g': return size << 30;
+    }
+    return size;
+}
+
+static std::vector<std::string> split(const char *str)
+{
+    std::vector<std::string> ret;
+    std::string item;
+    for (; *str; ++str)
+    {
+        if (*str == ',')
+        {
+            ret.push_back(item);
+            item.clear();
+        }
+        else
+        {
+            item += *str;
+        }
+    }
+    if (!item.empty())
+        ret.push_back(item);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    options_t opts;
+    opts.min_time = 0.2;
+    opts.out = stdout;
+
+    std::vector<std::string> sizes = split("1K,64K,1M");
+    std::vector<std::string> levels = split("1,2,3,4,5,6,7,8,9");
+    std::vector<std::string> buffsizes = split("8K,1M");
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "%s: missing value\n", argv[i]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (arg == "--sizes")
+            sizes = split(value);
+        else if (arg == "--corpora")
+            opts.corpora = split(value);
+        else if (arg == "--codecs")
+            opts.codecs = split(value);
+        else if (arg == "--levels")
+            levels = split(value);
+        else if (arg == "--buffsizes")
+            buffsizes = split(value);
+        else if (arg == "--min-time")
+            opts.min_time = atof(value);
+        else if (arg == "--out")
+        {
+            opts.out = fopen(value, "w");
+            if (!opts.out)
+            {
+                fprintf(stderr, "%s: cannot open\n", value);
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        opts.sizes.push_back(parse_size(sizes[i]));
+    }
+    for (size_t i = 0; i < levels.size(); ++i)
+    {
+        int level = atoi(levels[i].c_str());
+        if (1 <= level && level <= 9)
+            opts.levels.push_back(level);
+    }
+    for (size_t i = 0; i < buffsizes.size(); ++i)
+    {
+        opts.buffsizes.push_back(parse_size(buffsizes[i]));
+    }
+
+    fprintf(opts.out, "{\"allocs_counted\": %s, \"results\": [",
+            ALLOCS_COUNTED ? "true" : "false");
+    for (size_t i = 0; i < sizeof(s_corpora) / sizeof(s_corpora[0]); ++i)
+    {
+        if (!wanted(opts.corpora, s_corpora[i].name))
+            continue;
+        for (size_t k = 0; k < opts.sizes.size(); ++k)
+        {
+            std::string original = s_corpora[i].make(opts.sizes[k]);
+            bench_corpus(opts, s_corpora[i].name, original);
+        }
+    }
+    fprintf(opts.out, "\n]}\n");
+
+    if (opts.out != stdout)
+        fclose(opts.out);
+    return 0;
+}
@@ -4,125 +4,747 @@
 #ifndef COMP_DECOMP_BZLIB_HPP_
 #define COMP_DECOMP_BZLIB_HPP_
 
-#include <cstdlib>
-#include <cstdio>
-#include <cassert>
-#include <cstring>
-#include <string>
-
-#ifndef COMP_DECOMP_BUFFSIZE
-    #define COMP_DECOMP_BUFFSIZE (8 * 1024)
-#endif
+#include "comp_decomp_common.hpp"
 
-// int bzlib_comp(std::string& output, const void *input,
-//                unsigned int input_size, int rate = 9);
-// int bzlib_decomp(std::string& output, const void *input,
-//                  unsigned int input_size);
+// class bzlib_compressor;
+// class bzlib_decompressor;
+// struct bzlib_options;
+// int bzlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+//                int rate = 9, comp_decomp_allocator *allocator = NULL);
+// int bzlib_comp(void *output, size_t output_size, size_t& written,
+//                const void *input, size_t input_size, int rate = 9,
+//                comp_decomp_allocator *allocator = NULL);
+// int bzlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+//                const bzlib_options& options, comp_decomp_allocator *allocator = NULL);
+// int bzlib_comp(void *output, size_t output_size, size_t& written,
+//                const void *input, size_t input_size, const bzlib_options& options,
+//                comp_decomp_allocator *allocator = NULL);
+// int bzlib_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                  size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+//                  const comp_decomp_limits *limits = NULL);
+// int bzlib_decomp(void *output, size_t output_size, size_t& written,
+//                  const void *input, size_t input_size,
+//                  comp_decomp_allocator *allocator = NULL,
+//                  const comp_decomp_limits *limits = NULL);
+// size_t bzlib_comp_bound(size_t input_size);
+// int bzlib_comp_mt(std::string& output, const void *input, size_t input_size,
+//                   int rate = 9, unsigned threads = 0, size_t block_size = 0);
+// int bzlib_decomp_mt(std::string& output, const void *input,
+//                     size_t input_size, unsigned threads = 0);
 // const char *bzlib_errmsg(int ret);
 // bool bzlib_unittest(void);
 
 #ifdef HAVE_BZLIB
     #include <bzlib.h>
 
-    inline int bzlib_comp(std::string& output, const void *input,
-                          unsigned input_size, int rate = 9)
+    // The most bytes bzlib_comp can write for input_size bytes of input:
+    // the worst case that the bzip2 manual gives (1% more plus 600 bytes).
+    inline size_t bzlib_comp_bound(size_t input_size)
     {
-        output.clear();
-        output.reserve(input_size * 2 / 3);
-        static char inbuf[COMP_DECOMP_BUFFSIZE];
-        assert(1 <= rate && rate <= 9);
+        return input_size + input_size / 100 + 600;
+    }
 
-        bz_stream strm;
-        memset(&strm, 0, sizeof(strm));
-        strm.bzalloc = NULL;
-        strm.bzfree = NULL;
-        strm.opaque = NULL;
-        strm.next_in = (char *)input;
-        strm.avail_in = input_size;
+    // Tuning of bzlib_compressor beyond the rate (the block size in units of
+    // 100 KB). work_factor (1 to 250, 0 for the default of 30) is how much
+    // effort the block sort spends on repetitive data before it falls back
+    // to a slower algorithm that is steady on any data. small is for
+    // bzlib_decompressor: its slow mode of about 2.5 bytes of work memory
+    // per byte of block instead of 4.
+    struct bzlib_options
+    {
+        int rate;           // 1 to 9
+        int work_factor;
+        bool small;
 
-        int ret = BZ2_bzCompressInit(&strm, rate, 0, 0);
-        if (ret != BZ_OK)
-            return ret;
+        explicit bzlib_options(int rate_ = 9)
+            : rate(rate_), work_factor(0), small(false)
+        {
+        }
+
+        // 100 KB blocks, which sort faster than larger ones.
+        static bzlib_options fastest()
+        {
+            return bzlib_options(1);
+        }
+
+        // 100 KB blocks, decompressed in the small mode: about 1.2 MB of
+        // work memory to compress and 350 KB to decompress.
+        static bzlib_options low_memory()
+        {
+            bzlib_options options(1);
+            options.small = true;
+            return options;
+        }
+    };
+
+    inline void *bzlib_allocator_alloc(void *opaque, int n, int m)
+    {
+        return ((comp_decomp_allocator *)opaque)->alloc((size_t)n * m);
+    }
+
+    inline void bzlib_allocator_free(void *opaque, void *ptr)
+    {
+        ((comp_decomp_allocator *)opaque)->free(ptr);
+    }
+
+    // Makes strm take its work memory from allocator, or from pool if it
+    // is NULL.
+    inline void bzlib_set_allocator(bz_stream& strm, comp_decomp_allocator *allocator,
+                                    comp_decomp_pool& pool)
+    {
+        strm.bzalloc = bzlib_allocator_alloc;
+        strm.bzfree = bzlib_allocator_free;
+        strm.opaque = allocator ? allocator : &pool;
+    }
+
+    // bzip2 cannot reset a stream, so the stream is initialized again for
+    // each job and its work memory is recycled through allocator, or through
+    // a comp_decomp_pool of the object's own if it is NULL.
+    // Use comp() for a whole buffer, or begin()/write()/finish() to stream
+    // the compressed data to a sink in pieces of buffsize bytes.
+    // An object must not be used by two threads at once.
+    class bzlib_compressor
+    {
+    public:
+        explicit bzlib_compressor(int rate = 9, comp_decomp_allocator *allocator = NULL)
+            : bzlib_compressor(bzlib_options(rate), allocator)
+        {
+        }
 
-        output.resize(COMP_DECOMP_BUFFSIZE);
-        strm.next_out = (char *)output.data();
-        strm.avail_out = COMP_DECOMP_BUFFSIZE;
+        explicit bzlib_compressor(const bzlib_options& options,
+                                  comp_decomp_allocator *allocator = NULL)
+            : m_options(options), m_init(false), m_reallocs(0)
+        {
+            assert(1 <= options.rate && options.rate <= 9);
+            assert(0 <= options.work_factor && options.work_factor <= 250);
+            memset(&m_strm, 0, sizeof(m_strm));
+            bzlib_set_allocator(m_strm, allocator, m_pool);
+        }
 
-        int action = BZ_RUN;
-        ret = BZ_RUN_OK;
-        while (ret == BZ_RUN_OK || ret == BZ_FLUSH_OK || ret == BZ_FINISH_OK)
+        ~bzlib_compressor()
         {
-            if (strm.avail_in == 0)
+            if (m_init)
+                BZ2_bzCompressEnd(&m_strm);
+        }
+
+        // The output is reserved once, from bzlib_comp_bound.
+        template <typename T_BUFFER>
+        int comp(T_BUFFER& output, const void *input, size_t input_size)
+        {
+            output.clear();
+            m_reallocs = 0;
+            comp_decomp_reserve(output, bzlib_comp_bound(input_size));
+
+            int ret = reset();
+            if (ret != BZ_OK)
+                return ret;
+
+            comp_decomp_output out(output);
+            ret = code(out, input, input_size, BZ_FINISH);
+            m_reallocs = out.reallocs();
+            if (ret != BZ_STREAM_END)
             {
-                action = BZ_FINISH;
+                output.clear();
+                return ret;
             }
+            out.flush();
+            return BZ_OK;
+        }
 
-            if (strm.avail_out == 0)
+        // Compresses into the output_size bytes at output. Returns
+        // COMP_DECOMP_SPACE_ERROR if they are not enough, which never
+        // happens with bzlib_comp_bound(input_size) bytes.
+        int comp(void *output, size_t output_size, size_t& written,
+                 const void *input, size_t input_size)
+        {
+            written = 0;
+            m_reallocs = 0;
+
+            int ret = reset();
+            if (ret != BZ_OK)
+                return ret;
+
+            comp_decomp_output out(output, output_size);
+            ret = code(out, input, input_size, BZ_FINISH);
+            if (ret != BZ_STREAM_END)
+                return ret;
+            if (!out.flush())
+                return out.error();
+            written = out.used();
+            return BZ_OK;
+        }
+
+        int begin(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+        {
+            m_out.reset(sink, buffsize);
+            return reset();
+        }
+
+        int write(const void *input, size_t input_size)
+        {
+            int ret = code(m_out, input, input_size, BZ_RUN);
+            return (ret == BZ_RUN_OK) ? BZ_OK : ret;
+        }
+
+        int finish()
+        {
+            int ret = code(m_out, NULL, 0, BZ_FINISH);
+            if (ret != BZ_STREAM_END)
+                return ret;
+            return m_out.flush() ? BZ_OK : COMP_DECOMP_SINK_ERROR;
+        }
+
+        // How many times the output of the last comp() was reallocated.
+        size_t reallocs() const
+        {
+            return m_reallocs;
+        }
+
+    protected:
+        bzlib_options m_options;
+        bool m_init;
+        size_t m_reallocs;
+        comp_decomp_pool m_pool;
+        bz_stream m_strm;
+        comp_decomp_output m_out;
+
+        int reset()
+        {
+            if (m_init)
+                BZ2_bzCompressEnd(&m_strm);
+
+            int ret = BZ2_bzCompressInit(&m_strm, m_options.rate, 0, m_options.work_factor);
+            m_init = (ret == BZ_OK);
+            return ret;
+        }
+
+        // Compresses the input into out. Returns BZ_RUN_OK once all the
+        // input is taken, or BZ_STREAM_END once BZ_FINISH is done.
+        int code(comp_decomp_output& out, const void *input, size_t input_size, int action)
+        {
+            const char *ptr = (const char *)input;
+            size_t remainder = input_size;
+            m_strm.avail_in = 0;
+
+            for (;;)
             {
-                output.resize(output.size() + COMP_DECOMP_BUFFSIZE);
-                strm.next_out = (char *)(output.data() + output.size() - COMP_DECOMP_BUFFSIZE);
-                strm.avail_out = COMP_DECOMP_BUFFSIZE;
+                if (m_strm.avail_in == 0)
+                {
+                    if (remainder == 0 && action == BZ_RUN)
+                        return BZ_RUN_OK;
+
+                    m_strm.next_in = (char *)ptr;
+                    if (remainder < COMP_DECOMP_MAX_WINDOW)
+                        m_strm.avail_in = (unsigned)remainder;
+                    else
+                        m_strm.avail_in = COMP_DECOMP_MAX_WINDOW;
+                    ptr += m_strm.avail_in;
+                    remainder -= m_strm.avail_in;
+                }
+
+                char *next_out;
+                size_t avail;
+                if (!out.space(next_out, avail))
+                    return out.error();
+                if (avail > COMP_DECOMP_MAX_WINDOW)
+                    avail = COMP_DECOMP_MAX_WINDOW;
+                m_strm.next_out = next_out;
+                m_strm.avail_out = (unsigned)avail;
+
+                int ret = BZ2_bzCompress(&m_strm, (remainder == 0) ? action : BZ_RUN);
+
+                out.commit(avail - m_strm.avail_out);
+                if (ret != BZ_RUN_OK && ret != BZ_FINISH_OK)
+                    return ret;
             }
+        }
+
+    private:
+        bzlib_compressor(const bzlib_compressor&) = delete;
+        bzlib_compressor& operator=(const bzlib_compressor&) = delete;
+    };
+
+    // See bzlib_compressor. Multi-stream input is decoded up to its end.
+    class bzlib_decompressor
+    {
+    public:
+        explicit bzlib_decompressor(comp_decomp_allocator *allocator = NULL)
+            : m_init(false), m_end(false), m_small(false), m_trailing(false),
+              m_tail_size(0), m_reallocs(0)
+        {
+            memset(&m_strm, 0, sizeof(m_strm));
+            bzlib_set_allocator(m_strm, allocator, m_pool);
+        }
 
-            ret = BZ2_bzCompress(&strm, action);
+        ~bzlib_decompressor()
+        {
+            if (m_init)
+                BZ2_bzDecompressEnd(&m_strm);
         }
 
-        if (ret != BZ_STREAM_END)
+        // size_hint is the expected decompressed size, if known. bzip2
+        // does not record it, so a guess is used without the hint.
+        template <typename T_BUFFER>
+        int decomp(T_BUFFER& output, const void *input, size_t input_size,
+                   size_t size_hint = 0)
         {
-            BZ2_bzCompressEnd(&strm);
             output.clear();
+            m_reallocs = 0;
+            if (m_limits.max_output && size_hint > m_limits.max_output)
+                size_hint = m_limits.max_output;
+            if (size_hint)
+                comp_decomp_reserve(output, size_hint);
+            else
+                output.reserve(input_size * 3 / 2);
+
+            int ret = reset(input, input_size);
+            if (ret != BZ_OK)
+                return ret;
+
+            comp_decomp_output out(output);
+            out.limit(m_limits.max_output);
+            ret = code(out, input, input_size);
+            m_reallocs = out.reallocs();
+            if (ret == BZ_STREAM_END && truncated())
+                ret = BZ_OK;
+            if (ret != BZ_STREAM_END)
+            {
+                output.clear();
+                return (ret == BZ_OK) ? BZ_UNEXPECTED_EOF : ret;
+            }
+            if (!out.flush())
+            {
+                output.clear();
+                return out.error();
+            }
+            return BZ_OK;
+        }
+
+        // Decompresses into the output_size bytes at output. Returns
+        // COMP_DECOMP_SPACE_ERROR if they are not enough.
+        int decomp(void *output, size_t output_size, size_t& written,
+                   const void *input, size_t input_size)
+        {
+            written = 0;
+            m_reallocs = 0;
+
+            int ret = reset(input, input_size);
+            if (ret != BZ_OK)
+                return ret;
+
+            comp_decomp_output out(output, output_size);
+            out.limit(m_limits.max_output);
+            ret = code(out, input, input_size);
+            if (ret == BZ_STREAM_END && truncated())
+                ret = BZ_OK;
+            if (ret != BZ_STREAM_END)
+                return (ret == BZ_OK) ? BZ_UNEXPECTED_EOF : ret;
+            if (!out.flush())
+                return out.error();
+            written = out.used();
+            return BZ_OK;
+        }
+
+        int begin(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+        {
+            m_out.reset(sink, buffsize);
+            m_out.limit(m_limits.max_output);
+            return reset();
+        }
+
+        // Data after the last stream that does not start with "BZh" is ignored.
+        // The header of the next stream may be split between writes.
+        int write(const void *input, size_t input_size)
+        {
+            int ret = code(m_out, input, input_size);
+            return (ret == BZ_STREAM_END) ? BZ_OK : ret;
+        }
+
+        // A "BZh" at the end is taken for a truncated stream, and less of it
+        // for trailing data.
+        int finish()
+        {
+            if (!m_end || truncated())
+                return BZ_UNEXPECTED_EOF;
+            return m_out.flush() ? BZ_OK : COMP_DECOMP_SINK_ERROR;
+        }
+
+        // Caps the following decompressions. Under max_memory the small mode
+        // of bzip2 is used (about 2.5 bytes per byte of block instead of 4),
+        // and the block size comes from the header of each stream. begin()
+        // does not see the data, so it assumes the largest blocks.
+        void set_limits(const comp_decomp_limits& limits)
+        {
+            m_limits = limits;
+        }
+
+        // Uses the small mode if options.small, whatever the limits. The
+        // rest of options is for the compressor only.
+        void set_options(const bzlib_options& options)
+        {
+            m_small = options.small;
+        }
+
+        // How many times the output of the last decomp() was reallocated.
+        size_t reallocs() const
+        {
+            return m_reallocs;
+        }
+
+    protected:
+        bool m_init;
+        bool m_end;
+        bool m_small;
+        bool m_trailing;        // data after the last stream was seen
+        char m_tail[4];         // the start of the next header after a stream
+        size_t m_tail_size;
+        size_t m_reallocs;
+        comp_decomp_pool m_pool;
+        bz_stream m_strm;
+        comp_decomp_limits m_limits;
+        comp_decomp_output m_out;
+
+        // Starts the stream whose header is at header, if known.
+        // next_in and avail_in are kept for the next stream.
+        int reset(const void *header = NULL, size_t size = 0)
+        {
+            m_end = m_trailing = false;
+            m_tail_size = 0;
+            if (m_init)
+                BZ2_bzDecompressEnd(&m_strm);
+            m_init = false;
+
+            int small = m_small;
+            if (m_limits.max_memory)
+            {
+                const char *ptr = (const char *)header;
+                uint64_t block = 9 * 100000;
+                if (size >= 4 && memcmp(ptr, "BZh", 3) == 0 && '1' <= ptr[3] && ptr[3] <= '9')
+                    block = (ptr[3] - '0') * 100000;
+                if (100000 + 4 * block > m_limits.max_memory)
+                {
+                    if (100000 + block * 5 / 2 > m_limits.max_memory)
+                        return COMP_DECOMP_MEMORY_ERROR;
+                    small = 1;
+                }
+            }
+
+            int ret = BZ2_bzDecompressInit(&m_strm, 0, small);
+            m_init = (ret == BZ_OK);
             return ret;
         }
 
-        output.resize(output.size() - strm.avail_out);
-        return BZ2_bzCompressEnd(&strm);
+        bool truncated() const
+        {
+            return m_tail_size == 3;
+        }
+
+        // Decompresses the input into out. Returns BZ_OK when more input is
+        // needed, or BZ_STREAM_END after the last stream.
+        int code(comp_decomp_output& out, const void *input, size_t input_size)
+        {
+            if (!m_end)
+                return code_stream(out, input, input_size);
+            if (m_trailing || input_size == 0)
+                return BZ_STREAM_END;
+
+            // join the pieces of the next header
+            size_t take = 4 - m_tail_size;
+            if (take > input_size)
+                take = input_size;
+            memcpy(m_tail + m_tail_size, input, take);
+            m_tail_size += take;
+            if (memcmp(m_tail, "BZh", (m_tail_size < 3) ? m_tail_size : 3) != 0)
+            {
+                m_trailing = true;
+                m_tail_size = 0;
+                return BZ_STREAM_END;
+            }
+            if (m_tail_size < 4)
+                return BZ_STREAM_END;
+
+            char header[4];
+            memcpy(header, m_tail, 4);
+            int ret = reset(header, 4);
+            if (ret != BZ_OK)
+                return ret;
+            ret = code_stream(out, header, 4);
+            if (ret != BZ_OK || take == input_size)
+                return ret;
+            return code_stream(out, (const char *)input + take, input_size - take);
+        }
+
+        int code_stream(comp_decomp_output& out, const void *input, size_t input_size)
+        {
+            const char *ptr = (const char *)input;
+            size_t remainder = input_size;
+            m_strm.avail_in = 0;
+
+            for (;;)
+            {
+                if (m_strm.avail_in == 0 && remainder > 0)
+                {
+                    m_strm.next_in = (char *)ptr;
+                    if (remainder < COMP_DECOMP_MAX_WINDOW)
+                        m_strm.avail_in = (unsigned)remainder;
+                    else
+                        m_strm.avail_in = COMP_DECOMP_MAX_WINDOW;
+                    ptr += m_strm.avail_in;
+                    remainder -= m_strm.avail_in;
+                }
+
+                char *next_out;
+                size_t avail;
+                if (!out.space(next_out, avail))
+                    return out.error();
+                if (avail > COMP_DECOMP_MAX_WINDOW)
+                    avail = COMP_DECOMP_MAX_WINDOW;
+                m_strm.next_out = next_out;
+                m_strm.avail_out = (unsigned)avail;
+
+                int ret = BZ2_bzDecompress(&m_strm);
+
+                out.commit(avail - m_strm.avail_out);
+                if (ret == BZ_STREAM_END)
+                {
+                    m_end = true;
+
+                    // continue with the next stream of a multi-stream .bz2
+                    // (the windows are contiguous, so next_in can be peeked at)
+                    size_t left = m_strm.avail_in + remainder;
+                    if (left < 4)
+                        return code(out, m_strm.next_in, left);
+                    if (memcmp(m_strm.next_in, "BZh", 3) != 0)
+                    {
+                        m_trailing = true;
+                        return ret;
+                    }
+                    ret = reset(m_strm.next_in, left);
+                    if (ret != BZ_OK)
+                        return ret;
+                    continue;
+                }
+                if (ret != BZ_OK)
+                    return ret;
+                if (m_strm.avail_in == 0 && remainder == 0 && m_strm.avail_out > 0)
+                    return BZ_OK;
+            }
+        }
+
+    private:
+        bzlib_decompressor(const bzlib_decompressor&) = delete;
+        bzlib_decompressor& operator=(const bzlib_decompressor&) = delete;
+    };
+
+    // Pass comp_decomp_thread_pool() or an allocator of your own as
+    // allocator to recycle the work memory between calls.
+    template <typename T_BUFFER>
+    inline int bzlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+                          const bzlib_options& options, comp_decomp_allocator *allocator = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_BZLIB, true, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        bzlib_compressor compressor(options, allocator);
+        int ret = compressor.comp(output, input, input_size);
+        return COMP_DECOMP_STATS_RESULT(ret, output.size());
+    }
+
+    inline int bzlib_comp(void *output, size_t output_size, size_t& written,
+                          const void *input, size_t input_size, const bzlib_options& options,
+                          comp_decomp_allocator *allocator = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_BZLIB, true, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        bzlib_compressor compressor(options, allocator);
+        int ret = compressor.comp(output, output_size, written, input, input_size);
+        return COMP_DECOMP_STATS_RESULT(ret, written);
+    }
+
+    template <typename T_BUFFER>
+    inline int bzlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+                          int rate = 9, comp_decomp_allocator *allocator = NULL)
+    {
+        return bzlib_comp(output, input, input_size, bzlib_options(rate), allocator);
+    }
+
+    inline int bzlib_comp(void *output, size_t output_size, size_t& written,
+                          const void *input, size_t input_size, int rate = 9,
+                          comp_decomp_allocator *allocator = NULL)
+    {
+        return bzlib_comp(output, output_size, written, input, input_size, bzlib_options(rate),
+                          allocator);
+    }
+
+    // limits, if not NULL, caps the output and the work memory for data
+    // from untrusted sources.
+    template <typename T_BUFFER>
+    inline int bzlib_decomp(T_BUFFER& output, const void *input, size_t input_size,
+                            size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+                            const comp_decomp_limits *limits = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_BZLIB, false, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        bzlib_decompressor decompressor(allocator);
+        if (limits)
+            decompressor.set_limits(*limits);
+        int ret = decompressor.decomp(output, input, input_size, size_hint);
+        return COMP_DECOMP_STATS_RESULT(ret, output.size());
+    }
+
+    inline int bzlib_decomp(void *output, size_t output_size, size_t& written,
+                            const void *input, size_t input_size,
+                            comp_decomp_allocator *allocator = NULL,
+                            const comp_decomp_limits *limits = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_BZLIB, false, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        bzlib_decompressor decompressor(allocator);
+        if (limits)
+            decompressor.set_limits(*limits);
+        int ret = decompressor.decomp(output, output_size, written, input, input_size);
+        return COMP_DECOMP_STATS_RESULT(ret, written);
     }
 
-    inline int bzlib_decomp(std::string& output, const void *input,
-                            unsigned int input_size)
+    // Compresses pieces of block_size bytes (rate * 100000 by default) on
+    // threads threads and joins them into a multi-stream .bz2 (pbzip2 style).
+    inline int bzlib_comp_mt(std::string& output, const void *input,
+                             size_t input_size, int rate = 9,
+                             unsigned threads = 0, size_t block_size = 0)
     {
+        const char *ptr = (const char *)input;
+        assert(1 <= rate && rate <= 9);
+
         output.clear();
-        output.reserve(input_size * 3 / 2);
-        static uint8_t inbuf[COMP_DECOMP_BUFFSIZE];
-
-        bz_stream strm;
-        memset(&strm, 0, sizeof(strm));
-        strm.bzalloc = NULL;
-        strm.bzfree = NULL;
-        strm.opaque = NULL;
-        strm.next_in = (char *)input;
-        strm.avail_in = input_size;
-        int ret = BZ2_bzDecompressInit(&strm, 0, 0);
-        if (ret != BZ_OK)
-            return ret;
 
-        output.resize(COMP_DECOMP_BUFFSIZE);
-        strm.next_out  = (char *)(output.data());
-        strm.avail_out = (unsigned)output.size();
+        if (block_size == 0)
+            block_size = rate * 100000;
+        size_t count = (input_size + block_size - 1) / block_size;
+        if (count == 0)
+            count = 1;
+        threads = comp_decomp_threads(threads);
+        if (threads > count)
+            threads = (unsigned)count;
 
-        ret = BZ_OK;
-        while (ret == BZ_OK || ret == BZ_FLUSH_OK || ret == BZ_FINISH_OK)
-        {
-            if (strm.avail_out == 0)
+        std::vector<std::string> blocks(count);
+        std::atomic<size_t> next(0);
+        std::atomic<int> error(BZ_OK);
+
+        comp_decomp_run_workers(threads, [&]() {
+            bzlib_compressor compressor(rate);
+            for (size_t i = next++; i < count && error == BZ_OK; i = next++)
             {
-                output.resize(output.size() + COMP_DECOMP_BUFFSIZE);
-                strm.next_out  = (char *)(output.data() + output.size() - COMP_DECOMP_BUFFSIZE);
-                strm.avail_out = COMP_DECOMP_BUFFSIZE;
+                size_t offset = i * block_size;
+                size_t size = input_size - offset;
+                if (size > block_size)
+                    size = block_size;
+
+                int ret = compressor.comp(blocks[i], ptr + offset, size);
+                if (ret != BZ_OK)
+                    error = ret;
             }
+        });
+
+        if (error != BZ_OK)
+            return error;
 
-            ret = BZ2_bzDecompress(&strm);
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            total += blocks[i].size();
         }
+        output.reserve(total);
 
-        if (ret != BZ_STREAM_END)
+        for (size_t i = 0; i < count; ++i)
         {
-            output.clear();
-            BZ2_bzDecompressEnd(&strm);
-            return ret;
+            COMP_DECOMP_COPIED(blocks[i].size());
+            output += blocks[i];
+            std::string().swap(blocks[i]);
         }
+        return BZ_OK;
+    }
 
-        output.resize(output.size() - strm.avail_out);
+    // Returns the offsets where a bzip2 stream seems to start: "BZh1"-"BZh9"
+    // followed by the block magic or the end-of-stream magic.
+    inline std::vector<size_t> bzlib_find_streams(const void *input, size_t input_size)
+    {
+        static const char block_magic[] = "\x31\x41\x59\x26\x53\x59";
+        static const char eos_magic[] = "\x17\x72\x45\x38\x50\x90";
+        const char *ptr = (const char *)input;
+        std::vector<size_t> ret;
 
-        return BZ2_bzDecompressEnd(&strm);
+        for (size_t i = 0; i + 10 <= input_size; )
+        {
+            const char *found = (const char *)memchr(ptr + i, 'B', input_size - 10 - i + 1);
+            if (!found)
+                break;
+            i = found - ptr;
+            if (ptr[i + 1] == 'Z' && ptr[i + 2] == 'h' &&
+                '1' <= ptr[i + 3] && ptr[i + 3] <= '9' &&
+                (memcmp(ptr + i + 4, block_magic, 6) == 0 ||
+                 memcmp(ptr + i + 4, eos_magic, 6) == 0))
+            {
+                ret.push_back(i);
+                i += 10;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        return ret;
+    }
+
+    // Splits input at the stream boundaries found by bzlib_find_streams and
+    // decodes the pieces on threads threads. When a boundary turns out to
+    // be a false match the whole input is decoded again by bzlib_decomp.
+    inline int bzlib_decomp_mt(std::string& output, const void *input,
+                               size_t input_size, unsigned threads = 0)
+    {
+        const char *ptr = (const char *)input;
+        output.clear();
+
+        std::vector<size_t> starts = bzlib_find_streams(input, input_size);
+        threads = comp_decomp_threads(threads);
+        if (threads > starts.size())
+            threads = (unsigned)starts.size();
+        if (threads <= 1 || starts[0] != 0)
+            return bzlib_decomp(output, input, input_size);
+
+        size_t count = starts.size();
+        starts.push_back(input_size);
+
+        std::vector<std::string> pieces(count);
+        std::atomic<size_t> next(0);
+        std::atomic<int> error(BZ_OK);
+
+        comp_decomp_run_workers(threads, [&]() {
+            bzlib_decompressor decompressor;
+            for (size_t i = next++; i < count && error == BZ_OK; i = next++)
+            {
+                size_t size = starts[i + 1] - starts[i];
+                int ret = decompressor.decomp(pieces[i], ptr + starts[i], size);
+                if (ret != BZ_OK)
+                    error = ret;
+            }
+        });
+
+        if (error != BZ_OK)
+            return bzlib_decomp(output, input, input_size);
+
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            total += pieces[i].size();
+        }
+        output.reserve(total);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            COMP_DECOMP_COPIED(pieces[i].size());
+            output += pieces[i];
+            std::string().swap(pieces[i]);
+        }
+        return BZ_OK;
     }
 
     inline const char *bzlib_errmsg(int ret)
@@ -139,6 +761,11 @@
         case BZ_UNEXPECTED_EOF: return "unexpected EOF (BZ_UNEXPECTED_EOF )";
         case BZ_OUTBUFF_FULL: return "out buffer full (BZ_OUTBUFF_FULL)";
         case BZ_CONFIG_ERROR: return "config error (BZ_CONFIG_ERROR)";
+        case COMP_DECOMP_SINK_ERROR: return "sink error (COMP_DECOMP_SINK_ERROR)";
+        case COMP_DECOMP_SPACE_ERROR: return "output buffer too small (COMP_DECOMP_SPACE_ERROR)";
+        case COMP_DECOMP_LIMIT_ERROR: return "output over the limit (COMP_DECOMP_LIMIT_ERROR)";
+        case COMP_DECOMP_MEMORY_ERROR: return "memory over the limit (COMP_DECOMP_MEMORY_ERROR)";
+        case COMP_DECOMP_CANCEL_ERROR: return "cancelled (COMP_DECOMP_CANCEL_ERROR)";
         }
         return "Unknown error";
     }
@@ -146,12 +773,12 @@
     inline bool bzlib_test_entry(const std::string& original)
     {
         std::string encoded, decoded;
-        if (int ret = bzlib_comp(encoded, original.c_str(), (unsigned)original.size()))
+        if (int ret = bzlib_comp(encoded, original.c_str(), original.size()))
         {
             printf("bzlib_comp failed: %s\n", bzlib_errmsg(ret));
             return false;
         }
-        if (int ret = bzlib_decomp(decoded, encoded.c_str(), (unsigned)encoded.size()))
+        if (int ret = bzlib_decomp(decoded, encoded.c_str(), encoded.size()))
         {
             printf("bzlib_decomp failed: %s\n", bzlib_errmsg(ret));
             return false;
@@ -164,6 +791,243 @@
         return true;
     }
 
+    inline bool bzlib_test_entry(bzlib_compressor& compressor,
+                                 bzlib_decompressor& decompressor,
+                                 const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = compressor.comp(encoded, original.c_str(), original.size()))
+        {
+            printf("bzlib_compressor failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = decompressor.decomp(decoded, encoded.c_str(), encoded.size(),
+                                          original.size()))
+        {
+            printf("bzlib_decompressor failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("bzlib mismatch\n");
+            return false;
+        }
+        if (compressor.reallocs() || decompressor.reallocs())
+        {
+            printf("bzlib reallocated\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool bzlib_allocator_test_entry(comp_decomp_pool& pool, const std::string& original)
+    {
+        std::string encoded, decoded;
+        size_t allocs = pool.allocs();
+        if (int ret = bzlib_comp(encoded, original.data(), original.size(), 9, &pool))
+        {
+            printf("bzlib_comp with a pool failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = bzlib_decomp(decoded, encoded.data(), encoded.size(), 0, &pool))
+        {
+            printf("bzlib_decomp with a pool failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded) || pool.allocs() == allocs)
+        {
+            printf("bzlib pool mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool bzlib_mt_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = bzlib_comp_mt(encoded, original.c_str(), original.size(), 9, 3, 16))
+        {
+            printf("bzlib_comp_mt failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = bzlib_decomp_mt(decoded, encoded.c_str(), encoded.size(), 3))
+        {
+            printf("bzlib_decomp_mt failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("bzlib mt mismatch\n");
+            return false;
+        }
+        if (int ret = bzlib_decomp(decoded, encoded.c_str(), encoded.size()))
+        {
+            printf("bzlib_decomp failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("bzlib multi-stream mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool bzlib_span_test_entry(const std::string& original)
+    {
+        std::vector<unsigned char> encoded;
+        if (int ret = bzlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("bzlib_comp to a vector failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+
+        std::vector<char> buffer(bzlib_comp_bound(original.size()));
+        size_t written;
+        int ret = bzlib_comp(&buffer[0], buffer.size(), written,
+                             original.data(), original.size());
+        if (ret != BZ_OK || written != encoded.size() ||
+            memcmp(&buffer[0], &encoded[0], written) != 0)
+        {
+            printf("bzlib_comp to a buffer failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+
+        // exactly as large as needed, then one byte short
+        buffer.assign(original.size() + 1, 0);
+        ret = bzlib_decomp(&buffer[0], original.size(), written, &encoded[0], encoded.size());
+        if (ret != BZ_OK || written != original.size() ||
+            memcmp(&buffer[0], original.data(), written) != 0)
+        {
+            printf("bzlib_decomp to a buffer failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (original.size())
+        {
+            ret = bzlib_decomp(&buffer[0], original.size() - 1, written,
+                              &encoded[0], encoded.size());
+            if (ret != COMP_DECOMP_SPACE_ERROR || buffer[original.size() - 1] != original.back())
+            {
+                printf("bzlib_decomp overran a buffer: %s\n", bzlib_errmsg(ret));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline bool bzlib_stream_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        bool bounded = true;
+        comp_decomp_sink to_encoded = [&](const void *data, size_t size) {
+            bounded = bounded && size <= COMP_DECOMP_BUFFSIZE;
+            encoded.append((const char *)data, size);
+            return true;
+        };
+        comp_decomp_sink to_decoded = [&](const void *data, size_t size) {
+            bounded = bounded && size <= COMP_DECOMP_BUFFSIZE;
+            decoded.append((const char *)data, size);
+            return true;
+        };
+
+        bzlib_compressor compressor;
+        int ret = compressor.begin(to_encoded);
+        for (size_t i = 0; ret == BZ_OK && i < original.size(); i += 7)
+        {
+            size_t size = (original.size() - i < 7) ? original.size() - i : 7;
+            ret = compressor.write(&original[i], size);
+        }
+        if (ret == BZ_OK)
+            ret = compressor.finish();
+        if (ret != BZ_OK)
+        {
+            printf("bzlib_compressor streaming failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+
+        bzlib_decompressor decompressor;
+        ret = decompressor.begin(to_decoded);
+        for (size_t i = 0; ret == BZ_OK && i < encoded.size(); i += 5)
+        {
+            size_t size = (encoded.size() - i < 5) ? encoded.size() - i : 5;
+            ret = decompressor.write(&encoded[i], size);
+        }
+        if (ret == BZ_OK)
+            ret = decompressor.finish();
+        if (ret != BZ_OK)
+        {
+            printf("bzlib_decompressor streaming failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+
+        if (!(original == decoded) || !bounded)
+        {
+            printf("bzlib streaming mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    // Streams input split into two writes at split.
+    inline int bzlib_split_run(std::string& decoded, const std::string& input, size_t split)
+    {
+        assert(split <= input.size());
+        decoded.clear();
+        bzlib_decompressor decompressor;
+        int ret = decompressor.begin([&](const void *data, size_t size) {
+            decoded.append((const char *)data, size);
+            return true;
+        });
+        if (ret == BZ_OK)
+            ret = decompressor.write(input.data(), split);
+        if (ret == BZ_OK)
+            ret = decompressor.write(input.data() + split, input.size() - split);
+        if (ret == BZ_OK)
+            ret = decompressor.finish();
+        return ret;
+    }
+
+    // Two streams joined, written in two pieces split at every offset
+    // around the end of the first one.
+    inline bool bzlib_split_test_entry(const std::string& original)
+    {
+        std::string first, second, decoded;
+        size_t half = original.size() / 2;
+        bzlib_comp(first, original.data(), half);
+        bzlib_comp(second, original.data() + half, original.size() - half);
+        std::string joined = first + second;
+
+        for (size_t split = first.size() - 6; split <= first.size() + 6; ++split)
+        {
+            int ret = bzlib_split_run(decoded, joined, split);
+            if (ret != BZ_OK || !(decoded == original))
+            {
+                printf("bzlib split at %d of the boundary failed: %s\n",
+                       (int)(split - first.size()), bzlib_errmsg(ret));
+                return false;
+            }
+        }
+
+        // less than "BZh" after the end is trailing data, "BZh" is truncated
+        for (size_t split = first.size() - 2; split <= first.size() + 3; ++split)
+        {
+            if ((split <= first.size() + 2 &&
+                 bzlib_split_run(decoded, first + "BZ", split) != BZ_OK) ||
+                bzlib_split_run(decoded, first + "BZh", split) != BZ_UNEXPECTED_EOF)
+            {
+                printf("bzlib split tail at %d failed\n", (int)(split - first.size()));
+                return false;
+            }
+        }
+        std::string tail = first + "BZh";
+        if (bzlib_decomp(decoded, tail.data(), tail.size()) != BZ_UNEXPECTED_EOF)
+        {
+            printf("bzlib_decomp accepted a truncated stream\n");
+            return false;
+        }
+        return true;
+    }
+
 #ifndef COMP_DECOMP_MAX_TEST
     #define COMP_DECOMP_MAX_TEST 100
 #endif
@@ -171,8 +1035,146 @@
     #define COMP_DECOMP_TEST_COUNT 100
 #endif
 
+    inline bool bzlib_limits_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = bzlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("bzlib_comp failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+
+        comp_decomp_limits exact(original.size());
+        if (int ret = bzlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, &exact))
+        {
+            printf("bzlib_decomp within the limit failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        // 0 would be no limit
+        if (original.size() > 1)
+        {
+            comp_decomp_limits less(original.size() - 1);
+            if (bzlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, &less) !=
+                COMP_DECOMP_LIMIT_ERROR || !decoded.empty())
+            {
+                printf("bzlib_decomp over the limit did not fail\n");
+                return false;
+            }
+
+            // a fixed buffer larger than the limit
+            std::vector<char> buffer(original.size() + 100);
+            size_t written;
+            int ret = bzlib_decomp(&buffer[0], buffer.size(), written,
+                                   encoded.data(), encoded.size(), NULL, &less);
+            if (ret != COMP_DECOMP_LIMIT_ERROR)
+            {
+                printf("bzlib_decomp over the limit into a buffer did not fail\n");
+                return false;
+            }
+        }
+
+        // empty data may need no dictionary
+        if (!original.empty())
+        {
+            comp_decomp_limits small(0, 1024 * 1024);
+            if (bzlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, &small) !=
+                COMP_DECOMP_MEMORY_ERROR)
+            {
+                printf("bzlib_decomp over the memory limit did not fail\n");
+                return false;
+            }
+            comp_decomp_limits enough(0, 3 * 1024 * 1024);
+            if (int ret = bzlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, &enough))
+            {
+                printf("bzlib_decomp within the memory limit failed: %s\n", bzlib_errmsg(ret));
+                return false;
+            }
+        }
+        return original == decoded;
+    }
+
+    inline bool bzlib_options_test_entry(const std::string& original)
+    {
+        bzlib_options options[3];
+        options[0] = bzlib_options::fastest();
+        options[1] = bzlib_options::low_memory();
+        options[2].work_factor = 1;
+        for (size_t i = 0; i < 3; ++i)
+        {
+            std::string encoded, decoded;
+            if (int ret = bzlib_comp(encoded, original.data(), original.size(), options[i]))
+            {
+                printf("bzlib_comp with options failed: %s\n", bzlib_errmsg(ret));
+                return false;
+            }
+            if (encoded.size() < 4 || encoded[3] != '0' + options[i].rate)
+            {
+                printf("bzlib options did not set the block size\n");
+                return false;
+            }
+
+            bzlib_decompressor decompressor;
+            decompressor.set_options(options[i]);
+            if (int ret = decompressor.decomp(decoded, encoded.data(), encoded.size()))
+            {
+                printf("bzlib_decompressor with options failed: %s\n", bzlib_errmsg(ret));
+                return false;
+            }
+            if (!(original == decoded))
+            {
+                printf("bzlib options mismatch\n");
+                return false;
+            }
+        }
+        return true;
+    }
+
+#ifdef COMP_DECOMP_STATS
+    inline bool bzlib_stats_test_entry(const std::string& original)
+    {
+        comp_decomp_set_stats_callback(comp_decomp_stats_test_callback);
+        comp_decomp_stats before = comp_decomp_stats_snapshot(COMP_DECOMP_CODEC_BZLIB, true);
+
+        std::string encoded, decoded;
+        if (int ret = bzlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("bzlib_comp with stats failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        const comp_decomp_call_stats& call = comp_decomp_stats_test_last();
+        if (call.codec != COMP_DECOMP_CODEC_BZLIB || !call.compress || call.bytes_in != original.size() ||
+            call.bytes_out != encoded.size() || call.iterations == 0 || call.mem_peak == 0)
+        {
+            printf("bzlib call stats are wrong\n");
+            return false;
+        }
+
+        comp_decomp_stats after = comp_decomp_stats_snapshot(COMP_DECOMP_CODEC_BZLIB, true);
+        if (after.calls <= before.calls || after.bytes_in < before.bytes_in + original.size())
+        {
+            printf("bzlib stats snapshot is wrong\n");
+            return false;
+        }
+
+        if (int ret = bzlib_decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("bzlib_decomp with stats failed: %s\n", bzlib_errmsg(ret));
+            return false;
+        }
+        if (call.compress || call.bytes_out != original.size() || call.iterations == 0)
+        {
+            printf("bzlib decomp call stats are wrong\n");
+            return false;
+        }
+        return original == decoded;
+    }
+#endif
+
     inline bool bzlib_unittest(void)
     {
+        bzlib_compressor compressor;
+        bzlib_decompressor decompressor;
+        comp_decomp_pool pool;
         std::string original;
         if (!bzlib_test_entry(original))
             return false;
@@ -180,6 +1182,14 @@
         original.assign(COMP_DECOMP_MAX_TEST, 'A');
         if (!bzlib_test_entry(original))
             return false;
+        if (!bzlib_mt_test_entry(original))
+            return false;
+        if (!bzlib_span_test_entry(original))
+            return false;
+        if (!bzlib_stream_test_entry(original))
+            return false;
+        if (!bzlib_split_test_entry(original))
+            return false;
 
         for (size_t i = 0; i < COMP_DECOMP_TEST_COUNT; ++i)
         {
@@ -191,6 +1201,31 @@
             }
             if (!bzlib_test_entry(original))
                 return false;
+            if (!bzlib_test_entry(compressor, decompressor, original))
+                return false;
+            if (!bzlib_allocator_test_entry(pool, original))
+                return false;
+            if (!bzlib_limits_test_entry(original))
+                return false;
+            if (!bzlib_options_test_entry(original))
+                return false;
+#ifdef COMP_DECOMP_STATS
+            if (!bzlib_stats_test_entry(original))
+                return false;
+#endif
+            if (!bzlib_mt_test_entry(original))
+                return false;
+            if (!bzlib_span_test_entry(original))
+                return false;
+            if (!bzlib_stream_test_entry(original))
+                return false;
+            if (!bzlib_split_test_entry(original))
+                return false;
+        }
+        if (pool.reused() == 0)
+        {
+            printf("bzlib pool not reused\n");
+            return false;
         }
         return true;
     }
@@ -0,0 +1,770 @@
+// comp_decomp_common.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_COMMON_HPP_
+#define COMP_DECOMP_COMMON_HPP_
+
+#include <cstdlib>
+#include <cstddef>
+#include <cstdio>
+#include <cassert>
+#include <cstring>
+#include <climits>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#ifndef COMP_DECOMP_BUFFSIZE
+    #define COMP_DECOMP_BUFFSIZE (8 * 1024)
+#endif
+
+// The most bytes given to a codec with 32-bit avail_in/avail_out at once.
+// Larger buffers are fed in windows of this size.
+#ifndef COMP_DECOMP_MAX_WINDOW
+    #define COMP_DECOMP_MAX_WINDOW UINT_MAX
+#endif
+
+// zlib_comp and lzma_comp store an input whose estimated entropy is at least
+// this many bits per byte, instead of compressing it. 0 turns this off.
+#ifndef COMP_DECOMP_STORE_ENTROPY
+    #define COMP_DECOMP_STORE_ENTROPY 7.9
+#endif
+
+// Inputs smaller than this are always compressed.
+#ifndef COMP_DECOMP_STORE_MIN
+    #define COMP_DECOMP_STORE_MIN 1024
+#endif
+
+// A decompressed size read from the data itself (gzip ISIZE, xz index) is
+// reserved up to this many times the input size, or COMP_DECOMP_HINT_MIN
+// bytes if that is more. The output grows past it as it comes.
+#ifndef COMP_DECOMP_HINT_RATIO
+    #define COMP_DECOMP_HINT_RATIO 32
+#endif
+#ifndef COMP_DECOMP_HINT_MIN
+    #define COMP_DECOMP_HINT_MIN (64 * 1024 * 1024)
+#endif
+
+// Called with the number of bytes moved when the output has to be reallocated.
+#ifndef COMP_DECOMP_COPIED
+    #define COMP_DECOMP_COPIED(size) ((void)0)
+#endif
+
+// enum { COMP_DECOMP_SINK_ERROR, ... };
+// enum comp_decomp_codec { COMP_DECOMP_CODEC_NONE, ... };
+// struct comp_decomp_limits;
+// typedef std::function<bool(const void *data, size_t size)> comp_decomp_sink;
+// size_t comp_decomp_grow(T_BUFFER& output, size_t used);
+// void comp_decomp_reserve(T_BUFFER& output, size_t size);
+// size_t comp_decomp_data_hint(size_t size, size_t input_size);
+// void comp_decomp_put_le64(std::string& output, uint64_t value);
+// uint64_t comp_decomp_get_le64(const void *ptr);
+// class comp_decomp_output;
+// class comp_decomp_allocator;
+// class comp_decomp_pool;
+// comp_decomp_pool& comp_decomp_thread_pool(void);
+// class comp_decomp_dict;
+// comp_decomp_dict comp_decomp_train_dict(const std::vector<std::string>& samples,
+//                                         size_t dict_size = 32 * 1024);
+// double comp_decomp_entropy(const void *input, size_t input_size,
+//                            size_t sample_size = 16 * 1024);
+// bool comp_decomp_incompressible(const void *input, size_t input_size);
+// unsigned comp_decomp_threads(unsigned threads);
+// void comp_decomp_run_workers(unsigned threads, T_WORKER worker);
+
+// Status codes of comp_decomp itself. They don't collide with the codecs'.
+enum
+{
+    COMP_DECOMP_SINK_ERROR = -100,  // the sink returned false
+    COMP_DECOMP_FILE_ERROR = -101,  // file I/O failed (see errno)
+    COMP_DECOMP_CODEC_ERROR = -102, // unknown or unavailable codec
+    COMP_DECOMP_SPACE_ERROR = -103, // the caller's output buffer is too small
+    COMP_DECOMP_LIMIT_ERROR = -104, // the output is over comp_decomp_limits::max_output
+    COMP_DECOMP_MEMORY_ERROR = -105, // the codec needs over comp_decomp_limits::max_memory
+    COMP_DECOMP_CANCEL_ERROR = -106 // the job was cancelled
+};
+
+// Caps for a decompression of untrusted data. 0 means no limit.
+// max_memory is the work memory of the codec, without the output. zlib gets
+// it by a smaller window, bzip2 by its small mode and xz by a memlimit.
+struct comp_decomp_limits
+{
+    size_t max_output;
+    uint64_t max_memory;
+
+    comp_decomp_limits(size_t max_output_ = 0, uint64_t max_memory_ = 0)
+        : max_output(max_output_), max_memory(max_memory_)
+    {
+    }
+};
+
+// The codecs the codec-independent entry points can dispatch to.
+enum comp_decomp_codec
+{
+    COMP_DECOMP_CODEC_NONE = 0,
+    COMP_DECOMP_CODEC_ZLIB,
+    COMP_DECOMP_CODEC_BZLIB,
+    COMP_DECOMP_CODEC_LZMA
+};
+
+// Receives compressed or decompressed data. Returns false to abort.
+typedef std::function<bool(const void *data, size_t size)> comp_decomp_sink;
+
+#include "comp_decomp_stats.hpp"
+#ifdef COMP_DECOMP_STATS
+    // keeps the blocks of comp_decomp_allocator aligned as malloc's
+    #define COMP_DECOMP_STATS_HEADER sizeof(std::max_align_t)
+#endif
+
+// Appends value as 8 bytes, little endian.
+inline void comp_decomp_put_le64(std::string& output, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+    {
+        output += (char)((value >> (i * 8)) & 0xFF);
+    }
+}
+
+inline uint64_t comp_decomp_get_le64(const void *ptr)
+{
+    const unsigned char *bytes = (const unsigned char *)ptr;
+    uint64_t value = 0;
+    for (int i = 8; i-- > 0; )
+    {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Makes free space after the first used bytes of output and returns its size.
+// The codecs write straight into the returned space. A reserved capacity is
+// used up before the buffer is reallocated. T_BUFFER is std::string,
+// std::vector<uint8_t> or another container of bytes.
+template <typename T_BUFFER>
+inline size_t comp_decomp_grow(T_BUFFER& output, size_t used)
+{
+    size_t new_size = used + COMP_DECOMP_BUFFSIZE;
+    if (output.capacity() < new_size)
+    {
+        if (used < output.capacity())
+            new_size = output.capacity();
+        else
+            COMP_DECOMP_COPIED(used);
+    }
+    output.resize(new_size);
+    return new_size - used;
+}
+
+// Reserves the whole expected output at once. One more byte is reserved so
+// that a codec that fills the output exactly can still see its end without
+// another allocation.
+template <typename T_BUFFER>
+inline void comp_decomp_reserve(T_BUFFER& output, size_t size)
+{
+    if (size < output.max_size())
+        output.reserve(size + 1);
+}
+
+// Caps a size that the input_size bytes of compressed data tell about
+// themselves, so that a forged one cannot make a huge reservation.
+inline size_t comp_decomp_data_hint(size_t size, size_t input_size)
+{
+    size_t cap = COMP_DECOMP_HINT_MIN;
+    if (input_size > cap / COMP_DECOMP_HINT_RATIO)
+        cap = (input_size < SIZE_MAX / COMP_DECOMP_HINT_RATIO) ?
+              input_size * COMP_DECOMP_HINT_RATIO : SIZE_MAX;
+    return (size < cap) ? size : cap;
+}
+
+// The place a codec loop writes into: a container that grows as needed,
+// a buffer of buffsize bytes drained by a sink, or a fixed buffer of the
+// caller's that fails with COMP_DECOMP_SPACE_ERROR when it runs out.
+class comp_decomp_output
+{
+public:
+    comp_decomp_output()
+        : m_target(NULL), m_grow(NULL), m_trim(NULL), m_data(NULL), m_size(0),
+          m_used(0), m_reallocs(0), m_base(0), m_flushed(0), m_limit(SIZE_MAX)
+    {
+    }
+
+    // Appends to buffer.
+    template <typename T_BUFFER>
+    explicit comp_decomp_output(T_BUFFER& buffer)
+        : m_target(&buffer), m_grow(&grow_buffer<T_BUFFER>), m_trim(&trim_buffer<T_BUFFER>),
+          m_data(NULL), m_size(buffer.size()), m_used(buffer.size()), m_reallocs(0),
+          m_base(buffer.size()), m_flushed(0), m_limit(SIZE_MAX)
+    {
+    }
+
+    // Writes to the size bytes at data and no further.
+    comp_decomp_output(void *data, size_t size)
+        : m_target(NULL), m_grow(NULL), m_trim(NULL), m_data((char *)data), m_size(size),
+          m_used(0), m_reallocs(0), m_base(0), m_flushed(0), m_limit(SIZE_MAX)
+    {
+    }
+
+    void reset(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+    {
+        m_sink = sink;
+        m_target = NULL;
+        m_buffer.resize(buffsize);
+        m_data = &m_buffer[0];
+        m_size = buffsize;
+        m_used = 0;
+        m_base = m_flushed = 0;
+        m_limit = SIZE_MAX;
+    }
+
+    // Fails with COMP_DECOMP_LIMIT_ERROR once the codec has more than
+    // max_output bytes to write in all (0 for no limit).
+    void limit(size_t max_output)
+    {
+        m_limit = max_output ? max_output : SIZE_MAX;
+    }
+
+    // Returns the free space after the written data. Fails if the sink fails
+    // or a fixed buffer is full.
+    bool space(char *& ptr, size_t& avail)
+    {
+        COMP_DECOMP_STATS_ITERATION();
+        size_t written = this->written();
+        if (written >= m_limit)
+        {
+            // one byte to spare again, to see if the codec has more
+            if (written > m_limit)
+                return false;
+            ptr = &m_spare;
+            avail = 1;
+            return true;
+        }
+        if (m_used >= m_size)
+        {
+            if (m_sink)
+            {
+                if (!flush())
+                    return false;
+            }
+            else if (m_target)
+            {
+                if (m_grow(m_target, m_used, m_data, m_size) && m_used > 0)
+                {
+                    ++m_reallocs;
+                    COMP_DECOMP_STATS_REALLOC();
+                }
+            }
+            else
+            {
+                // A full fixed buffer gets one byte to spare, so that a codec
+                // that has nothing more to write can still reach its end.
+                if (m_used > m_size)
+                    return false;
+                ptr = &m_spare;
+                avail = 1;
+                return true;
+            }
+        }
+        ptr = m_data + m_used;
+        avail = std::min(m_size - m_used, m_limit - written);
+        return true;
+    }
+
+    void commit(size_t size)
+    {
+        m_used += size;
+    }
+
+    // The status for a failed space().
+    int error() const
+    {
+        if (written() > m_limit)
+            return COMP_DECOMP_LIMIT_ERROR;
+        return m_sink ? COMP_DECOMP_SINK_ERROR : COMP_DECOMP_SPACE_ERROR;
+    }
+
+    // Gives the buffered data to the sink, or trims the container.
+    // Fails if the output overflowed into its spare byte.
+    bool flush()
+    {
+        if (written() > m_limit)
+            return false;
+        if (!m_sink)
+        {
+            if (!m_target)
+                return m_used <= m_size;
+            m_trim(m_target, m_used);
+            return true;
+        }
+        if (m_used && !m_sink(m_data, m_used))
+            return false;
+        m_flushed += m_used;
+        m_used = 0;
+        return true;
+    }
+
+    // The bytes the codec wrote in all.
+    size_t written() const
+    {
+        return m_flushed + m_used - m_base;
+    }
+
+    // The bytes written, for a fixed buffer.
+    size_t used() const
+    {
+        return m_used;
+    }
+
+    // How many times the container was moved to a bigger buffer.
+    size_t reallocs() const
+    {
+        return m_reallocs;
+    }
+
+protected:
+    void *m_target;
+    bool (*m_grow)(void *target, size_t used, char *& data, size_t& size);
+    void (*m_trim)(void *target, size_t used);
+    char *m_data;
+    size_t m_size;
+    size_t m_used;
+    size_t m_reallocs;
+    size_t m_base;      // the size of the container before
+    size_t m_flushed;   // the bytes given to the sink
+    size_t m_limit;
+    char m_spare;
+    std::string m_buffer;
+    comp_decomp_sink m_sink;
+
+    // Returns true if the buffer was moved.
+    template <typename T_BUFFER>
+    static bool grow_buffer(void *target, size_t used, char *& data, size_t& size)
+    {
+        static_assert(sizeof(typename T_BUFFER::value_type) == 1, "needs a buffer of bytes");
+        T_BUFFER& buffer = *(T_BUFFER *)target;
+        size_t capacity = buffer.capacity();
+        comp_decomp_grow(buffer, used);
+        data = (char *)&buffer[0];
+        size = buffer.size();
+        return buffer.capacity() != capacity;
+    }
+
+    template <typename T_BUFFER>
+    static void trim_buffer(void *target, size_t used)
+    {
+        ((T_BUFFER *)target)->resize(used);
+    }
+
+private:
+    comp_decomp_output(const comp_decomp_output&) = delete;
+    comp_decomp_output& operator=(const comp_decomp_output&) = delete;
+};
+
+// Gives the codecs their work memory. The default takes it from malloc;
+// derive from it and override do_alloc/do_free to supply an arena or a pool
+// of your own. Pass it to a compressor, a decompressor or a *_comp/*_decomp
+// function, and it must outlive them. allocs() and bytes() count what was
+// served. An allocator must not be used by two threads at once.
+class comp_decomp_allocator
+{
+public:
+    comp_decomp_allocator() : m_allocs(0), m_bytes(0)
+    {
+    }
+
+    virtual ~comp_decomp_allocator()
+    {
+    }
+
+    void *alloc(size_t size)
+    {
+#ifdef COMP_DECOMP_STATS
+        // the size is kept before the block for free()
+        char *block = (char *)do_alloc(size + COMP_DECOMP_STATS_HEADER);
+        void *ptr = NULL;
+        if (block)
+        {
+            memcpy(block, &size, sizeof(size));
+            ptr = block + COMP_DECOMP_STATS_HEADER;
+            COMP_DECOMP_STATS_ALLOC(size);
+        }
+#else
+        void *ptr = do_alloc(size);
+#endif
+        if (ptr)
+        {
+            ++m_allocs;
+            m_bytes += size;
+        }
+        return ptr;
+    }
+
+    void free(void *ptr)
+    {
+        if (!ptr)
+            return;
+#ifdef COMP_DECOMP_STATS
+        char *block = (char *)ptr - COMP_DECOMP_STATS_HEADER;
+        size_t size;
+        memcpy(&size, block, sizeof(size));
+        COMP_DECOMP_STATS_FREE(size);
+        ptr = block;
+#endif
+        do_free(ptr);
+    }
+
+    // The number of allocations served.
+    size_t allocs() const
+    {
+        return m_allocs;
+    }
+
+    // The bytes of all the allocations served.
+    size_t bytes() const
+    {
+        return m_bytes;
+    }
+
+    void reset_counters()
+    {
+        m_allocs = m_bytes = 0;
+    }
+
+protected:
+    size_t m_allocs;
+    size_t m_bytes;
+
+    virtual void *do_alloc(size_t size)
+    {
+        return std::malloc(size);
+    }
+
+    virtual void do_free(void *ptr)
+    {
+        std::free(ptr);
+    }
+
+private:
+    comp_decomp_allocator(const comp_decomp_allocator&) = delete;
+    comp_decomp_allocator& operator=(const comp_decomp_allocator&) = delete;
+};
+
+// Keeps freed blocks so that a codec initialized again gets its work memory
+// back without going through malloc. The sizes are rounded up to classes at
+// most 1/8 apart, so that a block fits the next request of about the same
+// size. reused() counts the allocations served from freed blocks.
+class comp_decomp_pool : public comp_decomp_allocator
+{
+public:
+    comp_decomp_pool() : m_reused(0)
+    {
+    }
+
+    ~comp_decomp_pool()
+    {
+        clear();
+    }
+
+    // Gives the freed blocks back to the system.
+    void clear()
+    {
+        for (size_t i = 0; i < m_free.size(); ++i)
+        {
+            std::free(m_free[i]);
+        }
+        m_free.clear();
+    }
+
+    size_t reused() const
+    {
+        return m_reused;
+    }
+
+protected:
+    union header_t
+    {
+        size_t size;
+        double align1;
+        void *align2;
+        long long align3;
+        long double align4;
+    };
+    std::vector<header_t *> m_free;
+    size_t m_reused;
+
+    static size_t size_class(size_t size)
+    {
+        size_t step = 64;
+        while (step * 16 <= size)
+            step *= 2;
+        return (size + step - 1) & ~(step - 1);
+    }
+
+    virtual void *do_alloc(size_t size)
+    {
+        size = size_class(size);
+        for (size_t i = 0; i < m_free.size(); ++i)
+        {
+            if (m_free[i]->size == size)
+            {
+                header_t *header = m_free[i];
+                m_free[i] = m_free.back();
+                m_free.pop_back();
+                ++m_reused;
+                return header + 1;
+            }
+        }
+
+        header_t *header = (header_t *)std::malloc(sizeof(header_t) + size);
+        if (!header)
+            return NULL;
+        header->size = size;
+        return header + 1;
+    }
+
+    virtual void do_free(void *ptr)
+    {
+        m_free.push_back((header_t *)ptr - 1);
+    }
+};
+
+// A pool for the calling thread. Passing it to the *_comp/*_decomp functions
+// recycles the codec work memory between calls on the same thread. It is
+// destroyed at the thread's exit, so it must not be given to a context that
+// lives longer.
+inline comp_decomp_pool& comp_decomp_thread_pool(void)
+{
+    static thread_local comp_decomp_pool s_pool;
+    return s_pool;
+}
+
+// A preset dictionary: bytes that are likely to occur in the data, the
+// likeliest at the end. Both sides must use the same dictionary. It is not
+// changed after construction, so one dictionary can be shared by the
+// contexts of any number of threads.
+class comp_decomp_dict
+{
+public:
+    comp_decomp_dict()
+    {
+    }
+
+    comp_decomp_dict(const void *data, size_t size) : m_data((const char *)data, size)
+    {
+    }
+
+    explicit comp_decomp_dict(const std::string& data) : m_data(data)
+    {
+    }
+
+    const void *data() const
+    {
+        return m_data.data();
+    }
+
+    size_t size() const
+    {
+        return m_data.size();
+    }
+
+    bool empty() const
+    {
+        return m_data.empty();
+    }
+
+protected:
+    std::string m_data;
+};
+
+// Builds a dictionary of at most dict_size bytes from sample messages.
+// The runs of 8-byte strings that occur in two or more samples are scored
+// by how many samples contain them, and the best runs are kept with the
+// highest scores at the end, where deflate and LZMA reach them cheapest.
+// zlib uses the last 32 KB of a dictionary only.
+inline comp_decomp_dict
+comp_decomp_train_dict(const std::vector<std::string>& samples, size_t dict_size = 32 * 1024)
+{
+    const size_t gram = 8;
+    struct count_t
+    {
+        size_t samples;
+        size_t last;
+    };
+    std::unordered_map<uint64_t, count_t> counts;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const std::string& sample = samples[i];
+        for (size_t pos = 0; pos + gram <= sample.size(); ++pos)
+        {
+            uint64_t key;
+            memcpy(&key, &sample[pos], gram);
+            count_t& count = counts[key];
+            if (count.last != i + 1)
+            {
+                count.last = i + 1;
+                ++count.samples;
+            }
+        }
+    }
+
+    // the runs of common strings, each once
+    std::unordered_map<std::string, size_t> runs;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        const std::string& sample = samples[i];
+        size_t start = 0, score = 0;
+        for (size_t pos = 0; pos + gram <= sample.size() + 1; ++pos)
+        {
+            size_t count = 0;
+            if (pos + gram <= sample.size())
+            {
+                uint64_t key;
+                memcpy(&key, &sample[pos], gram);
+                count = counts[key].samples;
+            }
+            if (count >= 2)
+            {
+                if (score == 0)
+                    start = pos;
+                score += count;
+                continue;
+            }
+            if (score)
+                runs[sample.substr(start, pos - start + gram - 1)] = score;
+            score = 0;
+        }
+    }
+
+    std::vector<std::pair<size_t, const std::string *> > ranking;
+    for (auto& run : runs)
+    {
+        ranking.push_back(std::make_pair(run.second, &run.first));
+    }
+    std::sort(ranking.begin(), ranking.end(),
+              [](const std::pair<size_t, const std::string *>& a,
+                 const std::pair<size_t, const std::string *>& b) {
+                  return a.first > b.first || (a.first == b.first && *a.second < *b.second);
+              });
+
+    std::string chosen;
+    std::vector<const std::string *> order;
+    for (size_t i = 0; i < ranking.size(); ++i)
+    {
+        const std::string& run = *ranking[i].second;
+        if (chosen.size() + run.size() > dict_size || chosen.find(run) != std::string::npos)
+            continue;
+        chosen += run;
+        order.push_back(&run);
+    }
+
+    std::string dict;
+    dict.reserve(chosen.size());
+    for (size_t i = order.size(); i-- > 0; )
+    {
+        dict += *order[i];
+    }
+    return comp_decomp_dict(dict);
+}
+
+// Counts the bytes into four histograms in turn, so that repeats of a byte
+// do not wait for each other's increments and the loop can run in parallel.
+inline void comp_decomp_histogram(uint32_t counts[4][256], const unsigned char *ptr,
+                                  size_t size)
+{
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+    {
+        ++counts[0][ptr[i]];
+        ++counts[1][ptr[i + 1]];
+        ++counts[2][ptr[i + 2]];
+        ++counts[3][ptr[i + 3]];
+    }
+    for (; i < size; ++i)
+        ++counts[0][ptr[i]];
+}
+
+// Estimates the order-0 entropy of the input in bits per byte (0 to 8) from
+// about sample_size bytes in slices spread over it. The Miller-Madow term
+// corrects the bias of a small sample toward lower values.
+inline double comp_decomp_entropy(const void *input, size_t input_size,
+                                  size_t sample_size = 16 * 1024)
+{
+    const unsigned char *ptr = (const unsigned char *)input;
+    uint32_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+
+    const size_t slices = 16;
+    size_t total;
+    if (input_size <= sample_size || sample_size < slices)
+    {
+        comp_decomp_histogram(counts, ptr, input_size);
+        total = input_size;
+    }
+    else
+    {
+        size_t slice = sample_size / slices;
+        size_t step = (input_size - slice) / (slices - 1);
+        for (size_t i = 0; i < slices; ++i)
+            comp_decomp_histogram(counts, ptr + i * step, slice);
+        total = slice * slices;
+    }
+    if (total == 0)
+        return 0;
+
+    double entropy = 0;
+    int used = 0;
+    for (int byte = 0; byte < 256; ++byte)
+    {
+        uint32_t count = counts[0][byte] + counts[1][byte] + counts[2][byte] + counts[3][byte];
+        if (count)
+        {
+            double p = (double)count / total;
+            entropy -= p * std::log2(p);
+            ++used;
+        }
+    }
+    entropy += (used - 1) / (2.0 * total * std::log(2.0));
+    return std::min(entropy, 8.0);
+}
+
+// Whether the input looks not worth compressing: random, encrypted or
+// already compressed. Only the byte distribution is seen, so data that
+// repeats blocks of random bytes is taken for incompressible as well.
+inline bool comp_decomp_incompressible(const void *input, size_t input_size)
+{
+    if (COMP_DECOMP_STORE_ENTROPY <= 0 || input_size < COMP_DECOMP_STORE_MIN)
+        return false;
+    return comp_decomp_entropy(input, input_size) >= COMP_DECOMP_STORE_ENTROPY;
+}
+
+// Returns the number of worker threads to use. Zero means one per core.
+inline unsigned comp_decomp_threads(unsigned threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return threads ? threads : 1;
+}
+
+// Runs worker() on threads threads including the calling one.
+// The workers take their jobs from a shared atomic counter.
+template <typename T_WORKER>
+inline void comp_decomp_run_workers(unsigned threads, T_WORKER worker)
+{
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; ++i)
+    {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < pool.size(); ++i)
+    {
+        pool[i].join();
+    }
+}
+
+#endif  // ndef COMP_DECOMP_COMMON_HPP_
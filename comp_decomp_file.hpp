@@ -0,0 +1,608 @@
+// comp_decomp_file.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_FILE_HPP_
+#define COMP_DECOMP_FILE_HPP_
+
+#include "comp_decomp_common.hpp"
+#ifdef HAVE_ZLIB
+    #include "comp_decomp_zlib.hpp"
+#endif
+#ifdef HAVE_BZLIB
+    #include "comp_decomp_bzlib.hpp"
+#endif
+#ifdef HAVE_LZMA
+    #include "comp_decomp_lzma.hpp"
+#endif
+
+#include <cerrno>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+// struct comp_decomp_file_options;
+// comp_decomp_codec comp_decomp_codec_from_name(const char *filename);
+// int comp_decomp_with_coder(bool compress, comp_decomp_codec codec, int rate,
+//                            T_RUNNER& run);
+// int comp_file(const char *src, const char *dst,
+//               comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE, int rate = 9,
+//               const comp_decomp_file_options& options = comp_decomp_file_options());
+// int decomp_file(const char *src, const char *dst,
+//                 comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+//                 const comp_decomp_file_options& options = comp_decomp_file_options());
+// const char *comp_decomp_errmsg(comp_decomp_codec codec, int ret);
+// bool file_unittest(void);
+
+struct comp_decomp_file_options
+{
+    size_t write_size;  // bytes per write to the destination
+    bool sequential;    // madvise(MADV_SEQUENTIAL) and posix_fadvise hints
+    bool drop_cache;    // drop the source from the page cache when done
+
+    comp_decomp_file_options()
+        : write_size(1024 * 1024), sequential(true), drop_cache(false)
+    {
+    }
+};
+
+// ".zz"/".zlib" for zlib, ".bz2" for bzip2 and ".xz" for xz.
+inline comp_decomp_codec comp_decomp_codec_from_name(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    if (!dot)
+        return COMP_DECOMP_CODEC_NONE;
+
+    std::string ext(dot + 1);
+    for (size_t i = 0; i < ext.size(); ++i)
+    {
+        if ('A' <= ext[i] && ext[i] <= 'Z')
+            ext[i] = (char)(ext[i] - 'A' + 'a');
+    }
+    if (ext == "zz" || ext == "zlib")
+        return COMP_DECOMP_CODEC_ZLIB;
+    if (ext == "bz2")
+        return COMP_DECOMP_CODEC_BZLIB;
+    if (ext == "xz")
+        return COMP_DECOMP_CODEC_LZMA;
+    return COMP_DECOMP_CODEC_NONE;
+}
+
+inline const char *comp_decomp_errmsg(comp_decomp_codec codec, int ret)
+{
+    switch (ret)
+    {
+    case COMP_DECOMP_SINK_ERROR: return "sink error (COMP_DECOMP_SINK_ERROR)";
+    case COMP_DECOMP_FILE_ERROR: return "file error (COMP_DECOMP_FILE_ERROR)";
+    case COMP_DECOMP_CODEC_ERROR: return "unknown codec (COMP_DECOMP_CODEC_ERROR)";
+    }
+
+    switch (codec)
+    {
+#ifdef HAVE_ZLIB
+    case COMP_DECOMP_CODEC_ZLIB: return zlib_errmsg(ret);
+#endif
+#ifdef HAVE_BZLIB
+    case COMP_DECOMP_CODEC_BZLIB: return bzlib_errmsg(ret);
+#endif
+#ifdef HAVE_LZMA
+    case COMP_DECOMP_CODEC_LZMA: return lzma_errmsg(ret);
+#endif
+    default:
+        break;
+    }
+    return ret ? "unknown error" : "success";
+}
+
+// A read-only mapping of a whole file.
+class comp_decomp_file_map
+{
+public:
+    comp_decomp_file_map() : m_data(NULL), m_size(0)
+    {
+#ifdef _WIN32
+        m_file = INVALID_HANDLE_VALUE;
+        m_mapping = NULL;
+#else
+        m_fd = -1;
+#endif
+    }
+
+    ~comp_decomp_file_map()
+    {
+        close();
+    }
+
+    bool open(const char *path, bool sequential)
+    {
+#ifdef _WIN32
+        m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             sequential ? FILE_FLAG_SEQUENTIAL_SCAN : 0, NULL);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size))
+            return false;
+        m_size = (size_t)size.QuadPart;
+        if (m_size == 0)
+            return true;
+
+        m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_mapping)
+            return false;
+        m_data = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+        return m_data != NULL;
+#else
+        m_fd = ::open(path, O_RDONLY);
+        if (m_fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0)
+            return false;
+        m_size = (size_t)st.st_size;
+        if (m_size == 0)
+            return true;
+
+    #ifdef POSIX_FADV_SEQUENTIAL
+        if (sequential)
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+        void *ptr = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (ptr == MAP_FAILED)
+            return false;
+        m_data = ptr;
+        if (sequential)
+            madvise(ptr, m_size, MADV_SEQUENTIAL);
+        return true;
+#endif
+    }
+
+    void drop_cache()
+    {
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+        if (m_fd >= 0)
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+        m_mapping = NULL;
+#else
+        if (m_data)
+            munmap(m_data, m_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+        m_data = NULL;
+        m_size = 0;
+    }
+
+    const void *data() const
+    {
+        return m_data;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+protected:
+    void *m_data;
+    size_t m_size;
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_fd;
+#endif
+
+private:
+    comp_decomp_file_map(const comp_decomp_file_map&) = delete;
+    comp_decomp_file_map& operator=(const comp_decomp_file_map&) = delete;
+};
+
+// An output file written with one system call per chunk.
+class comp_decomp_file_writer
+{
+public:
+    comp_decomp_file_writer()
+    {
+#ifdef _WIN32
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        m_fd = -1;
+#endif
+    }
+
+    ~comp_decomp_file_writer()
+    {
+        close();
+    }
+
+    bool open(const char *path)
+    {
+#ifdef _WIN32
+        m_file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        return m_file != INVALID_HANDLE_VALUE;
+#else
+        m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        return m_fd >= 0;
+#endif
+    }
+
+    bool write(const void *data, size_t size)
+    {
+        const char *ptr = (const char *)data;
+        while (size > 0)
+        {
+#ifdef _WIN32
+            DWORD chunk = (size < 0x40000000) ? (DWORD)size : 0x40000000, written;
+            if (!WriteFile(m_file, ptr, chunk, &written, NULL))
+                return false;
+#else
+            ssize_t written = ::write(m_fd, ptr, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+#endif
+            ptr += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    bool close()
+    {
+        bool ok = true;
+#ifdef _WIN32
+        if (m_file != INVALID_HANDLE_VALUE)
+            ok = !!CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_fd >= 0)
+            ok = (::close(m_fd) == 0);
+        m_fd = -1;
+#endif
+        return ok;
+    }
+
+protected:
+#ifdef _WIN32
+    HANDLE m_file;
+#else
+    int m_fd;
+#endif
+
+private:
+    comp_decomp_file_writer(const comp_decomp_file_writer&) = delete;
+    comp_decomp_file_writer& operator=(const comp_decomp_file_writer&) = delete;
+};
+
+// An input file read with one system call per chunk.
+class comp_decomp_file_reader
+{
+public:
+    comp_decomp_file_reader()
+    {
+#ifdef _WIN32
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        m_fd = -1;
+#endif
+    }
+
+    ~comp_decomp_file_reader()
+    {
+        close();
+    }
+
+    bool open(const char *path, bool sequential)
+    {
+#ifdef _WIN32
+        m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             sequential ? FILE_FLAG_SEQUENTIAL_SCAN : 0, NULL);
+        return m_file != INVALID_HANDLE_VALUE;
+#else
+        m_fd = ::open(path, O_RDONLY);
+        if (m_fd < 0)
+            return false;
+    #ifdef POSIX_FADV_SEQUENTIAL
+        if (sequential)
+            posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #else
+        (void)sequential;
+    #endif
+        return true;
+#endif
+    }
+
+    // Reads up to size bytes, fewer only at the end of the file. Returns
+    // false on failure.
+    bool read(void *data, size_t size, size_t& got)
+    {
+        char *ptr = (char *)data;
+        got = 0;
+        while (got < size)
+        {
+#ifdef _WIN32
+            DWORD chunk = (size - got < 0x40000000) ? (DWORD)(size - got) : 0x40000000, done;
+            if (!ReadFile(m_file, ptr + got, chunk, &done, NULL))
+                return false;
+#else
+            ssize_t done = ::read(m_fd, ptr + got, size - got);
+            if (done < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+#endif
+            if (done == 0)
+                break;
+            got += done;
+        }
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+    }
+
+protected:
+#ifdef _WIN32
+    HANDLE m_file;
+#else
+    int m_fd;
+#endif
+
+private:
+    comp_decomp_file_reader(const comp_decomp_file_reader&) = delete;
+    comp_decomp_file_reader& operator=(const comp_decomp_file_reader&) = delete;
+};
+
+// Makes the compressor or decompressor context of codec and calls
+// run(context), where run has a member template int operator()(T_CODER&).
+// Returns COMP_DECOMP_CODEC_ERROR for a codec that is not available.
+template <typename T_RUNNER>
+inline int comp_decomp_with_coder(bool compress, comp_decomp_codec codec, int rate,
+                                  T_RUNNER& run)
+{
+    switch (codec)
+    {
+#ifdef HAVE_ZLIB
+    case COMP_DECOMP_CODEC_ZLIB:
+        if (compress)
+        {
+            zlib_compressor coder(rate);
+            return run(coder);
+        }
+        else
+        {
+            zlib_decompressor coder;
+            return run(coder);
+        }
+#endif
+#ifdef HAVE_BZLIB
+    case COMP_DECOMP_CODEC_BZLIB:
+        if (compress)
+        {
+            bzlib_compressor coder(rate);
+            return run(coder);
+        }
+        else
+        {
+            bzlib_decompressor coder;
+            return run(coder);
+        }
+#endif
+#ifdef HAVE_LZMA
+    case COMP_DECOMP_CODEC_LZMA:
+        if (compress)
+        {
+            lzma_compressor coder(rate);
+            return run(coder);
+        }
+        else
+        {
+            lzma_decompressor coder;
+            return run(coder);
+        }
+#endif
+    default:
+        return COMP_DECOMP_CODEC_ERROR;
+    }
+}
+
+// Streams the mapped source through a compressor or decompressor context
+// whose output buffer is written out write_size bytes at a time.
+template <typename T_CODER>
+inline int comp_decomp_file_run(T_CODER& coder, const comp_decomp_file_map& src,
+                                comp_decomp_file_writer& dst, size_t write_size)
+{
+    comp_decomp_sink sink = [&](const void *data, size_t size) {
+        return dst.write(data, size);
+    };
+
+    int ret = (int)coder.begin(sink, write_size);
+    if (!ret)
+        ret = (int)coder.write(src.data(), src.size());
+    if (!ret)
+        ret = (int)coder.finish();
+    return (ret == COMP_DECOMP_SINK_ERROR) ? COMP_DECOMP_FILE_ERROR : ret;
+}
+
+struct comp_decomp_file_runner
+{
+    const comp_decomp_file_map& src;
+    comp_decomp_file_writer& dst;
+    size_t write_size;
+
+    template <typename T_CODER>
+    int operator()(T_CODER& coder)
+    {
+        return comp_decomp_file_run(coder, src, dst, write_size);
+    }
+};
+
+inline int comp_decomp_file(bool compress, const char *src, const char *dst,
+                            comp_decomp_codec codec, int rate,
+                            const comp_decomp_file_options& options)
+{
+    if (codec == COMP_DECOMP_CODEC_NONE)
+        codec = comp_decomp_codec_from_name(compress ? dst : src);
+
+    comp_decomp_file_map input;
+    if (!input.open(src, options.sequential))
+        return COMP_DECOMP_FILE_ERROR;
+
+    comp_decomp_file_writer output;
+    if (!output.open(dst))
+        return COMP_DECOMP_FILE_ERROR;
+
+    comp_decomp_file_runner runner = { input, output, options.write_size };
+    int ret = comp_decomp_with_coder(compress, codec, rate, runner);
+
+    if (options.drop_cache)
+        input.drop_cache();
+    if (!output.close() && !ret)
+        ret = COMP_DECOMP_FILE_ERROR;
+    if (ret)
+        remove(dst);
+    return ret;
+}
+
+// Compresses the file src into dst. The codec defaults to the one that
+// the name of dst implies.
+inline int comp_file(const char *src, const char *dst,
+                     comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE, int rate = 9,
+                     const comp_decomp_file_options& options = comp_decomp_file_options())
+{
+    return comp_decomp_file(true, src, dst, codec, rate, options);
+}
+
+// Decompresses the file src into dst. The codec defaults to the one that
+// the name of src implies.
+inline int decomp_file(const char *src, const char *dst,
+                       comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+                       const comp_decomp_file_options& options = comp_decomp_file_options())
+{
+    return comp_decomp_file(false, src, dst, codec, 9, options);
+}
+
+inline bool file_test_entry(const char *original_name, const std::string& original,
+                            const char *encoded_name)
+{
+    const char *decoded_name = "comp_decomp_file_test.out";
+    comp_decomp_codec codec = comp_decomp_codec_from_name(encoded_name);
+
+    comp_decomp_file_options options;
+    options.write_size = 4096;
+    if (int ret = comp_file(original_name, encoded_name, COMP_DECOMP_CODEC_NONE, 6, options))
+    {
+        printf("comp_file failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+    if (int ret = decomp_file(encoded_name, decoded_name, COMP_DECOMP_CODEC_NONE, options))
+    {
+        printf("decomp_file failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+
+    std::string decoded;
+    if (FILE *fp = fopen(decoded_name, "rb"))
+    {
+        char buf[4096];
+        size_t size;
+        while ((size = fread(buf, 1, sizeof(buf), fp)) > 0)
+        {
+            decoded.append(buf, size);
+        }
+        fclose(fp);
+    }
+    remove(encoded_name);
+    remove(decoded_name);
+
+    if (!(original == decoded))
+    {
+        printf("file mismatch (%s)\n", encoded_name);
+        return false;
+    }
+    return true;
+}
+
+inline bool file_unittest(void)
+{
+    const char *original_name = "comp_decomp_file_test.dat";
+
+    if (comp_decomp_codec_from_name("a.tar.XZ") != COMP_DECOMP_CODEC_LZMA ||
+        comp_decomp_codec_from_name("a.bz2") != COMP_DECOMP_CODEC_BZLIB ||
+        comp_decomp_codec_from_name("a.zz") != COMP_DECOMP_CODEC_ZLIB ||
+        comp_decomp_codec_from_name("a.txt") != COMP_DECOMP_CODEC_NONE)
+    {
+        printf("comp_decomp_codec_from_name failed\n");
+        return false;
+    }
+    if (comp_file("comp_decomp_no_such_file", "comp_decomp_file_test.xz") !=
+        COMP_DECOMP_FILE_ERROR)
+    {
+        printf("comp_file succeeded on a missing file\n");
+        return false;
+    }
+
+    std::string original;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        original += (char)('a' + std::rand() % 4);
+    }
+
+    FILE *fp = fopen(original_name, "wb");
+    if (!fp)
+        return false;
+    fwrite(original.data(), 1, original.size(), fp);
+    fclose(fp);
+
+    bool ok = true;
+#ifdef HAVE_ZLIB
+    ok = ok && file_test_entry(original_name, original, "comp_decomp_file_test.zz");
+#endif
+#ifdef HAVE_BZLIB
+    ok = ok && file_test_entry(original_name, original, "comp_decomp_file_test.bz2");
+#endif
+#ifdef HAVE_LZMA
+    ok = ok && file_test_entry(original_name, original, "comp_decomp_file_test.xz");
+#endif
+    remove(original_name);
+    return ok;
+}
+
+#endif  // ndef COMP_DECOMP_FILE_HPP_
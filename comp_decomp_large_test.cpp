@@ -0,0 +1,164 @@
+// comp_decomp_large_test.cpp --- round trips of more than 4 GiB
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#include <chrono>
+#include <cstdint>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+#include "comp_decomp.hpp"
+
+namespace cr = std::chrono;
+typedef cr::high_resolution_clock my_clock;
+
+// Zero-filled memory that takes no real pages until written.
+static char *alloc_sparse(size_t size)
+{
+#ifdef _WIN32
+    return (char *)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : (char *)ptr;
+#endif
+}
+
+static void free_sparse(char *ptr, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+// Memory for the decoded data. Outside Windows it is a mapped temporary
+// file, so that the system can write it out instead of holding it all.
+static char *alloc_output(size_t size)
+{
+#ifdef _WIN32
+    return alloc_sparse(size);
+#else
+    FILE *fp = tmpfile();
+    if (!fp)
+        return NULL;
+    void *ptr = MAP_FAILED;
+    if (ftruncate(fileno(fp), (off_t)size) == 0)
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    fclose(fp);
+    return (ptr == MAP_FAILED) ? NULL : (char *)ptr;
+#endif
+}
+
+static double mb_per_sec(size_t size, my_clock::time_point time1)
+{
+    double sec = cr::duration<double>(my_clock::now() - time1).count();
+    return size / (sec * 1024 * 1024);
+}
+
+template <typename T_COMP, typename T_DECOMP>
+static bool large_test(const char *name, const char *input, size_t size,
+                       T_COMP comp, T_DECOMP decomp)
+{
+    std::string encoded;
+
+    auto time1 = my_clock::now();
+    if (int ret = comp(encoded, input, size))
+    {
+        printf("%s: compression failed (%d)\n", name, ret);
+        return false;
+    }
+    printf("%s: %lu -> %lu bytes, %.1f MB/s\n", name, (unsigned long)size,
+           (unsigned long)encoded.size(), mb_per_sec(size, time1));
+    fflush(stdout);
+
+    char *decoded = alloc_output(size);
+    if (!decoded)
+    {
+        printf("%s: cannot allocate %lu bytes\n", name, (unsigned long)size);
+        return false;
+    }
+
+    size_t written = 0;
+    time1 = my_clock::now();
+    int ret = decomp(decoded, size, written, encoded.data(), encoded.size());
+    if (ret)
+    {
+        printf("%s: decompression failed (%d)\n", name, ret);
+        free_sparse(decoded, size);
+        return false;
+    }
+    printf("%s: %lu -> %lu bytes, %.1f MB/s\n", name, (unsigned long)encoded.size(),
+           (unsigned long)written, mb_per_sec(size, time1));
+    fflush(stdout);
+
+    bool ok = (written == size);
+    for (size_t pos = 0; ok && pos < size; pos += 1024 * 1024)
+    {
+        size_t len = (size - pos < 1024 * 1024) ? size - pos : 1024 * 1024;
+        ok = (memcmp(decoded + pos, input + pos, len) == 0);
+    }
+    free_sparse(decoded, size);
+    if (!ok)
+    {
+        printf("%s: mismatch\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    if (sizeof(size_t) <= 4)
+    {
+        printf("skipped: 32-bit size_t\n");
+        return 0;
+    }
+
+    const size_t size = (size_t)UINT_MAX + 3 * 1024 * 1024 + 123;
+    char *input = alloc_sparse(size);
+    if (!input)
+    {
+        printf("cannot allocate %lu bytes\n", (unsigned long)size);
+        return 1;
+    }
+
+    // a few marks around the 4 GiB boundary
+    const size_t marks[] = { 0, 12345, (size_t)UINT_MAX - 1, (size_t)UINT_MAX,
+                             (size_t)UINT_MAX + 1, size - 1 };
+    for (size_t i = 0; i < sizeof(marks) / sizeof(marks[0]); ++i)
+    {
+        input[marks[i]] = (char)('a' + i);
+    }
+
+    bool ok = true;
+#ifdef HAVE_ZLIB
+    ok = ok && large_test("zlib", input, size,
+        [](std::string& output, const void *input, size_t size) {
+            return zlib_comp(output, input, size, 1);
+        },
+        [](void *output, size_t output_size, size_t& written,
+           const void *input, size_t input_size) {
+            return zlib_decomp(output, output_size, written, input, input_size);
+        });
+#endif
+#ifdef HAVE_BZLIB
+    ok = ok && large_test("bzlib", input, size,
+        [](std::string& output, const void *input, size_t size) {
+            return bzlib_comp(output, input, size, 1);
+        },
+        [](void *output, size_t output_size, size_t& written,
+           const void *input, size_t input_size) {
+            return bzlib_decomp(output, output_size, written, input, input_size);
+        });
+#endif
+
+    free_sparse(input, size);
+
+    printf(ok ? "done!\n" : "failed!\n");
+    return ok ? 0 : 1;
+}
@@ -4,196 +4,1675 @@
 #ifndef COMP_DECOMP_LZMA_HPP_
 #define COMP_DECOMP_LZMA_HPP_
 
-#include <cstdlib>
-#include <cstdio>
-#include <cassert>
-#include <cstring>
-#include <string>
-
-#ifndef COMP_DECOMP_BUFFSIZE
-    #define COMP_DECOMP_BUFFSIZE (8 * 1024)
+#include "comp_decomp_common.hpp"
+
+// class lzma_compressor;
+// class lzma_decompressor;
+// struct lzma_options;
+// int lzma_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               int rate = 9, comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, int rate = 9,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               const lzma_options& options, comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, const lzma_options& options,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int lzma_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                 size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// int lzma_decomp(void *output, size_t output_size, size_t& written,
+//                 const void *input, size_t input_size,
+//                 comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// size_t lzma_comp_bound(size_t input_size);
+// int lzma_store(T_BUFFER& output, const void *input, size_t input_size,
+//                lzma_check check = LZMA_CHECK_CRC64);
+// int lzma_store(void *output, size_t output_size, size_t& written,
+//                const void *input, size_t input_size,
+//                lzma_check check = LZMA_CHECK_CRC64);
+// int lzma_comp_mt(std::string& output, const void *input, size_t input_size,
+//                  int rate = 9, unsigned threads = 0, size_t block_size = 0);
+// int lzma_decomp_mt(std::string& output, const void *input,
+//                    size_t input_size, unsigned threads = 0);
+// int lzma_comp_seekable(std::string& output, const void *input, size_t input_size,
+//                        int rate = 9, size_t block_size = 1024 * 1024,
+//                        unsigned threads = 0);
+// int lzma_decomp_range(T_BUFFER& output, const void *input, size_t input_size,
+//                       size_t offset, size_t length);
+// lzma_ret lzma_decode_index(lzma_index **index, const void *input, size_t input_size);
+// size_t lzma_expected_size(const void *input, size_t input_size);
+// const char *lzma_errmsg(int ret);
+// bool lzma_unittest(void);
+
+#ifdef HAVE_LZMA
+    #include <lzma.h>
+
+    // The LZMA2 dictionary size of data compressed with a preset dictionary.
+    // The raw format does not record it, so both sides must agree.
+    #ifndef COMP_DECOMP_LZMA_RAW_DICT_SIZE
+        #define COMP_DECOMP_LZMA_RAW_DICT_SIZE (1 << 20)
+    #endif
+
+    // The most bytes lzma_comp can write for input_size bytes of input.
+    inline size_t lzma_comp_bound(size_t input_size)
+    {
+        return lzma_stream_buffer_bound(input_size);
+    }
+
+    inline void *lzma_allocator_alloc(void *opaque, size_t nmemb, size_t size)
+    {
+        return ((comp_decomp_allocator *)opaque)->alloc(nmemb * size);
+    }
+
+    inline void lzma_allocator_free(void *opaque, void *ptr)
+    {
+        ((comp_decomp_allocator *)opaque)->free(ptr);
+    }
+
+    // Tuning of lzma_compressor beyond the rate (the xz preset). dict_size
+    // (0 for the preset's) is also about the work memory of the
+    // decompressor. filter puts a BCJ filter (LZMA_FILTER_X86,
+    // LZMA_FILTER_ARM, ...) for executable code or LZMA_FILTER_DELTA for
+    // samples of delta_distance bytes before LZMA2. The decompressor reads
+    // all of this from the .xz headers. With a preset dictionary only rate
+    // and extreme apply, as the raw format records nothing.
+    struct lzma_options
+    {
+        int rate;                   // 0 to 9
+        bool extreme;               // LZMA_PRESET_EXTREME: slower, a little smaller
+        uint32_t dict_size;
+        lzma_check check;           // LZMA_CHECK_NONE, _CRC32, _CRC64 or _SHA256
+        lzma_vli filter;            // LZMA_VLI_UNKNOWN for none
+        uint32_t delta_distance;    // 1 to 256
+
+        explicit lzma_options(int rate_ = 9)
+            : rate(rate_), extreme(false), dict_size(0), check(LZMA_CHECK_CRC64),
+              filter(LZMA_VLI_UNKNOWN), delta_distance(1)
+        {
+        }
+
+        // Preset 0 with the cheaper CRC32 check.
+        static lzma_options fastest()
+        {
+            lzma_options options(0);
+            options.check = LZMA_CHECK_CRC32;
+            return options;
+        }
+
+        // Preset 0 with a 64 KiB dictionary: about 1.5 MiB of work memory to
+        // compress and 100 KiB to decompress.
+        static lzma_options low_memory()
+        {
+            lzma_options options(0);
+            options.dict_size = 64 * 1024;
+            return options;
+        }
+
+        uint32_t preset() const
+        {
+            return (uint32_t)rate | (extreme ? LZMA_PRESET_EXTREME : 0);
+        }
+    };
+
+    // Fills the filter chain of the .xz streams of options. lzma2 and delta
+    // hold the options of the filters, and must live as long as filters.
+    inline lzma_ret lzma_stream_filters(lzma_filter filters[3], lzma_options_lzma& lzma2,
+                                        lzma_options_delta& delta, const lzma_options& options)
+    {
+        if (lzma_lzma_preset(&lzma2, options.preset()))
+            return LZMA_OPTIONS_ERROR;
+        if (options.dict_size)
+            lzma2.dict_size = options.dict_size;
+
+        size_t i = 0;
+        if (options.filter != LZMA_VLI_UNKNOWN)
+        {
+            filters[i].id = options.filter;
+            filters[i].options = NULL;
+            if (options.filter == LZMA_FILTER_DELTA)
+            {
+                memset(&delta, 0, sizeof(delta));
+                delta.type = LZMA_DELTA_TYPE_BYTE;
+                delta.dist = options.delta_distance;
+                filters[i].options = &delta;
+            }
+            ++i;
+        }
+        filters[i].id = LZMA_FILTER_LZMA2;
+        filters[i].options = &lzma2;
+        filters[i + 1].id = LZMA_VLI_UNKNOWN;
+        filters[i + 1].options = NULL;
+        return LZMA_OK;
+    }
+
+    // Fills the raw LZMA2 filter chain for data compressed with dict.
+    // The .xz format has no place for a preset dictionary.
+    inline lzma_ret lzma_raw_filters(lzma_filter filters[2], lzma_options_lzma& options,
+                                     uint32_t preset, const comp_decomp_dict& dict)
+    {
+        if (lzma_lzma_preset(&options, preset))
+            return LZMA_OPTIONS_ERROR;
+        options.dict_size = COMP_DECOMP_LZMA_RAW_DICT_SIZE;
+        options.preset_dict = (const uint8_t *)dict.data();
+        options.preset_dict_size = (uint32_t)dict.size();
+        if (dict.size() > options.dict_size)
+        {
+            options.preset_dict += dict.size() - options.dict_size;
+            options.preset_dict_size = options.dict_size;
+        }
+        filters[0].id = LZMA_FILTER_LZMA2;
+        filters[0].options = &options;
+        filters[1].id = LZMA_VLI_UNKNOWN;
+        filters[1].options = NULL;
+        return LZMA_OK;
+    }
+
+    // Makes strm take its work memory from allocator through wrapper, if
+    // allocator is not NULL. wrapper must live as long as strm.
+    inline void lzma_set_allocator(lzma_stream& strm, lzma_allocator& wrapper,
+                                   comp_decomp_allocator *allocator)
+    {
+        if (allocator)
+        {
+            wrapper.alloc = lzma_allocator_alloc;
+            wrapper.free = lzma_allocator_free;
+            wrapper.opaque = allocator;
+            strm.allocator = &wrapper;
+        }
+    }
+
+    // Runs an initialized lzma_stream over the input into out. With LZMA_RUN
+    // it returns LZMA_OK once all the input is taken, and with LZMA_FINISH
+    // it returns LZMA_STREAM_END at the end of the stream.
+    inline int lzma_code_into(lzma_stream *strm, comp_decomp_output& out,
+                              const void *input, size_t input_size,
+                              lzma_action action)
+    {
+        strm->next_in = (const uint8_t *)input;
+        strm->avail_in = input_size;
+
+        for (;;)
+        {
+            char *next_out;
+            size_t avail;
+            if (!out.space(next_out, avail))
+                return out.error();
+            strm->next_out = (uint8_t *)next_out;
+            strm->avail_out = avail;
+
+            int ret = lzma_code(strm, action);
+
+            out.commit(avail - strm->avail_out);
+            if (ret == LZMA_STREAM_END)
+                return ret;
+            if (action == LZMA_RUN && strm->avail_in == 0 &&
+                (ret == LZMA_BUF_ERROR || (ret == LZMA_OK && strm->avail_out > 0)))
+            {
+                return LZMA_OK;
+            }
+            if (ret != LZMA_OK)
+                return ret;
+        }
+    }
+
+    // Runs an initialized lzma_stream over the whole input into output.
+    // The number of reallocations of output goes to *reallocs. More than
+    // max_output bytes (0 for any) fail with COMP_DECOMP_LIMIT_ERROR.
+    template <typename T_BUFFER>
+    inline int lzma_code_all(lzma_stream *strm, T_BUFFER& output,
+                             const void *input, size_t input_size,
+                             size_t *reallocs = NULL, size_t max_output = 0)
+    {
+        comp_decomp_output out(output);
+        out.limit(max_output);
+        int ret = lzma_code_into(strm, out, input, input_size, LZMA_FINISH);
+        if (reallocs)
+            *reallocs = out.reallocs();
+        if (ret != LZMA_STREAM_END)
+        {
+            output.clear();
+            return ret;
+        }
+        if (!out.flush())
+        {
+            output.clear();
+            return out.error();
+        }
+        return LZMA_OK;
+    }
+
+    // Runs an initialized lzma_stream over the whole input into the
+    // output_size bytes at output. The size of the result goes to written.
+    inline int lzma_code_all(lzma_stream *strm, void *output, size_t output_size,
+                             size_t& written, const void *input, size_t input_size,
+                             size_t max_output = 0)
+    {
+        written = 0;
+        comp_decomp_output out(output, output_size);
+        out.limit(max_output);
+        int ret = lzma_code_into(strm, out, input, input_size, LZMA_FINISH);
+        if (ret != LZMA_STREAM_END)
+            return ret;
+        if (!out.flush())
+            return out.error();
+        written = out.used();
+        return LZMA_OK;
+    }
+
+    // Reads the indexes of all the xz streams in input, from the end
+    // backwards, and joins them into *index. Free it with lzma_index_end.
+    inline lzma_ret lzma_decode_index(lzma_index **index, const void *input,
+                                      size_t input_size)
+    {
+        const uint8_t *ptr = (const uint8_t *)input;
+        lzma_index *combined = NULL;
+        size_t pos = input_size;
+
+        *index = NULL;
+        lzma_ret ret = LZMA_OK;
+        while (pos > 0)
+        {
+            size_t padding = 0;
+            while (pos >= 4 && memcmp(ptr + pos - 4, "\0\0\0\0", 4) == 0)
+            {
+                pos -= 4;
+                padding += 4;
+            }
+            if (pos < 2 * LZMA_STREAM_HEADER_SIZE)
+            {
+                ret = LZMA_DATA_ERROR;
+                break;
+            }
+
+            lzma_stream_flags footer;
+            ret = lzma_stream_footer_decode(&footer, ptr + pos - LZMA_STREAM_HEADER_SIZE);
+            if (ret != LZMA_OK)
+                break;
+            if (pos - 2 * LZMA_STREAM_HEADER_SIZE < footer.backward_size)
+            {
+                ret = LZMA_DATA_ERROR;
+                break;
+            }
+
+            uint64_t memlimit = UINT64_MAX;
+            lzma_index *idx = NULL;
+            size_t in_pos = pos - LZMA_STREAM_HEADER_SIZE - (size_t)footer.backward_size;
+            ret = lzma_index_buffer_decode(&idx, &memlimit, NULL, ptr, &in_pos,
+                                           pos - LZMA_STREAM_HEADER_SIZE);
+            if (ret != LZMA_OK)
+                break;
+
+            lzma_vli stream_size = lzma_index_stream_size(idx);
+            lzma_stream_flags header;
+            if (stream_size > pos)
+                ret = LZMA_DATA_ERROR;
+            else
+                ret = lzma_stream_header_decode(&header, ptr + pos - stream_size);
+            if (ret == LZMA_OK)
+                ret = lzma_stream_flags_compare(&header, &footer);
+            if (ret == LZMA_OK)
+                ret = lzma_index_stream_flags(idx, &footer);
+            if (ret == LZMA_OK)
+                ret = lzma_index_stream_padding(idx, padding);
+            if (ret == LZMA_OK && combined)
+                ret = lzma_index_cat(idx, combined, NULL);
+            if (ret != LZMA_OK)
+            {
+                lzma_index_end(idx, NULL);
+                break;
+            }
+
+            combined = idx;
+            pos -= (size_t)stream_size;
+        }
+
+        if (ret != LZMA_OK || !combined)
+        {
+            if (combined)
+                lzma_index_end(combined, NULL);
+            return (ret != LZMA_OK) ? ret : LZMA_DATA_ERROR;
+        }
+
+        *index = combined;
+        return LZMA_OK;
+    }
+
+    // Returns the decompressed size recorded in the xz indexes of input, or 0
+    // if they cannot be read or tell more than xz reaches (about 7000:1).
+    inline size_t lzma_expected_size(const void *input, size_t input_size)
+    {
+        lzma_index *index;
+        if (lzma_decode_index(&index, input, input_size) != LZMA_OK)
+            return 0;
+
+        lzma_vli size = lzma_index_uncompressed_size(index);
+        lzma_index_end(index, NULL);
+        if (size / 16384 > input_size)
+            return 0;
+        return (size_t)size;
+    }
+
+    // Whether the sizes in index can come from input_size bytes of xz data:
+    // neither the whole nor a block expands more than xz reaches. A forged
+    // index then cannot make the decoders allocate more than that.
+    inline bool lzma_index_plausible(const lzma_index *index, size_t input_size)
+    {
+        if (lzma_index_uncompressed_size(index) / 16384 > input_size)
+            return false;
+
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+        {
+            if (iter.block.uncompressed_size / 16384 > iter.block.total_size)
+                return false;
+        }
+        return true;
+    }
+
+    // Owns a lzma_stream. liblzma reuses the memory of an initialized
+    // stream when the same encoder is set up on it again.
+    // Use comp() for a whole buffer, or begin()/write()/finish() to stream
+    // the compressed data to a sink in pieces of buffsize bytes.
+    // The work memory comes from allocator, or from malloc if it is NULL.
+    // An object must not be used by two threads at once.
+    class lzma_compressor
+    {
+    public:
+        explicit lzma_compressor(int rate = 9, comp_decomp_allocator *allocator = NULL)
+            : lzma_compressor(lzma_options(rate), allocator)
+        {
+        }
+
+        explicit lzma_compressor(const lzma_options& options,
+                                 comp_decomp_allocator *allocator = NULL)
+            : m_options(options), m_reallocs(0), m_dict(NULL)
+        {
+            assert(0 <= options.rate && options.rate <= 9);
+            lzma_stream strm = LZMA_STREAM_INIT;
+            m_strm = strm;
+            lzma_set_allocator(m_strm, m_allocator, allocator);
+        }
+
+        ~lzma_compressor()
+        {
+            lzma_end(&m_strm);
+        }
+
+        // The output is reserved once, from lzma_comp_bound.
+        template <typename T_BUFFER>
+        int comp(T_BUFFER& output, const void *input, size_t input_size)
+        {
+            output.clear();
+            m_reallocs = 0;
+            comp_decomp_reserve(output, lzma_comp_bound(input_size));
+
+            int ret = reset();
+            if (ret != LZMA_OK)
+                return ret;
+
+            return lzma_code_all(&m_strm, output, input, input_size, &m_reallocs);
+        }
+
+        // Compresses into the output_size bytes at output. Returns
+        // COMP_DECOMP_SPACE_ERROR if they are not enough, which never
+        // happens with lzma_comp_bound(input_size) bytes.
+        int comp(void *output, size_t output_size, size_t& written,
+                 const void *input, size_t input_size)
+        {
+            written = 0;
+            m_reallocs = 0;
+
+            int ret = reset();
+            if (ret != LZMA_OK)
+                return ret;
+
+            return lzma_code_all(&m_strm, output, output_size, written, input, input_size);
+        }
+
+        int begin(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+        {
+            m_out.reset(sink, buffsize);
+            return reset();
+        }
+
+        int write(const void *input, size_t input_size)
+        {
+            return lzma_code_into(&m_strm, m_out, input, input_size, LZMA_RUN);
+        }
+
+        int finish()
+        {
+            int ret = lzma_code_into(&m_strm, m_out, NULL, 0, LZMA_FINISH);
+            if (ret != LZMA_STREAM_END)
+                return ret;
+            if (!m_out.flush())
+                return COMP_DECOMP_SINK_ERROR;
+            return LZMA_OK;
+        }
+
+        // Compresses the following data against dict (NULL for none), which
+        // must outlive its use. With a dictionary the output is raw LZMA2
+        // (no .xz headers) that only a decompressor with the same
+        // dictionary reads.
+        void set_dict(const comp_decomp_dict *dict)
+        {
+            m_dict = dict;
+        }
+
+        // How many times the output of the last comp() was reallocated.
+        size_t reallocs() const
+        {
+            return m_reallocs;
+        }
+
+        // The work memory of the coder. liblzma counts it for decoders only,
+        // so this is its estimate for the filters, or 0 if they are wrong.
+        uint64_t memusage() const
+        {
+            lzma_options_lzma lzma2;
+            lzma_options_delta delta;
+            lzma_filter filters[3];
+            int ret;
+            if (m_dict)
+                ret = lzma_raw_filters(filters, lzma2, m_options.preset(), *m_dict);
+            else
+                ret = lzma_stream_filters(filters, lzma2, delta, m_options);
+            if (ret != LZMA_OK)
+                return 0;
+            uint64_t usage = lzma_raw_encoder_memusage(filters);
+            return (usage == UINT64_MAX) ? 0 : usage;
+        }
+
+    protected:
+        lzma_stream m_strm;
+        lzma_allocator m_allocator;
+        lzma_options m_options;
+        size_t m_reallocs;
+        const comp_decomp_dict *m_dict;
+        comp_decomp_output m_out;
+
+        int reset()
+        {
+            lzma_options_lzma lzma2;
+            lzma_filter filters[3];
+            int ret;
+            if (m_dict)
+            {
+                ret = lzma_raw_filters(filters, lzma2, m_options.preset(), *m_dict);
+                if (ret != LZMA_OK)
+                    return ret;
+                return lzma_raw_encoder(&m_strm, filters);
+            }
+
+            lzma_options_delta delta;
+            ret = lzma_stream_filters(filters, lzma2, delta, m_options);
+            if (ret != LZMA_OK)
+                return ret;
+            return lzma_stream_encoder(&m_strm, filters, m_options.check);
+        }
+
+    private:
+        lzma_compressor(const lzma_compressor&) = delete;
+        lzma_compressor& operator=(const lzma_compressor&) = delete;
+    };
+
+    // See lzma_compressor. Concatenated .xz streams are decoded in order.
+    class lzma_decompressor
+    {
+    public:
+        explicit lzma_decompressor(comp_decomp_allocator *allocator = NULL)
+            : m_reallocs(0), m_dict(NULL)
+        {
+            lzma_stream strm = LZMA_STREAM_INIT;
+            m_strm = strm;
+            lzma_set_allocator(m_strm, m_allocator, allocator);
+        }
+
+        ~lzma_decompressor()
+        {
+            lzma_end(&m_strm);
+        }
+
+        // size_hint is the expected decompressed size, if known. Without
+        // it, the size in the xz indexes is used up to comp_decomp_data_hint,
+        // or else a guess.
+        template <typename T_BUFFER>
+        int decomp(T_BUFFER& output, const void *input, size_t input_size,
+                   size_t size_hint = 0)
+        {
+            output.clear();
+            m_reallocs = 0;
+            if (size_hint == 0)
+                size_hint = comp_decomp_data_hint(lzma_expected_size(input, input_size),
+                                                  input_size);
+            if (m_limits.max_output && size_hint > m_limits.max_output)
+                size_hint = m_limits.max_output;
+            if (size_hint)
+                comp_decomp_reserve(output, size_hint);
+            else
+                output.reserve(input_size * 3 / 2);
+
+            int ret = reset();
+            if (ret != LZMA_OK)
+                return ret;
+
+            return limited(lzma_code_all(&m_strm, output, input, input_size, &m_reallocs,
+                                         m_limits.max_output));
+        }
+
+        // Decompresses into the output_size bytes at output. Returns
+        // COMP_DECOMP_SPACE_ERROR if they are not enough.
+        int decomp(void *output, size_t output_size, size_t& written,
+                   const void *input, size_t input_size)
+        {
+            written = 0;
+            m_reallocs = 0;
+
+            int ret = reset();
+            if (ret != LZMA_OK)
+                return ret;
+
+            return limited(lzma_code_all(&m_strm, output, output_size, written,
+                                         input, input_size, m_limits.max_output));
+        }
+
+        int begin(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+        {
+            m_out.reset(sink, buffsize);
+            m_out.limit(m_limits.max_output);
+            return reset();
+        }
+
+        int write(const void *input, size_t input_size)
+        {
+            return limited(lzma_code_into(&m_strm, m_out, input, input_size, LZMA_RUN));
+        }
+
+        int finish()
+        {
+            int ret = lzma_code_into(&m_strm, m_out, NULL, 0, LZMA_FINISH);
+            if (ret != LZMA_STREAM_END)
+                return limited(ret);
+            if (!m_out.flush())
+                return COMP_DECOMP_SINK_ERROR;
+            return LZMA_OK;
+        }
+
+        // Reads the raw LZMA2 data of a compressor with the same dict (NULL
+        // for .xz data), which must outlive its use.
+        void set_dict(const comp_decomp_dict *dict)
+        {
+            m_dict = dict;
+        }
+
+        // Caps the following decompressions. max_memory is the memlimit of
+        // liblzma, so data whose dictionary needs more stops early.
+        void set_limits(const comp_decomp_limits& limits)
+        {
+            m_limits = limits;
+        }
+
+        // How many times the output of the last decomp() was reallocated.
+        size_t reallocs() const
+        {
+            return m_reallocs;
+        }
+
+        // The work memory of the coder, as liblzma counts it.
+        uint64_t memusage() const
+        {
+            return lzma_memusage(&m_strm);
+        }
+
+    protected:
+        lzma_stream m_strm;
+        lzma_allocator m_allocator;
+        size_t m_reallocs;
+        const comp_decomp_dict *m_dict;
+        comp_decomp_limits m_limits;
+        comp_decomp_output m_out;
+
+        int reset()
+        {
+            if (!m_dict)
+            {
+                uint64_t memlimit = m_limits.max_memory ? m_limits.max_memory : UINT64_MAX;
+                return lzma_stream_decoder(&m_strm, memlimit, LZMA_CONCATENATED);
+            }
+
+            // the preset only fills the options that the decoder ignores
+            lzma_options_lzma options;
+            lzma_filter filters[2];
+            int ret = lzma_raw_filters(filters, options, 6, *m_dict);
+            if (ret != LZMA_OK)
+                return ret;
+            if (m_limits.max_memory &&
+                lzma_raw_decoder_memusage(filters) > m_limits.max_memory)
+            {
+                return COMP_DECOMP_MEMORY_ERROR;
+            }
+            return lzma_raw_decoder(&m_strm, filters);
+        }
+
+        static int limited(int ret)
+        {
+            return (ret == LZMA_MEMLIMIT_ERROR) ? COMP_DECOMP_MEMORY_ERROR : ret;
+        }
+
+    private:
+        lzma_decompressor(const lzma_decompressor&) = delete;
+        lzma_decompressor& operator=(const lzma_decompressor&) = delete;
+    };
+
+    // Writes the input as an .xz stream of one block of LZMA2 uncompressed
+    // chunks into the output_size bytes at output, without trying to
+    // compress it. Any xz decoder reads it, with a dictionary of 4 KiB.
+    inline int lzma_store(void *output, size_t output_size, size_t& written,
+                          const void *input, size_t input_size,
+                          lzma_check check = LZMA_CHECK_CRC64)
+    {
+        uint8_t *out = (uint8_t *)output;
+        written = 0;
+        if (output_size < 2 * LZMA_STREAM_HEADER_SIZE)
+            return COMP_DECOMP_SPACE_ERROR;
+
+        lzma_stream_flags flags;
+        memset(&flags, 0, sizeof(flags));
+        flags.check = check;
+        int ret = lzma_stream_header_encode(&flags, out);
+        if (ret != LZMA_OK)
+            return ret;
+        size_t pos = LZMA_STREAM_HEADER_SIZE;
+
+        lzma_index *index = lzma_index_init(NULL);
+        if (!index)
+            return LZMA_MEM_ERROR;
+        if (input_size > 0)
+        {
+            lzma_block block;
+            memset(&block, 0, sizeof(block));
+            block.check = flags.check;
+            ret = lzma_block_uncomp_encode(&block, (const uint8_t *)input, input_size,
+                                           out, &pos, output_size);
+            if (ret == LZMA_OK)
+            {
+                ret = lzma_index_append(index, NULL, lzma_block_unpadded_size(&block),
+                                        block.uncompressed_size);
+            }
+        }
+        if (ret == LZMA_OK)
+            ret = lzma_index_buffer_encode(index, out, &pos, output_size);
+        if (ret == LZMA_OK)
+        {
+            flags.backward_size = lzma_index_size(index);
+            if (output_size - pos < LZMA_STREAM_HEADER_SIZE)
+                ret = LZMA_BUF_ERROR;
+            else
+                ret = lzma_stream_footer_encode(&flags, out + pos);
+            pos += LZMA_STREAM_HEADER_SIZE;
+        }
+        lzma_index_end(index, NULL);
+
+        if (ret == LZMA_BUF_ERROR)
+            return COMP_DECOMP_SPACE_ERROR;
+        if (ret == LZMA_OK)
+            written = pos;
+        return ret;
+    }
+
+    template <typename T_BUFFER>
+    inline int lzma_store(T_BUFFER& output, const void *input, size_t input_size,
+                          lzma_check check = LZMA_CHECK_CRC64)
+    {
+        output.resize(lzma_comp_bound(input_size));
+        size_t written;
+        int ret = lzma_store(&output[0], output.size(), written, input, input_size, check);
+        output.resize(written);
+        return ret;
+    }
+
+    // Pass comp_decomp_thread_pool() or an allocator of your own as
+    // allocator to recycle the work memory between calls, and a preset
+    // dictionary as dict for small messages (see comp_decomp_train_dict).
+    // Input that looks incompressible is stored (see lzma_store), except
+    // with dict, whose raw format has no container for it.
+    template <typename T_BUFFER>
+    inline int lzma_comp(T_BUFFER& output, const void *input, size_t input_size,
+                         const lzma_options& options,
+                         comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_LZMA, true, input_size);
+        if (!dict && comp_decomp_incompressible(input, input_size))
+        {
+            int ret = lzma_store(output, input, input_size, options.check);
+            COMP_DECOMP_STATS_ITERATION();
+            return COMP_DECOMP_STATS_RESULT(ret, output.size());
+        }
+        lzma_compressor compressor(options, allocator);
+        compressor.set_dict(dict);
+        int ret = compressor.comp(output, input, input_size);
+        COMP_DECOMP_STATS_MEMORY(compressor.memusage());
+        return COMP_DECOMP_STATS_RESULT(ret, output.size());
+    }
+
+    inline int lzma_comp(void *output, size_t output_size, size_t& written,
+                         const void *input, size_t input_size,
+                         const lzma_options& options,
+                         comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_LZMA, true, input_size);
+        if (!dict && comp_decomp_incompressible(input, input_size))
+        {
+            int ret = lzma_store(output, output_size, written, input, input_size,
+                                 options.check);
+            COMP_DECOMP_STATS_ITERATION();
+            return COMP_DECOMP_STATS_RESULT(ret, written);
+        }
+        lzma_compressor compressor(options, allocator);
+        compressor.set_dict(dict);
+        int ret = compressor.comp(output, output_size, written, input, input_size);
+        COMP_DECOMP_STATS_MEMORY(compressor.memusage());
+        return COMP_DECOMP_STATS_RESULT(ret, written);
+    }
+
+    template <typename T_BUFFER>
+    inline int lzma_comp(T_BUFFER& output, const void *input, size_t input_size,
+                         int rate = 9, comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        return lzma_comp(output, input, input_size, lzma_options(rate), allocator, dict);
+    }
+
+    inline int lzma_comp(void *output, size_t output_size, size_t& written,
+                         const void *input, size_t input_size, int rate = 9,
+                         comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        return lzma_comp(output, output_size, written, input, input_size, lzma_options(rate),
+                         allocator, dict);
+    }
+
+    // limits, if not NULL, caps the output and the work memory for data
+    // from untrusted sources.
+    template <typename T_BUFFER>
+    inline int lzma_decomp(T_BUFFER& output, const void *input, size_t input_size,
+                           size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+                           const comp_decomp_dict *dict = NULL,
+                           const comp_decomp_limits *limits = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_LZMA, false, input_size);
+        lzma_decompressor decompressor(allocator);
+        decompressor.set_dict(dict);
+        if (limits)
+            decompressor.set_limits(*limits);
+        int ret = decompressor.decomp(output, input, input_size, size_hint);
+        COMP_DECOMP_STATS_MEMORY(decompressor.memusage());
+        return COMP_DECOMP_STATS_RESULT(ret, output.size());
+    }
+
+    inline int lzma_decomp(void *output, size_t output_size, size_t& written,
+                           const void *input, size_t input_size,
+                           comp_decomp_allocator *allocator = NULL,
+                           const comp_decomp_dict *dict = NULL,
+                           const comp_decomp_limits *limits = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_LZMA, false, input_size);
+        lzma_decompressor decompressor(allocator);
+        decompressor.set_dict(dict);
+        if (limits)
+            decompressor.set_limits(*limits);
+        int ret = decompressor.decomp(output, output_size, written, input, input_size);
+        COMP_DECOMP_STATS_MEMORY(decompressor.memusage());
+        return COMP_DECOMP_STATS_RESULT(ret, written);
+    }
+
+    // Compresses with liblzma's multithreaded encoder. The output has one
+    // xz block per block_size bytes of input (0 lets liblzma choose).
+    inline int lzma_comp_mt(std::string& output, const void *input,
+                            size_t input_size, int rate = 9,
+                            unsigned threads = 0, size_t block_size = 0)
+    {
+        assert(1 <= rate && rate <= 9);
+
+        output.clear();
+        comp_decomp_reserve(output, lzma_comp_bound(input_size));
+
+        lzma_stream strm = LZMA_STREAM_INIT;
+#if LZMA_VERSION >= 50020002
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = comp_decomp_threads(threads);
+        mt.block_size = block_size;
+        mt.preset = rate;
+        mt.check = LZMA_CHECK_CRC64;
+        int ret = lzma_stream_encoder_mt(&strm, &mt);
+#else
+        (void)threads;
+        (void)block_size;
+        int ret = lzma_easy_encoder(&strm, rate, LZMA_CHECK_CRC64);
 #endif
+        if (ret != LZMA_OK)
+            return ret;
+
+        ret = lzma_code_all(&strm, output, input, input_size);
+        lzma_end(&strm);
+        return ret;
+    }
+
+    // Decodes one block described by iter into its place in output, which
+    // holds the decompressed data from the offset base on.
+    inline lzma_ret lzma_decode_block(uint8_t *output, const uint8_t *input,
+                                      const lzma_index_iter& iter, size_t base = 0)
+    {
+        size_t offset = (size_t)iter.block.compressed_file_offset;
+        size_t end = offset + (size_t)iter.block.total_size;
+
+        lzma_filter filters[LZMA_FILTERS_MAX + 1];
+        lzma_block block;
+        memset(&block, 0, sizeof(block));
+        block.version = 0;
+        block.check = iter.stream.flags->check;
+        block.filters = filters;
+        block.header_size = lzma_block_header_size_decode(input[offset]);
+        if (block.header_size > iter.block.total_size)
+            return LZMA_DATA_ERROR;
+
+        lzma_ret ret = lzma_block_header_decode(&block, NULL, input + offset);
+        if (ret != LZMA_OK)
+            return ret;
+
+        size_t in_pos = offset + block.header_size;
+        size_t out_pos = (size_t)iter.block.uncompressed_file_offset - base;
+        size_t out_end = out_pos + (size_t)iter.block.uncompressed_size;
+        ret = lzma_block_buffer_decode(&block, NULL, input, &in_pos, end,
+                                       output, &out_pos, out_end);
+        if (ret == LZMA_OK && (in_pos != end || out_pos != out_end))
+            ret = LZMA_DATA_ERROR;
+
+        for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+        {
+            free(filters[i].options);
+        }
+        return ret;
+    }
+
+    // Decodes the blocks listed in the xz indexes in parallel, each into its
+    // known offset of output. Falls back to lzma_decomp for one block.
+    inline int lzma_decomp_mt(std::string& output, const void *input,
+                              size_t input_size, unsigned threads = 0)
+    {
+        const uint8_t *ptr = (const uint8_t *)input;
+        output.clear();
+
+        lzma_index *index;
+        int ret = lzma_decode_index(&index, input, input_size);
+        if (ret != LZMA_OK)
+            return ret;
+        if (!lzma_index_plausible(index, input_size))
+        {
+            lzma_index_end(index, NULL);
+            return LZMA_DATA_ERROR;
+        }
+
+        std::vector<lzma_index_iter> blocks;
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+        {
+            blocks.push_back(iter);
+        }
+
+        threads = comp_decomp_threads(threads);
+        if (threads > blocks.size())
+            threads = (unsigned)blocks.size();
+        if (threads <= 1)
+        {
+            lzma_index_end(index, NULL);
+            return lzma_decomp(output, input, input_size);
+        }
+
+        lzma_vli total = lzma_index_uncompressed_size(index);
+        if (total > output.max_size())
+        {
+            lzma_index_end(index, NULL);
+            return LZMA_MEM_ERROR;
+        }
+        output.resize((size_t)total);
+
+        uint8_t *out = (uint8_t *)&output[0];
+        std::atomic<size_t> next(0);
+        std::atomic<int> error(LZMA_OK);
+        comp_decomp_run_workers(threads, [&]() {
+            for (size_t i = next++; i < blocks.size() && error == LZMA_OK; i = next++)
+            {
+                int ret = lzma_decode_block(out, ptr, blocks[i]);
+                if (ret != LZMA_OK)
+                    error = ret;
+            }
+        });
+
+        lzma_index_end(index, NULL);
+        if (error != LZMA_OK)
+        {
+            output.clear();
+            return error;
+        }
+        return LZMA_OK;
+    }
+
+    // Compresses into xz blocks of block_size bytes. The index of the .xz
+    // format then lets lzma_decomp_range find the blocks of a range.
+    inline int lzma_comp_seekable(std::string& output, const void *input,
+                                  size_t input_size, int rate = 9,
+                                  size_t block_size = 1024 * 1024, unsigned threads = 0)
+    {
+        assert(block_size > 0);
+        return lzma_comp_mt(output, input, input_size, rate, threads, block_size);
+    }
+
+    // Decompresses the length bytes at offset of the .xz data. Only the
+    // blocks of the range are decoded. The range is cut at the end of the
+    // data.
+    template <typename T_BUFFER>
+    inline int lzma_decomp_range(T_BUFFER& output, const void *input, size_t input_size,
+                                 size_t offset, size_t length)
+    {
+        const uint8_t *ptr = (const uint8_t *)input;
+        output.clear();
+
+        lzma_index *index;
+        int ret = lzma_decode_index(&index, input, input_size);
+        if (ret != LZMA_OK)
+            return ret;
+        if (!lzma_index_plausible(index, input_size))
+        {
+            lzma_index_end(index, NULL);
+            return LZMA_DATA_ERROR;
+        }
+
+        lzma_vli total = lzma_index_uncompressed_size(index);
+        if (offset >= total)
+        {
+            lzma_index_end(index, NULL);
+            return LZMA_OK;
+        }
+        if (length > total - offset)
+            length = (size_t)(total - offset);
+        comp_decomp_reserve(output, length);
+
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        bool more = !lzma_index_iter_locate(&iter, offset);
+        std::vector<uint8_t> block;
+        size_t end = offset + length;
+        while (more && ret == LZMA_OK)
+        {
+            size_t start = (size_t)iter.block.uncompressed_file_offset;
+            size_t size = (size_t)iter.block.uncompressed_size;
+            if (start >= end)
+                break;
+
+            block.resize(size);
+            ret = lzma_decode_block(&block[0], ptr, iter, start);
+            if (ret == LZMA_OK)
+            {
+                size_t from = (offset > start) ? offset - start : 0;
+                size_t to = (end < start + size) ? end - start : size;
+                output.insert(output.end(), block.begin() + from, block.begin() + to);
+            }
+            more = !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK);
+        }
+
+        lzma_index_end(index, NULL);
+        if (ret != LZMA_OK)
+            output.clear();
+        return ret;
+    }
+
+    inline const char *lzma_errmsg(int ret)
+    {
+        switch (ret)
+        {
+        case LZMA_OK: return "Operation completed successfully (LZMA_OK)";
+        case LZMA_STREAM_END: return "End of stream was reached (LZMA_STREAM_END)";
+        case LZMA_NO_CHECK: return "Input stream has no integrity check (LZMA_NO_CHECK)";
+        case LZMA_UNSUPPORTED_CHECK: return "Cannot calculate the integrity check (LZMA_UNSUPPORTED_CHECK)";
+        case LZMA_GET_CHECK: return "Integrity check type is now available (LZMA_GET_CHECK)";
+        case LZMA_MEM_ERROR: return "Cannot allocate memory (LZMA_MEM_ERROR)";
+        case LZMA_MEMLIMIT_ERROR: return "Memory usage limit was reached (LZMA_MEMLIMIT_ERROR)";
+        case LZMA_FORMAT_ERROR: return "File format not recognized (LZMA_FORMAT_ERROR)";
+        case LZMA_OPTIONS_ERROR: return "Invalid or unsupported options (LZMA_OPTIONS_ERROR)";
+        case LZMA_DATA_ERROR: return "Data is corrupt (LZMA_DATA_ERROR)";
+        case LZMA_BUF_ERROR: return "No progress is possible (LZMA_BUF_ERROR)";
+        case LZMA_PROG_ERROR: return "Programming error (LZMA_PROG_ERROR)";
+        case COMP_DECOMP_SINK_ERROR: return "Sink error (COMP_DECOMP_SINK_ERROR)";
+        case COMP_DECOMP_SPACE_ERROR: return "Output buffer too small (COMP_DECOMP_SPACE_ERROR)";
+        case COMP_DECOMP_LIMIT_ERROR: return "Output over the limit (COMP_DECOMP_LIMIT_ERROR)";
+        case COMP_DECOMP_MEMORY_ERROR: return "Memory over the limit (COMP_DECOMP_MEMORY_ERROR)";
+        case COMP_DECOMP_CANCEL_ERROR: return "Cancelled (COMP_DECOMP_CANCEL_ERROR)";
+        }
+        return "Unknown error";
+    }
+
+    inline bool lzma_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = lzma_comp(encoded, original.c_str(), original.size()))
+        {
+            printf("lzma_comp failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (int ret = lzma_decomp(decoded, encoded.c_str(), encoded.size()))
+        {
+            printf("lzma_decomp failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("lzma mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool lzma_test_entry(lzma_compressor& compressor,
+                                lzma_decompressor& decompressor,
+                                const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = compressor.comp(encoded, original.c_str(), original.size()))
+        {
+            printf("lzma_compressor failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (int ret = decompressor.decomp(decoded, encoded.c_str(), encoded.size()))
+        {
+            printf("lzma_decompressor failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("lzma mismatch\n");
+            return false;
+        }
+        if (compressor.reallocs() || decompressor.reallocs())
+        {
+            printf("lzma reallocated\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool lzma_allocator_test_entry(comp_decomp_pool& pool, const std::string& original)
+    {
+        std::string encoded, decoded;
+        size_t allocs = pool.allocs();
+        if (int ret = lzma_comp(encoded, original.data(), original.size(), 9, &pool))
+        {
+            printf("lzma_comp with a pool failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size(), 0, &pool))
+        {
+            printf("lzma_decomp with a pool failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded) || pool.allocs() == allocs)
+        {
+            printf("lzma pool mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool lzma_dict_test_entry(const comp_decomp_dict& dict, const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = lzma_comp(encoded, original.data(), original.size(), 9, NULL, &dict))
+        {
+            printf("lzma_comp with a dictionary failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, &dict))
+        {
+            printf("lzma_decomp with a dictionary failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("lzma dictionary mismatch\n");
+            return false;
+        }
+        return true;
+    }
 
-// lzma_ret lzma_comp(std::string& output, const void *input,
-//                    size_t input_size, int rate = 9);
-// lzma_ret lzma_decomp(std::string& output, const void *input, size_t input_size);
-// const char *lzma_errmsg(lzma_ret ret);
-// bool lzma_unittest(void);
+    // Messages that share most of their text compress better with a
+    // dictionary trained on others like them.
+    inline bool lzma_train_test_entry(void)
+    {
+        std::vector<std::string> samples;
+        char buf[128];
+        for (int i = 0; i < 64; ++i)
+        {
+            sprintf(buf, "{\"user\": \"user%d\", \"action\": \"login\", \"status\": \"ok\"}", i);
+            samples.push_back(buf);
+        }
+        comp_decomp_dict dict = comp_decomp_train_dict(samples);
+        if (dict.empty() || !lzma_dict_test_entry(dict, samples[7]))
+            return false;
 
-#ifdef HAVE_LZMA
-    #include <lzma.h>
+        std::string plain, trained;
+        lzma_comp(plain, samples[7].data(), samples[7].size());
+        lzma_comp(trained, samples[7].data(), samples[7].size(), 9, NULL, &dict);
+        if (trained.size() >= plain.size())
+        {
+            printf("lzma dictionary did not help: %d >= %d\n",
+                   (int)trained.size(), (int)plain.size());
+            return false;
+        }
+        return true;
+    }
 
-    inline lzma_ret lzma_comp(std::string& output, const void *input,
-                              size_t input_size, int rate = 9)
+    inline bool lzma_mt_test_entry(const std::string& original)
     {
-        const uint8_t *ptr = (const uint8_t *)input;
-        size_t remainder = input_size;
-        assert(1 <= rate && rate <= 9);
+        std::string encoded, decoded;
+        if (int ret = lzma_comp_mt(encoded, original.c_str(), original.size(), 1, 3, 16))
+        {
+            printf("lzma_comp_mt failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        encoded += encoded;
+        encoded.append(4, '\0');
+        if (int ret = lzma_decomp_mt(decoded, encoded.c_str(), encoded.size(), 3))
+        {
+            printf("lzma_decomp_mt failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (!(original + original == decoded))
+        {
+            printf("lzma mt mismatch\n");
+            return false;
+        }
+        return true;
+    }
 
-        output.clear();
-        output.reserve(input_size * 2 / 3);
-        static uint8_t inbuf[COMP_DECOMP_BUFFSIZE];
-        static uint8_t outbuf[COMP_DECOMP_BUFFSIZE];
+    // Replaces the index of the single-stream xz data encoded with one whose
+    // blocks have the uncompressed size forge(i, iter).
+    template <typename T_FORGE>
+    inline bool lzma_forge_index(std::string& encoded, T_FORGE forge)
+    {
+        lzma_stream_flags flags;
+        const uint8_t *footer = (const uint8_t *)encoded.data() + encoded.size() -
+                                LZMA_STREAM_HEADER_SIZE;
+        if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK)
+            return false;
 
-        lzma_stream strm = LZMA_STREAM_INIT;
-        lzma_ret ret = lzma_easy_encoder(&strm, rate, LZMA_CHECK_CRC64);
-        if (ret != LZMA_OK)
-            return ret;
+        lzma_index *index;
+        if (lzma_decode_index(&index, encoded.data(), encoded.size()) != LZMA_OK)
+            return false;
+        lzma_index *forged = lzma_index_init(NULL);
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        int ret = LZMA_OK;
+        size_t i = 0;
+        while (ret == LZMA_OK && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+        {
+            ret = lzma_index_append(forged, NULL, iter.block.unpadded_size, forge(i++, iter));
+        }
+        lzma_index_end(index, NULL);
 
-        strm.next_in = NULL;
-        strm.avail_in = 0;
-        strm.next_out = outbuf;
-        strm.avail_out = sizeof(outbuf);
+        size_t index_pos = encoded.size() - LZMA_STREAM_HEADER_SIZE - (size_t)flags.backward_size;
+        std::string buffer((size_t)lzma_index_size(forged) + LZMA_STREAM_HEADER_SIZE, 0);
+        size_t out_pos = 0;
+        if (ret == LZMA_OK)
+            ret = lzma_index_buffer_encode(forged, (uint8_t *)&buffer[0], &out_pos,
+                                           buffer.size());
+        flags.backward_size = lzma_index_size(forged);
+        lzma_index_end(forged, NULL);
+        if (ret != LZMA_OK ||
+            lzma_stream_footer_encode(&flags, (uint8_t *)&buffer[out_pos]) != LZMA_OK)
+        {
+            return false;
+        }
+        encoded.replace(index_pos, std::string::npos, buffer);
+        return true;
+    }
 
-        lzma_action action = LZMA_RUN;
-        while (ret == LZMA_OK)
+    inline bool lzma_forged_index_test_entry(const std::string& original)
+    {
+        std::string encoded, forged, decoded;
+        if (int ret = lzma_comp_mt(encoded, original.data(), original.size(), 1, 3, 16))
         {
-            if (strm.avail_in == 0)
-            {
-                strm.next_in = (const uint8_t *)inbuf;
-                if (remainder < COMP_DECOMP_BUFFSIZE)
-                    strm.avail_in = remainder;
-                else
-                    strm.avail_in = COMP_DECOMP_BUFFSIZE;
-                memcpy(inbuf, ptr, strm.avail_in);
-                ptr += strm.avail_in;
-                remainder -= strm.avail_in;
+            printf("lzma_comp_mt failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
 
-                if (remainder == 0)
-                    action = LZMA_FINISH;
-            }
+        // terabytes in all, then a block that expands too much
+        forged = encoded;
+        bool ok = lzma_forge_index(forged, [](size_t, const lzma_index_iter&) {
+            return (lzma_vli)1 << 40;
+        });
+        ok = ok && lzma_decomp_mt(decoded, forged.data(), forged.size(), 3) == LZMA_DATA_ERROR &&
+             lzma_decomp_range(decoded, forged.data(), forged.size(), 0, 10) == LZMA_DATA_ERROR &&
+             lzma_expected_size(forged.data(), forged.size()) == 0;
+
+        forged = encoded;
+        ok = ok && lzma_forge_index(forged, [](size_t i, const lzma_index_iter& iter) {
+            return i ? iter.block.uncompressed_size : (iter.block.total_size + 1) * 16384;
+        });
+        ok = ok && lzma_decomp_mt(decoded, forged.data(), forged.size(), 3) == LZMA_DATA_ERROR &&
+             lzma_decomp_range(decoded, forged.data(), forged.size(), 0, 10) == LZMA_DATA_ERROR;
+        if (!ok)
+        {
+            printf("lzma accepted a forged index\n");
+            return false;
+        }
+        return true;
+    }
 
-            ret = lzma_code(&strm, action);
+    inline bool lzma_seekable_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = lzma_comp_seekable(encoded, original.data(), original.size(), 9, 16))
+        {
+            printf("lzma_comp_seekable failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("lzma_decomp of seekable data failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("lzma seekable mismatch\n");
+            return false;
+        }
 
-            if (strm.avail_out == 0 || ret == LZMA_STREAM_END)
+        // within a block, across blocks, up to and past the end
+        const size_t ranges[][2] =
+        {
+            { 0, 1 }, { 3, 10 }, { 15, 2 }, { 10, 40 }, { 0, 1000 },
+            { original.size() / 2, 1000 }, { original.size(), 1 }, { 5, 0 },
+        };
+        for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i)
+        {
+            size_t offset = ranges[i][0], length = ranges[i][1];
+            if (int ret = lzma_decomp_range(decoded, encoded.data(), encoded.size(),
+                                              offset, length))
+            {
+                printf("lzma_decomp_range failed: %s\n", lzma_errmsg(ret));
+                return false;
+            }
+            std::string expected;
+            if (offset < original.size())
+                expected = original.substr(offset, length);
+            if (!(expected == decoded))
             {
-                size_t write_size = sizeof(outbuf) - strm.avail_out;
-                output.insert(output.size(), (char *)outbuf, write_size);
-                strm.next_out = outbuf;
-                strm.avail_out = sizeof(outbuf);
+                printf("lzma_decomp_range mismatch at %d+%d\n", (int)offset, (int)length);
+                return false;
             }
         }
+        return true;
+    }
+
+    inline bool lzma_span_test_entry(const std::string& original)
+    {
+        std::vector<unsigned char> encoded;
+        if (int ret = lzma_comp(encoded, original.data(), original.size(), 1))
+        {
+            printf("lzma_comp to a vector failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
 
-        lzma_end(&strm);
-        if (ret == LZMA_STREAM_END)
-            ret = LZMA_OK;
-        return ret;
+        std::vector<char> buffer(lzma_comp_bound(original.size()));
+        size_t written;
+        int ret = lzma_comp(&buffer[0], buffer.size(), written,
+                            original.data(), original.size(), 1);
+        if (ret != LZMA_OK || written != encoded.size() ||
+            memcmp(&buffer[0], &encoded[0], written) != 0)
+        {
+            printf("lzma_comp to a buffer failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+
+        // exactly as large as needed, then one byte short
+        buffer.assign(original.size() + 1, 0);
+        ret = lzma_decomp(&buffer[0], original.size(), written, &encoded[0], encoded.size());
+        if (ret != LZMA_OK || written != original.size() ||
+            memcmp(&buffer[0], original.data(), written) != 0)
+        {
+            printf("lzma_decomp to a buffer failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (original.size())
+        {
+            ret = lzma_decomp(&buffer[0], original.size() - 1, written,
+                              &encoded[0], encoded.size());
+            if (ret != COMP_DECOMP_SPACE_ERROR || buffer[original.size() - 1] != original.back())
+            {
+                printf("lzma_decomp overran a buffer: %s\n", lzma_errmsg(ret));
+                return false;
+            }
+        }
+        return true;
     }
 
-    inline lzma_ret lzma_decomp(std::string& output, const void *input,
-                                size_t input_size)
+    inline bool lzma_stream_test_entry(const std::string& original)
     {
-        const uint8_t *ptr = (const uint8_t *)input;
-        size_t remainder = input_size;
+        std::string encoded, decoded;
+        bool bounded = true;
+        comp_decomp_sink to_encoded = [&](const void *data, size_t size) {
+            bounded = bounded && size <= COMP_DECOMP_BUFFSIZE;
+            encoded.append((const char *)data, size);
+            return true;
+        };
+        comp_decomp_sink to_decoded = [&](const void *data, size_t size) {
+            bounded = bounded && size <= COMP_DECOMP_BUFFSIZE;
+            decoded.append((const char *)data, size);
+            return true;
+        };
 
-        output.clear();
-        output.reserve(input_size * 3 / 2);
-        static uint8_t inbuf[COMP_DECOMP_BUFFSIZE];
-        static uint8_t outbuf[COMP_DECOMP_BUFFSIZE];
+        lzma_compressor compressor;
+        int ret = compressor.begin(to_encoded);
+        for (size_t i = 0; ret == LZMA_OK && i < original.size(); i += 7)
+        {
+            size_t size = (original.size() - i < 7) ? original.size() - i : 7;
+            ret = compressor.write(&original[i], size);
+        }
+        if (ret == LZMA_OK)
+            ret = compressor.finish();
+        if (ret != LZMA_OK)
+        {
+            printf("lzma_compressor streaming failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
 
-        lzma_stream strm = LZMA_STREAM_INIT;
-        lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+        lzma_decompressor decompressor;
+        ret = decompressor.begin(to_decoded);
+        for (size_t i = 0; ret == LZMA_OK && i < encoded.size(); i += 5)
+        {
+            size_t size = (encoded.size() - i < 5) ? encoded.size() - i : 5;
+            ret = decompressor.write(&encoded[i], size);
+        }
+        if (ret == LZMA_OK)
+            ret = decompressor.finish();
         if (ret != LZMA_OK)
-            return ret;
+        {
+            printf("lzma_decompressor streaming failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+
+        if (!(original == decoded) || !bounded)
+        {
+            printf("lzma streaming mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+#ifndef COMP_DECOMP_MAX_TEST
+    #define COMP_DECOMP_MAX_TEST 100
+#endif
+#ifndef COMP_DECOMP_TEST_COUNT
+    #define COMP_DECOMP_TEST_COUNT 100
+#endif
 
-        strm.next_in = NULL;
-        strm.avail_in = 0;
-        strm.next_out = outbuf;
-        strm.avail_out = sizeof(outbuf);
+    inline bool lzma_limits_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = lzma_comp(encoded, original.data(), original.size()))
+        {
+            printf("lzma_comp failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
 
-        lzma_action action = LZMA_RUN;
-        while (ret == LZMA_OK)
+        comp_decomp_limits exact(original.size());
+        if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size(),
+                                       0, NULL, NULL, &exact))
         {
-            if (strm.avail_in == 0)
+            printf("lzma_decomp within the limit failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        // 0 would be no limit
+        if (original.size() > 1)
+        {
+            comp_decomp_limits less(original.size() - 1);
+            if (lzma_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, NULL, &less) !=
+                COMP_DECOMP_LIMIT_ERROR || !decoded.empty())
             {
-                strm.next_in = inbuf;
-                if (remainder < COMP_DECOMP_BUFFSIZE)
-                    strm.avail_in = remainder;
-                else
-                    strm.avail_in = COMP_DECOMP_BUFFSIZE;
-                memcpy(inbuf, ptr, strm.avail_in);
-                ptr += strm.avail_in;
-                remainder -= strm.avail_in;
-
-                if (remainder == 0)
-                    action = LZMA_FINISH;
+                printf("lzma_decomp over the limit did not fail\n");
+                return false;
             }
 
-            ret = lzma_code(&strm, action);
-
-            if (strm.avail_out == 0 || ret == LZMA_STREAM_END)
+            // a fixed buffer larger than the limit
+            std::vector<char> buffer(original.size() + 100);
+            size_t written;
+            int ret = lzma_decomp(&buffer[0], buffer.size(), written,
+                                  encoded.data(), encoded.size(), NULL, NULL, &less);
+            if (ret != COMP_DECOMP_LIMIT_ERROR)
             {
-                size_t write_size = sizeof(outbuf) - strm.avail_out;
+                printf("lzma_decomp over the limit into a buffer did not fail\n");
+                return false;
+            }
+        }
 
-                output.insert(output.size(), (char *)outbuf, write_size);
-                strm.next_out = outbuf;
-                strm.avail_out = sizeof(outbuf);
+        // empty data may need no dictionary
+        if (!original.empty())
+        {
+            comp_decomp_limits small(0, 1024 * 1024);
+            if (lzma_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, NULL, &small) !=
+                COMP_DECOMP_MEMORY_ERROR)
+            {
+                printf("lzma_decomp over the memory limit did not fail\n");
+                return false;
+            }
+            comp_decomp_limits enough(0, 100 * 1024 * 1024);
+            if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size(),
+                                           0, NULL, NULL, &enough))
+            {
+                printf("lzma_decomp within the memory limit failed: %s\n", lzma_errmsg(ret));
+                return false;
             }
         }
+        return original == decoded;
+    }
 
-        lzma_end(&strm);
-        if (ret == LZMA_STREAM_END)
-            ret = LZMA_OK;
-        return ret;
+    inline bool lzma_store_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = lzma_store(encoded, original.data(), original.size()))
+        {
+            printf("lzma_store failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        // stream header and footer, block header, chunk headers, check and index
+        if (encoded.size() > original.size() + original.size() / 16384 + 128)
+        {
+            printf("lzma_store is too large: %u\n", (unsigned)encoded.size());
+            return false;
+        }
+        if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("lzma_decomp of a stored stream failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+
+        std::string small(encoded.size() / 2, '\0');
+        size_t written;
+        if (lzma_store(&small[0], small.size(), written, original.data(), original.size()) !=
+            COMP_DECOMP_SPACE_ERROR)
+        {
+            printf("lzma_store overran its output\n");
+            return false;
+        }
+        return original == decoded;
     }
 
-    inline const char *lzma_errmsg(lzma_ret ret)
+    inline bool lzma_options_test_entry(const std::string& original)
     {
-        switch (ret)
+        lzma_options options[7];
+        options[0] = lzma_options::fastest();
+        options[1] = lzma_options::low_memory();
+        options[2].rate = 1;
+        options[2].extreme = true;
+        options[3].check = LZMA_CHECK_NONE;
+        options[4].check = LZMA_CHECK_SHA256;
+        options[5].filter = LZMA_FILTER_X86;
+        options[6].filter = LZMA_FILTER_DELTA;
+        options[6].delta_distance = 4;
+        for (size_t i = 0; i < 7; ++i)
         {
-        case LZMA_OK: return "Operation completed successfully (LZMA_OK)";
-        case LZMA_STREAM_END: return "End of stream was reached (LZMA_STREAM_END)";
-        case LZMA_NO_CHECK: return "Input stream has no integrity check (LZMA_NO_CHECK)";
-        case LZMA_UNSUPPORTED_CHECK: return "Cannot calculate the integrity check (LZMA_UNSUPPORTED_CHECK)";
-        case LZMA_GET_CHECK: return "Integrity check type is now available (LZMA_GET_CHECK)";
-        case LZMA_MEM_ERROR: return "Cannot allocate memory (LZMA_MEM_ERROR)";
-        case LZMA_MEMLIMIT_ERROR: return "Memory usage limit was reached (LZMA_MEMLIMIT_ERROR)";
-        case LZMA_FORMAT_ERROR: return "File format not recognized (LZMA_FORMAT_ERROR)";
-        case LZMA_OPTIONS_ERROR: return "Invalid or unsupported options (LZMA_OPTIONS_ERROR)";
-        case LZMA_DATA_ERROR: return "Data is corrupt (LZMA_DATA_ERROR)";
-        case LZMA_BUF_ERROR: return "No progress is possible (LZMA_BUF_ERROR)";
-        case LZMA_PROG_ERROR: return "Programming error (LZMA_PROG_ERROR)";
+            std::vector<char> encoded(lzma_comp_bound(original.size()));
+            std::string decoded;
+            size_t written;
+            if (int ret = lzma_comp(&encoded[0], encoded.size(), written,
+                                         original.data(), original.size(), options[i]))
+            {
+                printf("lzma_comp with options failed: %s\n", lzma_errmsg(ret));
+                return false;
+            }
+
+            // the low_memory dictionary fits a small memory limit
+            comp_decomp_limits limits(0, (i == 1) ? 1024 * 1024 : 0);
+            if (int ret = lzma_decomp(decoded, &encoded[0], written, 0, NULL, NULL, &limits))
+            {
+                printf("lzma_decomp with options failed: %s\n", lzma_errmsg(ret));
+                return false;
+            }
+            if (!(original == decoded))
+            {
+                printf("lzma options mismatch\n");
+                return false;
+            }
         }
-        return "Unknown error";
+
+        lzma_compressor fastest(lzma_options::fastest()), low(lzma_options::low_memory());
+        lzma_compressor preset9;
+        if (!(low.memusage() < fastest.memusage() && fastest.memusage() < preset9.memusage()))
+        {
+            printf("lzma presets do not save memory\n");
+            return false;
+        }
+        return true;
     }
 
-    inline bool lzma_test_entry(const std::string& original)
+#ifdef COMP_DECOMP_STATS
+    inline bool lzma_stats_test_entry(const std::string& original)
     {
+        comp_decomp_set_stats_callback(comp_decomp_stats_test_callback);
+        comp_decomp_stats before = comp_decomp_stats_snapshot(COMP_DECOMP_CODEC_LZMA, true);
+
         std::string encoded, decoded;
-        if (lzma_ret ret = lzma_comp(encoded, original.c_str(), original.size()))
+        if (int ret = lzma_comp(encoded, original.data(), original.size()))
         {
-            printf("lzma_comp failed: %s\n", lzma_errmsg(ret));
+            printf("lzma_comp with stats failed: %s\n", lzma_errmsg(ret));
             return false;
         }
-        if (lzma_ret ret = lzma_decomp(decoded, encoded.c_str(), encoded.size()))
+        // a stored stream needs no encoder memory
+        bool stored = comp_decomp_incompressible(original.data(), original.size());
+        const comp_decomp_call_stats& call = comp_decomp_stats_test_last();
+        if (call.codec != COMP_DECOMP_CODEC_LZMA || !call.compress || call.bytes_in != original.size() ||
+            call.bytes_out != encoded.size() || call.iterations == 0 || (call.mem_peak == 0) != stored)
         {
-            printf("lzma_decomp failed: %s\n", lzma_errmsg(ret));
+            printf("lzma call stats are wrong\n");
             return false;
         }
-        if (!(original == decoded))
+
+        comp_decomp_stats after = comp_decomp_stats_snapshot(COMP_DECOMP_CODEC_LZMA, true);
+        if (after.calls <= before.calls || after.bytes_in < before.bytes_in + original.size())
         {
-            printf("lzma mismatch\n");
+            printf("lzma stats snapshot is wrong\n");
             return false;
         }
-        return true;
-    }
 
-#ifndef COMP_DECOMP_MAX_TEST
-    #define COMP_DECOMP_MAX_TEST 100
+        if (int ret = lzma_decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("lzma_decomp with stats failed: %s\n", lzma_errmsg(ret));
+            return false;
+        }
+        if (call.compress || call.bytes_out != original.size() || call.iterations == 0)
+        {
+            printf("lzma decomp call stats are wrong\n");
+            return false;
+        }
+        return original == decoded;
+    }
 #endif
-#ifndef COMP_DECOMP_TEST_COUNT
-    #define COMP_DECOMP_TEST_COUNT 100
+
+    // Inputs large enough for comp_decomp_incompressible to look at: lzma_comp
+    // writes random bytes as lzma_store does (LZMA2 alone comes out a few
+    // bytes smaller, so only the same stream shows the store path), and
+    // compresses text. Both round-trip.
+    inline bool lzma_store_test_entry(void)
+    {
+        std::string random(16 * 1024, 0), text(16 * 1024, 0);
+        for (size_t i = 0; i < random.size(); ++i)
+        {
+            random[i] = (char)(std::rand() & 0xFF);
+            text[i] = (char)('a' + std::rand() % 4);
+        }
+
+        for (int k = 0; k < 2; ++k)
+        {
+            const std::string& original = k ? text : random;
+            std::string encoded, stored, decoded;
+            if (lzma_comp(encoded, original.data(), original.size()) ||
+                lzma_store(stored, original.data(), original.size()) ||
+                lzma_decomp(decoded, encoded.data(), encoded.size()) || !(original == decoded))
+            {
+                printf("lzma store round trip failed\n");
+                return false;
+            }
+            if (k ? (encoded.size() >= stored.size() / 2) : !(encoded == stored))
+            {
+                printf("lzma stored %s input\n", k ? "the text" : "not the random");
+                return false;
+            }
+        }
+#ifdef COMP_DECOMP_STATS
+        if (!lzma_stats_test_entry(random) || !lzma_stats_test_entry(text))
+            return false;
 #endif
+        return true;
+    }
 
     inline bool lzma_unittest(void)
     {
+        lzma_compressor compressor;
+        lzma_decompressor decompressor;
+        comp_decomp_pool pool;
         std::string original;
         if (!lzma_test_entry(original))
             return false;
 
+        if (!lzma_train_test_entry())
+            return false;
+
         original.assign(COMP_DECOMP_MAX_TEST, 'A');
         if (!lzma_test_entry(original))
             return false;
+        if (!lzma_mt_test_entry(original))
+            return false;
+        if (!lzma_span_test_entry(original))
+            return false;
+        if (!lzma_stream_test_entry(original))
+            return false;
+        if (!lzma_forged_index_test_entry(original))
+            return false;
+        if (!lzma_store_test_entry())
+            return false;
 
         for (size_t i = 0; i < COMP_DECOMP_TEST_COUNT; ++i)
         {
@@ -205,6 +1684,36 @@
             }
             if (!lzma_test_entry(original))
                 return false;
+            if (!lzma_test_entry(compressor, decompressor, original))
+                return false;
+            if (!lzma_allocator_test_entry(pool, original))
+                return false;
+            if (!lzma_limits_test_entry(original))
+                return false;
+            if (!lzma_store_test_entry(original))
+                return false;
+            if (!lzma_options_test_entry(original))
+                return false;
+#ifdef COMP_DECOMP_STATS
+            if (!lzma_stats_test_entry(original))
+                return false;
+#endif
+            if (!lzma_dict_test_entry(comp_decomp_dict(original.data(), original.size() / 2),
+                                      original))
+                return false;
+            if (!lzma_mt_test_entry(original))
+                return false;
+            if (!lzma_span_test_entry(original))
+                return false;
+            if (!lzma_stream_test_entry(original))
+                return false;
+            if (!lzma_seekable_test_entry(original))
+                return false;
+        }
+        if (pool.reused() == 0)
+        {
+            printf("lzma pool not reused\n");
+            return false;
         }
         return true;
     }
@@ -0,0 +1,447 @@
+// comp_decomp_pipeline.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_PIPELINE_HPP_
+#define COMP_DECOMP_PIPELINE_HPP_
+
+#include "comp_decomp_file.hpp"
+
+#include <chrono>
+
+// class comp_decomp_ring<T>;
+// struct comp_decomp_pipeline_options;
+// struct comp_decomp_pipeline_stats;
+// int comp_decomp_pipeline_run(T_CODER& coder, comp_decomp_file_reader& src,
+//                              comp_decomp_file_writer& dst,
+//                              const comp_decomp_pipeline_options& options,
+//                              comp_decomp_pipeline_stats *stats = NULL);
+// int comp_file_pipelined(const char *src, const char *dst,
+//                         comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE, int rate = 9,
+//                         const comp_decomp_pipeline_options& options = ...,
+//                         comp_decomp_pipeline_stats *stats = NULL);
+// int decomp_file_pipelined(const char *src, const char *dst,
+//                           comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+//                           const comp_decomp_pipeline_options& options = ...,
+//                           comp_decomp_pipeline_stats *stats = NULL);
+// bool pipeline_unittest(void);
+
+// A bounded lock-free queue for one producer thread and one consumer thread.
+// The capacity is rounded up to a power of two.
+template <typename T>
+class comp_decomp_ring
+{
+public:
+    explicit comp_decomp_ring(size_t capacity) : m_head(0), m_tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        m_items.resize(size);
+        m_mask = size - 1;
+    }
+
+    // Fails if the queue is full. Called by the producer only.
+    bool push(const T& item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == m_items.size())
+            return false;
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Fails if the queue is empty. Called by the consumer only.
+    bool pop(T& item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+        item = m_items[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+protected:
+    std::vector<T> m_items;
+    size_t m_mask;
+    // the two ends on cache lines of their own
+    char m_pad1[64];
+    std::atomic<size_t> m_head;
+    char m_pad2[64];
+    std::atomic<size_t> m_tail;
+    char m_pad3[64];
+
+private:
+    comp_decomp_ring(const comp_decomp_ring&) = delete;
+    comp_decomp_ring& operator=(const comp_decomp_ring&) = delete;
+};
+
+struct comp_decomp_pipeline_options
+{
+    size_t chunk_size;  // bytes per read, per codec output and per write
+    size_t chunks;      // chunks in flight between two stages
+    bool sequential;    // posix_fadvise hint for the source
+
+    comp_decomp_pipeline_options()
+        : chunk_size(1024 * 1024), chunks(4), sequential(true)
+    {
+    }
+};
+
+// How busy each stage was, as a part of the wall time. The stage near 1.0
+// is the bottleneck; the others waited for it.
+struct comp_decomp_pipeline_stats
+{
+    double seconds;
+    double read_busy;
+    double codec_busy;
+    double write_busy;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    comp_decomp_pipeline_stats()
+        : seconds(0), read_busy(0), codec_busy(0), write_busy(0),
+          bytes_read(0), bytes_written(0)
+    {
+    }
+};
+
+struct comp_decomp_chunk
+{
+    std::string data;
+    size_t size;
+    bool last;
+};
+
+typedef comp_decomp_ring<comp_decomp_chunk *> comp_decomp_chunk_ring;
+
+// Takes a chunk from ring, waiting while it is empty. Fails when abort is set.
+inline bool comp_decomp_chunk_wait(comp_decomp_chunk_ring& ring, comp_decomp_chunk *& chunk,
+                                   const std::atomic<bool>& abort)
+{
+    for (unsigned tries = 0; !ring.pop(chunk); ++tries)
+    {
+        if (abort)
+            return false;
+        if (tries < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+
+// Runs the reader and the writer on threads of their own and the coder on
+// the calling thread. The chunks go round: reader -> coder -> reader, and
+// coder -> writer -> coder, so that no buffer is allocated after the start.
+template <typename T_CODER>
+inline int comp_decomp_pipeline_run(T_CODER& coder, comp_decomp_file_reader& src,
+                                    comp_decomp_file_writer& dst,
+                                    const comp_decomp_pipeline_options& options,
+                                    comp_decomp_pipeline_stats *stats = NULL)
+{
+    typedef std::chrono::steady_clock clock;
+    typedef std::chrono::duration<double> seconds;
+    assert(options.chunk_size > 0 && options.chunks > 0);
+
+    std::vector<comp_decomp_chunk> chunks(options.chunks * 2);
+    comp_decomp_chunk_ring free_in(options.chunks), full_in(options.chunks);
+    comp_decomp_chunk_ring free_out(options.chunks), full_out(options.chunks);
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        chunks[i].data.resize(options.chunk_size);
+        (i < options.chunks ? free_in : free_out).push(&chunks[i]);
+    }
+
+    std::atomic<bool> abort(false);
+    std::atomic<int> error(0);
+    double read_time = 0, write_time = 0, wait_time = 0;
+    uint64_t bytes_read = 0, bytes_written = 0;
+    clock::time_point start = clock::now();
+
+    std::thread reader([&]() {
+        comp_decomp_chunk *chunk;
+        bool last = false;
+        while (!last && comp_decomp_chunk_wait(free_in, chunk, abort))
+        {
+            clock::time_point time = clock::now();
+            if (!src.read(&chunk->data[0], chunk->data.size(), chunk->size))
+            {
+                error = COMP_DECOMP_FILE_ERROR;
+                abort = true;
+                return;
+            }
+            read_time += seconds(clock::now() - time).count();
+            bytes_read += chunk->size;
+            last = chunk->last = (chunk->size < chunk->data.size());
+            full_in.push(chunk);
+        }
+    });
+
+    std::thread writer([&]() {
+        comp_decomp_chunk *chunk;
+        while (comp_decomp_chunk_wait(full_out, chunk, abort))
+        {
+            if (chunk->last)
+                return;
+            clock::time_point time = clock::now();
+            if (!dst.write(chunk->data.data(), chunk->size))
+            {
+                error = COMP_DECOMP_FILE_ERROR;
+                abort = true;
+                return;
+            }
+            write_time += seconds(clock::now() - time).count();
+            bytes_written += chunk->size;
+            free_out.push(chunk);
+        }
+    });
+
+    // the coder's buffer is as large as a chunk
+    comp_decomp_sink sink = [&](const void *data, size_t size) {
+        clock::time_point time = clock::now();
+        comp_decomp_chunk *chunk;
+        bool ok = comp_decomp_chunk_wait(free_out, chunk, abort);
+        wait_time += seconds(clock::now() - time).count();
+        if (!ok)
+            return false;
+        memcpy(&chunk->data[0], data, size);
+        chunk->size = size;
+        chunk->last = false;
+        full_out.push(chunk);
+        return true;
+    };
+
+    clock::time_point coder_start = clock::now();
+    int ret = (int)coder.begin(sink, options.chunk_size);
+    comp_decomp_chunk *chunk;
+    for (bool last = false; !ret && !last; )
+    {
+        clock::time_point time = clock::now();
+        bool ok = comp_decomp_chunk_wait(full_in, chunk, abort);
+        wait_time += seconds(clock::now() - time).count();
+        if (!ok)
+            break;
+
+        last = chunk->last;
+        ret = (int)coder.write(chunk->data.data(), chunk->size);
+        free_in.push(chunk);
+        if (!ret && last)
+            ret = (int)coder.finish();
+    }
+    if (!ret && !abort)
+    {
+        clock::time_point time = clock::now();
+        bool ok = comp_decomp_chunk_wait(free_out, chunk, abort);
+        wait_time += seconds(clock::now() - time).count();
+        if (ok)
+        {
+            chunk->size = 0;
+            chunk->last = true;
+            full_out.push(chunk);
+        }
+    }
+    double coder_time = seconds(clock::now() - coder_start).count() - wait_time;
+    if (ret)
+        abort = true;
+
+    reader.join();
+    writer.join();
+
+    if (stats)
+    {
+        stats->seconds = seconds(clock::now() - start).count();
+        if (stats->seconds > 0)
+        {
+            stats->read_busy = read_time / stats->seconds;
+            stats->codec_busy = coder_time / stats->seconds;
+            stats->write_busy = write_time / stats->seconds;
+        }
+        stats->bytes_read = bytes_read;
+        stats->bytes_written = bytes_written;
+    }
+
+    if (error)
+        return error;
+    return (ret == COMP_DECOMP_SINK_ERROR) ? COMP_DECOMP_FILE_ERROR : ret;
+}
+
+struct comp_decomp_pipeline_runner
+{
+    comp_decomp_file_reader& src;
+    comp_decomp_file_writer& dst;
+    const comp_decomp_pipeline_options& options;
+    comp_decomp_pipeline_stats *stats;
+
+    template <typename T_CODER>
+    int operator()(T_CODER& coder)
+    {
+        return comp_decomp_pipeline_run(coder, src, dst, options, stats);
+    }
+};
+
+inline int comp_decomp_file_pipelined(bool compress, const char *src, const char *dst,
+                                      comp_decomp_codec codec, int rate,
+                                      const comp_decomp_pipeline_options& options,
+                                      comp_decomp_pipeline_stats *stats)
+{
+    if (codec == COMP_DECOMP_CODEC_NONE)
+        codec = comp_decomp_codec_from_name(compress ? dst : src);
+
+    comp_decomp_file_reader input;
+    if (!input.open(src, options.sequential))
+        return COMP_DECOMP_FILE_ERROR;
+
+    comp_decomp_file_writer output;
+    if (!output.open(dst))
+        return COMP_DECOMP_FILE_ERROR;
+
+    comp_decomp_pipeline_runner runner = { input, output, options, stats };
+    int ret = comp_decomp_with_coder(compress, codec, rate, runner);
+
+    if (!output.close() && !ret)
+        ret = COMP_DECOMP_FILE_ERROR;
+    if (ret)
+        remove(dst);
+    return ret;
+}
+
+// Like comp_file, with reading, compressing and writing overlapped on
+// three threads. stats, if not NULL, receives the stage utilizations.
+inline int comp_file_pipelined(const char *src, const char *dst,
+                               comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE, int rate = 9,
+                               const comp_decomp_pipeline_options& options =
+                                   comp_decomp_pipeline_options(),
+                               comp_decomp_pipeline_stats *stats = NULL)
+{
+    return comp_decomp_file_pipelined(true, src, dst, codec, rate, options, stats);
+}
+
+// Like decomp_file, pipelined as comp_file_pipelined.
+inline int decomp_file_pipelined(const char *src, const char *dst,
+                                 comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+                                 const comp_decomp_pipeline_options& options =
+                                     comp_decomp_pipeline_options(),
+                                 comp_decomp_pipeline_stats *stats = NULL)
+{
+    return comp_decomp_file_pipelined(false, src, dst, codec, 9, options, stats);
+}
+
+inline bool pipeline_test_entry(const char *original_name, const std::string& original,
+                                const char *encoded_name)
+{
+    const char *decoded_name = "comp_decomp_pipeline_test.out";
+    comp_decomp_codec codec = comp_decomp_codec_from_name(encoded_name);
+
+    // small chunks, so that the rings fill up and wrap around
+    comp_decomp_pipeline_options options;
+    options.chunk_size = 1000;
+    options.chunks = 3;
+    comp_decomp_pipeline_stats stats;
+    if (int ret = comp_file_pipelined(original_name, encoded_name, COMP_DECOMP_CODEC_NONE, 6,
+                                      options, &stats))
+    {
+        printf("comp_file_pipelined failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+    if (stats.bytes_read != original.size() || stats.codec_busy <= 0)
+    {
+        printf("comp_file_pipelined stats are wrong\n");
+        return false;
+    }
+
+    // the pipelined output is the same format as comp_file's
+    if (int ret = decomp_file(encoded_name, decoded_name))
+    {
+        printf("decomp_file of pipelined data failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+    if (int ret = decomp_file_pipelined(encoded_name, decoded_name, COMP_DECOMP_CODEC_NONE,
+                                        options, &stats))
+    {
+        printf("decomp_file_pipelined failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+
+    std::string decoded;
+    if (FILE *fp = fopen(decoded_name, "rb"))
+    {
+        char buf[4096];
+        size_t size;
+        while ((size = fread(buf, 1, sizeof(buf), fp)) > 0)
+        {
+            decoded.append(buf, size);
+        }
+        fclose(fp);
+    }
+    remove(encoded_name);
+    remove(decoded_name);
+
+    if (!(original == decoded) || stats.bytes_written != original.size())
+    {
+        printf("pipeline mismatch (%s)\n", encoded_name);
+        return false;
+    }
+    return true;
+}
+
+inline bool pipeline_unittest(void)
+{
+    comp_decomp_ring<int> ring(3);
+    int item;
+    if (!ring.push(1) || !ring.push(2) || !ring.push(3) || !ring.push(4) || ring.push(5) ||
+        !ring.pop(item) || item != 1 || !ring.push(5))
+    {
+        printf("comp_decomp_ring failed\n");
+        return false;
+    }
+    for (int i = 2; i <= 5; ++i)
+    {
+        if (!ring.pop(item) || item != i)
+        {
+            printf("comp_decomp_ring order is wrong\n");
+            return false;
+        }
+    }
+    if (ring.pop(item))
+    {
+        printf("comp_decomp_ring is not empty\n");
+        return false;
+    }
+
+    const char *original_name = "comp_decomp_pipeline_test.dat";
+    if (comp_file_pipelined("comp_decomp_no_such_file", "comp_decomp_pipeline_test.xz") !=
+        COMP_DECOMP_FILE_ERROR)
+    {
+        printf("comp_file_pipelined succeeded on a missing file\n");
+        return false;
+    }
+
+    std::string original;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        original += (char)('a' + std::rand() % 4);
+    }
+
+    FILE *fp = fopen(original_name, "wb");
+    if (!fp)
+        return false;
+    fwrite(original.data(), 1, original.size(), fp);
+    fclose(fp);
+
+    bool ok = true;
+#ifdef HAVE_ZLIB
+    ok = ok && pipeline_test_entry(original_name, original, "comp_decomp_pipeline_test.zz");
+#endif
+#ifdef HAVE_BZLIB
+    ok = ok && pipeline_test_entry(original_name, original, "comp_decomp_pipeline_test.bz2");
+#endif
+#ifdef HAVE_LZMA
+    ok = ok && pipeline_test_entry(original_name, original, "comp_decomp_pipeline_test.xz");
+#endif
+    remove(original_name);
+    return ok;
+}
+
+#endif  // ndef COMP_DECOMP_PIPELINE_HPP_
@@ -0,0 +1,318 @@
+// comp_decomp_probe.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_PROBE_HPP_
+#define COMP_DECOMP_PROBE_HPP_
+
+#include "comp_decomp_file.hpp"
+
+// enum comp_decomp_check;
+// struct comp_decomp_probe_result;
+// int comp_decomp_probe(const void *input, size_t input_size,
+//                       comp_decomp_probe_result& result);
+// int probe_file(const char *src, comp_decomp_probe_result& result);
+// bool probe_unittest(void);
+
+// The integrity checks of the formats.
+enum comp_decomp_check
+{
+    COMP_DECOMP_CHECK_NONE = 0,
+    COMP_DECOMP_CHECK_ADLER32,      // zlib
+    COMP_DECOMP_CHECK_CRC32,        // gzip, bzip2 and xz
+    COMP_DECOMP_CHECK_CRC64,        // xz
+    COMP_DECOMP_CHECK_SHA256,       // xz
+    COMP_DECOMP_CHECK_UNKNOWN
+};
+
+// What comp_decomp_probe can tell without decoding. Counts that the
+// format does not record are 0.
+struct comp_decomp_probe_result
+{
+    comp_decomp_codec codec;    // COMP_DECOMP_CODEC_NONE if not recognized
+    bool gzip;                  // gzip rather than zlib data
+    bool size_known;
+    uint64_t size;              // the decompressed size, if size_known
+    uint64_t streams;           // xz streams
+    uint64_t blocks;            // xz blocks
+    comp_decomp_check check;
+    uint64_t memory;            // the work memory of the decoder, without the output
+
+    comp_decomp_probe_result()
+        : codec(COMP_DECOMP_CODEC_NONE), gzip(false), size_known(false), size(0),
+          streams(0), blocks(0), check(COMP_DECOMP_CHECK_NONE), memory(0)
+    {
+    }
+};
+
+#ifdef HAVE_LZMA
+    // The work memory that lzma_decompressor needs for the block whose
+    // header is at ptr, or 0 if the header is wrong.
+    inline uint64_t comp_decomp_probe_xz_block(const uint8_t *ptr, size_t avail,
+                                               lzma_check check)
+    {
+        if (avail == 0 || ptr[0] == 0)
+            return 0;
+
+        lzma_filter filters[LZMA_FILTERS_MAX + 1];
+        lzma_block block;
+        memset(&block, 0, sizeof(block));
+        block.version = 0;
+        block.check = check;
+        block.filters = filters;
+        block.header_size = lzma_block_header_size_decode(ptr[0]);
+        if (block.header_size > avail ||
+            lzma_block_header_decode(&block, NULL, ptr) != LZMA_OK)
+        {
+            return 0;
+        }
+
+        uint64_t usage = lzma_raw_decoder_memusage(filters);
+        for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+            free(filters[i].options);
+        return (usage == UINT64_MAX) ? 0 : usage;
+    }
+
+    // Reads the indexes and the block headers of xz data: the sizes and the
+    // counts from the former, and the memory from the filters of the latter.
+    inline int comp_decomp_probe_xz(const void *input, size_t input_size,
+                                    comp_decomp_probe_result& result)
+    {
+        lzma_index *index;
+        lzma_ret ret = lzma_decode_index(&index, input, input_size);
+        if (ret != LZMA_OK)
+            return ret;
+
+        result.size_known = true;
+        result.size = lzma_index_uncompressed_size(index);
+        result.streams = lzma_index_stream_count(index);
+        result.blocks = lzma_index_block_count(index);
+
+        const uint8_t *ptr = (const uint8_t *)input;
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+        {
+            lzma_vli offset = iter.block.compressed_file_offset;
+            if (offset >= input_size)
+            {
+                ret = LZMA_DATA_ERROR;
+                break;
+            }
+            uint64_t usage = comp_decomp_probe_xz_block(ptr + offset, input_size - offset,
+                                                        iter.stream.flags->check);
+            if (!usage)
+            {
+                ret = LZMA_DATA_ERROR;
+                break;
+            }
+            if (usage > result.memory)
+                result.memory = usage;
+        }
+        lzma_index_end(index, NULL);
+        return ret;
+    }
+#endif  // def HAVE_LZMA
+
+// Tells the format of input from its magic bytes and reads what the headers,
+// the trailers and the xz indexes record. The time does not depend on the
+// size of the data. The gzip size is the ISIZE of the last member: modulo
+// 4 GiB, so a hint only. Returns COMP_DECOMP_CODEC_ERROR for data of no
+// known format, or an error of the codec for damaged xz indexes.
+inline int comp_decomp_probe(const void *input, size_t input_size,
+                             comp_decomp_probe_result& result)
+{
+    const unsigned char *ptr = (const unsigned char *)input;
+    result = comp_decomp_probe_result();
+
+    if (input_size >= 12 && memcmp(ptr, "\xFD" "7zXZ", 6) == 0)
+    {
+        result.codec = COMP_DECOMP_CODEC_LZMA;
+        switch (ptr[7] & 0x0F)
+        {
+        case 0: result.check = COMP_DECOMP_CHECK_NONE; break;
+        case 1: result.check = COMP_DECOMP_CHECK_CRC32; break;
+        case 4: result.check = COMP_DECOMP_CHECK_CRC64; break;
+        case 10: result.check = COMP_DECOMP_CHECK_SHA256; break;
+        default: result.check = COMP_DECOMP_CHECK_UNKNOWN; break;
+        }
+#ifdef HAVE_LZMA
+        return comp_decomp_probe_xz(input, input_size, result);
+#else
+        return 0;
+#endif
+    }
+
+    if (input_size >= 4 && memcmp(ptr, "BZh", 3) == 0 && '1' <= ptr[3] && ptr[3] <= '9')
+    {
+        result.codec = COMP_DECOMP_CODEC_BZLIB;
+        result.check = COMP_DECOMP_CHECK_CRC32;
+        result.memory = 100000 + 4 * 100000 * (uint64_t)(ptr[3] - '0');
+        return 0;
+    }
+
+    if (input_size >= 18 && ptr[0] == 0x1F && ptr[1] == 0x8B && ptr[2] == 8)
+    {
+        result.codec = COMP_DECOMP_CODEC_ZLIB;
+        result.gzip = true;
+        result.check = COMP_DECOMP_CHECK_CRC32;
+        const unsigned char *isize = ptr + input_size - 4;
+        result.size_known = true;
+        result.size = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((uint64_t)isize[3] << 24);
+#ifdef HAVE_ZLIB
+        result.memory = (1 << MAX_WBITS) + COMP_DECOMP_ZLIB_INFLATE_STATE;
+#endif
+        return 0;
+    }
+
+    if (input_size >= 6 && (ptr[0] & 0x0F) == 8 && (ptr[0] >> 4) <= 7 &&
+        ((ptr[0] << 8) | ptr[1]) % 31 == 0)
+    {
+        result.codec = COMP_DECOMP_CODEC_ZLIB;
+        result.check = COMP_DECOMP_CHECK_ADLER32;
+#ifdef HAVE_ZLIB
+        result.memory = (1 << ((ptr[0] >> 4) + 8)) + COMP_DECOMP_ZLIB_INFLATE_STATE;
+#endif
+        return 0;
+    }
+
+    return COMP_DECOMP_CODEC_ERROR;
+}
+
+// The same for the file src, of which only the pages of the headers and the
+// indexes are read.
+inline int probe_file(const char *src, comp_decomp_probe_result& result)
+{
+    result = comp_decomp_probe_result();
+    comp_decomp_file_map input;
+    if (!input.open(src, false))
+        return COMP_DECOMP_FILE_ERROR;
+    return comp_decomp_probe(input.data(), input.size(), result);
+}
+
+inline bool probe_test_entry(const std::string& encoded, comp_decomp_codec codec,
+                             comp_decomp_check check, bool size_known, uint64_t size)
+{
+    comp_decomp_probe_result result;
+    if (int ret = comp_decomp_probe(encoded.data(), encoded.size(), result))
+    {
+        printf("comp_decomp_probe failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+    if (result.codec != codec || result.check != check || result.size_known != size_known ||
+        (size_known && result.size != size) || result.memory == 0)
+    {
+        printf("comp_decomp_probe is wrong (codec %d)\n", (int)codec);
+        return false;
+    }
+    return true;
+}
+
+inline bool probe_unittest(void)
+{
+    std::string original;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        original += (char)('a' + std::rand() % 4);
+    }
+
+    comp_decomp_probe_result result;
+    const char text[] = "plain text, not compressed";
+    if (comp_decomp_probe(text, sizeof(text) - 1, result) != COMP_DECOMP_CODEC_ERROR ||
+        comp_decomp_probe(NULL, 0, result) != COMP_DECOMP_CODEC_ERROR)
+    {
+        printf("comp_decomp_probe took text for compressed data\n");
+        return false;
+    }
+
+    std::string encoded;
+#ifdef HAVE_ZLIB
+    zlib_comp(encoded, original.data(), original.size());
+    if (!probe_test_entry(encoded, COMP_DECOMP_CODEC_ZLIB, COMP_DECOMP_CHECK_ADLER32, false, 0))
+        return false;
+    zlib_options gzip;
+    gzip.window_bits += 16;
+    zlib_comp(encoded, original.data(), original.size(), gzip);
+    if (!probe_test_entry(encoded, COMP_DECOMP_CODEC_ZLIB, COMP_DECOMP_CHECK_CRC32,
+                          true, original.size()))
+        return false;
+
+    // the window of the zlib header sets the memory
+    zlib_comp(encoded, original.data(), original.size(), zlib_options::low_memory());
+    comp_decomp_probe(encoded.data(), encoded.size(), result);
+    if (result.gzip || result.memory != 4096 + COMP_DECOMP_ZLIB_INFLATE_STATE)
+    {
+        printf("comp_decomp_probe got the zlib window wrong\n");
+        return false;
+    }
+#endif
+#ifdef HAVE_BZLIB
+    bzlib_comp(encoded, original.data(), original.size(), 1);
+    if (!probe_test_entry(encoded, COMP_DECOMP_CODEC_BZLIB, COMP_DECOMP_CHECK_CRC32, false, 0))
+        return false;
+#endif
+#ifdef HAVE_LZMA
+    lzma_comp(encoded, original.data(), original.size(), lzma_options::low_memory());
+    if (!probe_test_entry(encoded, COMP_DECOMP_CODEC_LZMA, COMP_DECOMP_CHECK_CRC64,
+                          true, original.size()))
+        return false;
+    comp_decomp_probe(encoded.data(), encoded.size(), result);
+    if (result.streams != 1 || result.blocks != 1 || result.memory > 1024 * 1024)
+    {
+        printf("comp_decomp_probe got the xz blocks wrong\n");
+        return false;
+    }
+
+    // two streams, the second of several blocks
+    std::string second;
+    lzma_comp_seekable(second, original.data(), original.size(), 1, 16 * 1024);
+    encoded += second;
+    comp_decomp_probe(encoded.data(), encoded.size(), result);
+    if (result.size != 2 * original.size() || result.streams != 2 ||
+        result.blocks != 1 + (original.size() + 16 * 1024 - 1) / (16 * 1024))
+    {
+        printf("comp_decomp_probe got the xz streams wrong\n");
+        return false;
+    }
+
+    lzma_options sha256;
+    sha256.check = LZMA_CHECK_SHA256;
+    lzma_comp(encoded, "", 0, sha256);
+    if (comp_decomp_probe(encoded.data(), encoded.size(), result) || result.size != 0 ||
+        result.blocks != 0 || result.check != COMP_DECOMP_CHECK_SHA256)
+    {
+        printf("comp_decomp_probe failed on empty xz data\n");
+        return false;
+    }
+
+    // the index of truncated data is not found
+    lzma_comp(encoded, original.data(), original.size());
+    if (!comp_decomp_probe(encoded.data(), encoded.size() - 1, result) ||
+        result.codec != COMP_DECOMP_CODEC_LZMA)
+    {
+        printf("comp_decomp_probe accepted truncated xz data\n");
+        return false;
+    }
+
+    const char *name = "comp_decomp_probe_test.xz";
+    if (FILE *fp = fopen(name, "wb"))
+    {
+        fwrite(encoded.data(), 1, encoded.size(), fp);
+        fclose(fp);
+    }
+    int ret = probe_file(name, result);
+    remove(name);
+    if (ret || result.size != original.size())
+    {
+        printf("probe_file failed: %s\n", comp_decomp_errmsg(COMP_DECOMP_CODEC_LZMA, ret));
+        return false;
+    }
+#endif
+    if (probe_file("comp_decomp_no_such_file", result) != COMP_DECOMP_FILE_ERROR)
+    {
+        printf("probe_file succeeded on a missing file\n");
+        return false;
+    }
+    return true;
+}
+
+#endif  // ndef COMP_DECOMP_PROBE_HPP_
@@ -0,0 +1,376 @@
+// comp_decomp_stats.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_STATS_HPP_
+#define COMP_DECOMP_STATS_HPP_
+
+// Statistics of the zlib_/bzlib_/lzma_ comp and decomp functions, compiled
+// in only if COMP_DECOMP_STATS is defined before comp_decomp is included.
+// Without it the hooks below expand to nothing and no code is added.
+//
+// Each thread counts into counters of its own, so the calls take no lock.
+// comp_decomp_stats_snapshot adds up the counters of all the threads,
+// including the threads that have exited. A callback set with
+// comp_decomp_set_stats_callback sees every call as it returns.
+
+#ifdef COMP_DECOMP_STATS
+
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <time.h>
+#endif
+
+// struct comp_decomp_call_stats;
+// struct comp_decomp_stats;
+// typedef void (*comp_decomp_stats_callback)(const comp_decomp_call_stats& call);
+// void comp_decomp_set_stats_callback(comp_decomp_stats_callback callback);
+// comp_decomp_stats comp_decomp_stats_snapshot(void);
+// comp_decomp_stats comp_decomp_stats_snapshot(int codec, bool compress);
+
+// the number of comp_decomp_codec values
+#define COMP_DECOMP_STATS_CODECS 4
+
+// One call. codec is a comp_decomp_codec.
+struct comp_decomp_call_stats
+{
+    int codec;
+    bool compress;
+    int status;             // the return value
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;        // CPU time of the calling thread
+    uint64_t iterations;    // turns of the codec loop
+    uint64_t reallocs;      // times the output was moved to a bigger buffer
+    uint64_t mem_peak;      // most codec work memory in use at once
+};
+
+// The sum of many calls. mem_peak is the largest of one call.
+struct comp_decomp_stats
+{
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t iterations;
+    uint64_t reallocs;
+    uint64_t mem_peak;
+
+    comp_decomp_stats()
+        : calls(0), errors(0), bytes_in(0), bytes_out(0), wall_ns(0), cpu_ns(0),
+          iterations(0), reallocs(0), mem_peak(0)
+    {
+    }
+
+    void add(const comp_decomp_stats& other)
+    {
+        calls += other.calls;
+        errors += other.errors;
+        bytes_in += other.bytes_in;
+        bytes_out += other.bytes_out;
+        wall_ns += other.wall_ns;
+        cpu_ns += other.cpu_ns;
+        iterations += other.iterations;
+        reallocs += other.reallocs;
+        mem_peak = std::max(mem_peak, other.mem_peak);
+    }
+};
+
+typedef void (*comp_decomp_stats_callback)(const comp_decomp_call_stats& call);
+
+// Counters written by one thread and read by any. The writer needs no
+// atomic read-modify-write, as it is the only one.
+class comp_decomp_stats_cell
+{
+public:
+    comp_decomp_stats_cell()
+    {
+        for (size_t i = 0; i < FIELDS; ++i)
+            m_values[i] = 0;
+    }
+
+    void add(const comp_decomp_call_stats& call)
+    {
+        bump(0, 1);
+        bump(1, call.status != 0);
+        bump(2, call.bytes_in);
+        bump(3, call.bytes_out);
+        bump(4, call.wall_ns);
+        bump(5, call.cpu_ns);
+        bump(6, call.iterations);
+        bump(7, call.reallocs);
+        if (call.mem_peak > m_values[8].load(std::memory_order_relaxed))
+            m_values[8].store(call.mem_peak, std::memory_order_relaxed);
+    }
+
+    comp_decomp_stats load() const
+    {
+        comp_decomp_stats stats;
+        stats.calls = get(0);
+        stats.errors = get(1);
+        stats.bytes_in = get(2);
+        stats.bytes_out = get(3);
+        stats.wall_ns = get(4);
+        stats.cpu_ns = get(5);
+        stats.iterations = get(6);
+        stats.reallocs = get(7);
+        stats.mem_peak = get(8);
+        return stats;
+    }
+
+protected:
+    enum { FIELDS = 9 };
+    std::atomic<uint64_t> m_values[FIELDS];
+
+    void bump(size_t i, uint64_t value)
+    {
+        m_values[i].store(m_values[i].load(std::memory_order_relaxed) + value,
+                          std::memory_order_relaxed);
+    }
+
+    uint64_t get(size_t i) const
+    {
+        return m_values[i].load(std::memory_order_relaxed);
+    }
+};
+
+class comp_decomp_stats_slot;
+
+// All the slots of the running threads, and the sums of the exited ones.
+struct comp_decomp_stats_registry
+{
+    std::mutex lock;
+    std::vector<comp_decomp_stats_slot *> slots;
+    comp_decomp_stats retired[COMP_DECOMP_STATS_CODECS][2];
+    std::atomic<comp_decomp_stats_callback> callback;
+
+    comp_decomp_stats_registry() : callback(NULL)
+    {
+    }
+};
+
+inline comp_decomp_stats_registry& comp_decomp_stats_global(void)
+{
+    static comp_decomp_stats_registry s_registry;
+    return s_registry;
+}
+
+// The counters of a thread, and the state of its call in progress.
+class comp_decomp_stats_slot
+{
+public:
+    comp_decomp_stats_cell cells[COMP_DECOMP_STATS_CODECS][2];
+    uint64_t iterations;
+    uint64_t reallocs;
+    int64_t live;   // codec work memory in use
+    int64_t peak;   // the most of live since the call began
+
+    comp_decomp_stats_slot() : iterations(0), reallocs(0), live(0), peak(0)
+    {
+        comp_decomp_stats_registry& registry = comp_decomp_stats_global();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.slots.push_back(this);
+    }
+
+    ~comp_decomp_stats_slot()
+    {
+        comp_decomp_stats_registry& registry = comp_decomp_stats_global();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (int codec = 0; codec < COMP_DECOMP_STATS_CODECS; ++codec)
+        {
+            for (int compress = 0; compress < 2; ++compress)
+                registry.retired[codec][compress].add(cells[codec][compress].load());
+        }
+        registry.slots.erase(std::find(registry.slots.begin(), registry.slots.end(), this));
+    }
+
+    void alloc(size_t size)
+    {
+        live += (int64_t)size;
+        if (live > peak)
+            peak = live;
+    }
+
+    void free(size_t size)
+    {
+        live -= (int64_t)size;
+    }
+
+private:
+    comp_decomp_stats_slot(const comp_decomp_stats_slot&) = delete;
+    comp_decomp_stats_slot& operator=(const comp_decomp_stats_slot&) = delete;
+};
+
+inline comp_decomp_stats_slot& comp_decomp_stats_local(void)
+{
+    static thread_local comp_decomp_stats_slot s_slot;
+    return s_slot;
+}
+
+inline uint64_t comp_decomp_thread_cpu_ns(void)
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (k + u) * 100;
+#else
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Measures one call from its construction to result().
+class comp_decomp_stats_scope
+{
+public:
+    comp_decomp_stats_scope(int codec, bool compress, size_t input_size)
+        : m_slot(comp_decomp_stats_local()), m_memory(0)
+    {
+        m_call.codec = codec;
+        m_call.compress = compress;
+        m_call.bytes_in = input_size;
+        m_iterations = m_slot.iterations;
+        m_reallocs = m_slot.reallocs;
+        m_live = m_slot.live;
+        m_outer_peak = m_slot.peak;
+        m_slot.peak = m_slot.live;
+        m_cpu = comp_decomp_thread_cpu_ns();
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    // The codec work memory is counted as it goes through an allocator, so
+    // a call without one gets the thread's counting malloc.
+    template <typename T_ALLOCATOR>
+    T_ALLOCATOR *watch(T_ALLOCATOR *allocator)
+    {
+        static thread_local T_ALLOCATOR s_allocator;
+        return allocator ? allocator : &s_allocator;
+    }
+
+    // For a codec that counts its work memory itself.
+    void memory(uint64_t bytes)
+    {
+        m_memory = std::max(m_memory, bytes);
+    }
+
+    template <typename T_RET>
+    T_RET result(T_RET ret, size_t output_size)
+    {
+        std::chrono::steady_clock::duration wall = std::chrono::steady_clock::now() - m_start;
+        m_call.status = (int)ret;
+        m_call.bytes_out = output_size;
+        m_call.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count();
+        m_call.cpu_ns = comp_decomp_thread_cpu_ns() - m_cpu;
+        m_call.iterations = m_slot.iterations - m_iterations;
+        m_call.reallocs = m_slot.reallocs - m_reallocs;
+        m_call.mem_peak = (m_slot.peak > m_live) ? m_slot.peak - m_live : 0;
+        m_call.mem_peak = std::max(m_call.mem_peak, m_memory);
+        m_slot.peak = std::max(m_slot.peak, m_outer_peak);
+
+        m_slot.cells[m_call.codec % COMP_DECOMP_STATS_CODECS][m_call.compress].add(m_call);
+        comp_decomp_stats_callback callback = comp_decomp_stats_global().callback;
+        if (callback)
+            callback(m_call);
+        return ret;
+    }
+
+protected:
+    comp_decomp_stats_slot& m_slot;
+    comp_decomp_call_stats m_call;
+    uint64_t m_iterations;
+    uint64_t m_reallocs;
+    int64_t m_live;
+    int64_t m_outer_peak;
+    uint64_t m_cpu;
+    uint64_t m_memory;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// Calls callback on the calling thread at the end of every call, or stops
+// calling if it is NULL. It must be quick and thread-safe.
+inline void comp_decomp_set_stats_callback(comp_decomp_stats_callback callback)
+{
+    comp_decomp_stats_global().callback = callback;
+}
+
+// The sums of all the calls of a codec in one direction so far. Take two
+// snapshots and compare them to see a period of time.
+inline comp_decomp_stats comp_decomp_stats_snapshot(int codec, bool compress)
+{
+    comp_decomp_stats_registry& registry = comp_decomp_stats_global();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    comp_decomp_stats stats = registry.retired[codec][compress];
+    for (size_t i = 0; i < registry.slots.size(); ++i)
+        stats.add(registry.slots[i]->cells[codec][compress].load());
+    return stats;
+}
+
+// The sums of all the calls so far.
+inline comp_decomp_stats comp_decomp_stats_snapshot(void)
+{
+    comp_decomp_stats stats;
+    for (int codec = 0; codec < COMP_DECOMP_STATS_CODECS; ++codec)
+    {
+        for (int compress = 0; compress < 2; ++compress)
+            stats.add(comp_decomp_stats_snapshot(codec, compress != 0));
+    }
+    return stats;
+}
+
+// The last call of the calling thread that the test callback saw.
+inline comp_decomp_call_stats& comp_decomp_stats_test_last(void)
+{
+    static thread_local comp_decomp_call_stats s_last;
+    return s_last;
+}
+
+inline void comp_decomp_stats_test_callback(const comp_decomp_call_stats& call)
+{
+    comp_decomp_stats_test_last() = call;
+}
+
+// Starts measuring the function it is in.
+#define COMP_DECOMP_STATS_SCOPE(codec, compress, input_size) \
+    comp_decomp_stats_scope comp_decomp_stats_scope_((codec), (compress), (input_size))
+// Makes allocator, if NULL, the counting one. liblzma zeroes the blocks of
+// an allocator itself instead of using calloc, which costs too much for
+// this, so the lzma functions report COMP_DECOMP_STATS_MEMORY instead.
+#define COMP_DECOMP_STATS_WATCH(allocator) \
+    ((allocator) = comp_decomp_stats_scope_.watch(allocator))
+#define COMP_DECOMP_STATS_MEMORY(bytes) comp_decomp_stats_scope_.memory(bytes)
+// Records the call and gives back ret.
+#define COMP_DECOMP_STATS_RESULT(ret, output_size) \
+    comp_decomp_stats_scope_.result((ret), (output_size))
+#define COMP_DECOMP_STATS_ITERATION() (++comp_decomp_stats_local().iterations)
+#define COMP_DECOMP_STATS_REALLOC() (++comp_decomp_stats_local().reallocs)
+#define COMP_DECOMP_STATS_ALLOC(size) comp_decomp_stats_local().alloc(size)
+#define COMP_DECOMP_STATS_FREE(size) comp_decomp_stats_local().free(size)
+
+#else   // ndef COMP_DECOMP_STATS
+
+#define COMP_DECOMP_STATS_SCOPE(codec, compress, input_size) ((void)0)
+#define COMP_DECOMP_STATS_WATCH(allocator) ((void)0)
+#define COMP_DECOMP_STATS_MEMORY(bytes) ((void)0)
+#define COMP_DECOMP_STATS_RESULT(ret, output_size) (ret)
+#define COMP_DECOMP_STATS_ITERATION() ((void)0)
+#define COMP_DECOMP_STATS_REALLOC() ((void)0)
+#define COMP_DECOMP_STATS_ALLOC(size) ((void)0)
+#define COMP_DECOMP_STATS_FREE(size) ((void)0)
+
+#endif  // ndef COMP_DECOMP_STATS
+
+#endif  // ndef COMP_DECOMP_STATS_HPP_
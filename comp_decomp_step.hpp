@@ -0,0 +1,324 @@
+// comp_decomp_step.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_STEP_HPP_
+#define COMP_DECOMP_STEP_HPP_
+
+#include "comp_decomp_common.hpp"
+#ifdef HAVE_ZLIB
+    #include "comp_decomp_zlib.hpp"
+#endif
+#ifdef HAVE_BZLIB
+    #include "comp_decomp_bzlib.hpp"
+#endif
+#ifdef HAVE_LZMA
+    #include "comp_decomp_lzma.hpp"
+#endif
+
+#include <chrono>
+
+// class comp_decomp_stepper<T_CODER>;
+// bool step_unittest(void);
+
+// The most input bytes given to the codec between two looks at the clock.
+// Under a time limit the slices shrink to a quarter of it, as far as
+// COMP_DECOMP_STEP_MIN_SLICE bytes.
+#ifndef COMP_DECOMP_STEP_SLICE
+    #define COMP_DECOMP_STEP_SLICE (16 * 1024)
+#endif
+#ifndef COMP_DECOMP_STEP_MIN_SLICE
+    #define COMP_DECOMP_STEP_MIN_SLICE 256
+#endif
+
+// Runs a compressor or decompressor context over a whole input in steps,
+// for callers that must not block for long, such as an event loop. Each
+// step() does a bounded amount of work and returns. The codec state
+// stays in the context between steps. The output goes to a sink as it
+// comes.
+//
+//     lzma_compressor coder(6);
+//     comp_decomp_stepper<lzma_compressor> job(coder);
+//     job.begin(input, input_size, sink);
+//     while (!job.done())
+//     {
+//         if (int ret = job.step(0, 2000))   // 2 ms per turn of the loop
+//             ...
+//         // serve other requests
+//     }
+//
+// A step can overrun by one slice of input and by the work of the finish.
+// bzip2 sorts whole blocks, so with it a step can take as long as one
+// block (bzlib_options::fastest() has the smallest).
+// The input must outlive the job. An object must not be used by two
+// threads at once.
+template <typename T_CODER>
+class comp_decomp_stepper
+{
+public:
+    explicit comp_decomp_stepper(T_CODER& coder)
+        : m_coder(coder), m_input(NULL), m_input_size(0), m_consumed(0), m_produced(0),
+          m_slice(COMP_DECOMP_STEP_SLICE), m_ret(0), m_done(true), m_cancelled(false)
+    {
+    }
+
+    // Starts a job over the input_size bytes at input.
+    int begin(const void *input, size_t input_size, const comp_decomp_sink& sink,
+              size_t buffsize = COMP_DECOMP_BUFFSIZE)
+    {
+        m_input = (const char *)input;
+        m_input_size = input_size;
+        m_consumed = m_produced = 0;
+        m_slice = COMP_DECOMP_STEP_SLICE;
+        m_cancelled = false;
+        m_done = false;
+        m_sink = sink;
+
+        comp_decomp_sink counted = [this](const void *data, size_t size) {
+            m_produced += size;
+            return m_sink(data, size);
+        };
+        m_ret = (int)m_coder.begin(counted, buffsize);
+        if (m_ret)
+            m_done = true;
+        return m_ret;
+    }
+
+    // Gives the codec at most max_bytes bytes of input (0 for any) and
+    // max_micros microseconds (0 for any), and then returns. Returns 0 while
+    // it goes well, or the error that ended the job, which is
+    // COMP_DECOMP_CANCEL_ERROR after cancel().
+    int step(size_t max_bytes, uint64_t max_micros = 0)
+    {
+        if (m_done)
+            return m_ret;
+        if (m_cancelled)
+            return end(COMP_DECOMP_CANCEL_ERROR);
+
+        typedef std::chrono::steady_clock clock;
+        clock::time_point start = clock::now(), now = start;
+        size_t budget = max_bytes ? max_bytes : SIZE_MAX;
+        while (m_consumed < m_input_size)
+        {
+            size_t slice = m_input_size - m_consumed;
+            if (slice > m_slice)
+                slice = m_slice;
+            if (slice > budget)
+                slice = budget;
+            if (slice == 0)
+                return 0;
+
+            if (int ret = (int)m_coder.write(m_input + m_consumed, slice))
+                return end(ret);
+            m_consumed += slice;
+            budget -= slice;
+            if (!max_micros)
+                continue;
+
+            // fit the next slice to the speed of the codec
+            clock::time_point then = now;
+            now = clock::now();
+            uint64_t micros =
+                std::chrono::duration_cast<std::chrono::microseconds>(now - then).count();
+            m_slice = (size_t)(slice * (max_micros / 4 + 1) / (micros + 1));
+            if (m_slice < COMP_DECOMP_STEP_MIN_SLICE)
+                m_slice = COMP_DECOMP_STEP_MIN_SLICE;
+            if (m_slice > COMP_DECOMP_STEP_SLICE)
+                m_slice = COMP_DECOMP_STEP_SLICE;
+
+            if (m_consumed < m_input_size && now - start >= std::chrono::microseconds(max_micros))
+                return 0;
+        }
+        return end((int)m_coder.finish());
+    }
+
+    // Makes the next step() end the job with COMP_DECOMP_CANCEL_ERROR. The
+    // output that went to the sink is incomplete.
+    void cancel()
+    {
+        m_cancelled = true;
+    }
+
+    bool done() const
+    {
+        return m_done;
+    }
+
+    // The input bytes given to the codec so far.
+    size_t consumed() const
+    {
+        return m_consumed;
+    }
+
+    // The output bytes given to the sink so far.
+    uint64_t produced() const
+    {
+        return m_produced;
+    }
+
+    // The part of the input done, from 0 to 1.
+    double progress() const
+    {
+        if (m_input_size == 0)
+            return m_done ? 1.0 : 0.0;
+        return (double)m_consumed / m_input_size;
+    }
+
+protected:
+    T_CODER& m_coder;
+    comp_decomp_sink m_sink;
+    const char *m_input;
+    size_t m_input_size;
+    size_t m_consumed;
+    uint64_t m_produced;
+    size_t m_slice;
+    int m_ret;
+    bool m_done;
+    bool m_cancelled;
+
+    int end(int ret)
+    {
+        m_ret = ret;
+        m_done = true;
+        return ret;
+    }
+
+private:
+    comp_decomp_stepper(const comp_decomp_stepper&) = delete;
+    comp_decomp_stepper& operator=(const comp_decomp_stepper&) = delete;
+};
+
+// Runs coder over input in steps of max_bytes bytes into output, and
+// counts the steps.
+template <typename T_CODER>
+inline int step_test_run(T_CODER& coder, std::string& output, const std::string& input,
+                         size_t max_bytes, uint64_t max_micros, size_t& steps)
+{
+    output.clear();
+    comp_decomp_sink sink = [&output](const void *data, size_t size) {
+        output.append((const char *)data, size);
+        return true;
+    };
+
+    comp_decomp_stepper<T_CODER> job(coder);
+    steps = 0;
+    if (int ret = job.begin(input.data(), input.size(), sink))
+        return ret;
+
+    double progress = 0;
+    while (!job.done())
+    {
+        if (int ret = job.step(max_bytes, max_micros))
+            return ret;
+        ++steps;
+        if (job.progress() < progress || job.produced() != output.size())
+            return COMP_DECOMP_SINK_ERROR;
+        progress = job.progress();
+    }
+    return (job.progress() == 1.0) ? 0 : COMP_DECOMP_SINK_ERROR;
+}
+
+template <typename T_COMPRESSOR, typename T_DECOMPRESSOR>
+inline bool step_test_entry(const char *name, const std::string& original)
+{
+    T_COMPRESSOR compressor;
+    T_DECOMPRESSOR decompressor;
+    std::string encoded, decoded;
+    size_t steps;
+
+    // by bytes
+    if (int ret = step_test_run(compressor, encoded, original, 1000, 0, steps))
+    {
+        printf("%s stepper failed to compress: %d\n", name, ret);
+        return false;
+    }
+    if (steps < original.size() / 1000)
+    {
+        printf("%s stepper took too few steps\n", name);
+        return false;
+    }
+    if (int ret = step_test_run(decompressor, decoded, encoded, 100, 0, steps))
+    {
+        printf("%s stepper failed to decompress: %d\n", name, ret);
+        return false;
+    }
+    if (!(original == decoded))
+    {
+        printf("%s stepper mismatch\n", name);
+        return false;
+    }
+
+    // by time: about one slice per step
+    if (int ret = step_test_run(compressor, encoded, original, 0, 1, steps))
+    {
+        printf("%s stepper failed to compress in time steps: %d\n", name, ret);
+        return false;
+    }
+    if (!original.empty() && steps < 2)
+    {
+        printf("%s stepper took too few time steps\n", name);
+        return false;
+    }
+
+    // a cancelled job stops at the next step
+    if (original.empty())
+        return true;
+    comp_decomp_stepper<T_COMPRESSOR> job(compressor);
+    comp_decomp_sink sink = [](const void *, size_t) {
+        return true;
+    };
+    job.begin(original.data(), original.size(), sink);
+    job.step(1000);
+    job.cancel();
+    if (job.step(1000) != COMP_DECOMP_CANCEL_ERROR || !job.done() ||
+        job.step(1000) != COMP_DECOMP_CANCEL_ERROR)
+    {
+        printf("%s stepper was not cancelled\n", name);
+        return false;
+    }
+    return true;
+}
+
+inline bool step_unittest(void)
+{
+    std::string original;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        original += (char)('a' + std::rand() % 4);
+    }
+
+#ifdef HAVE_ZLIB
+    if (!step_test_entry<zlib_compressor, zlib_decompressor>("zlib", original))
+        return false;
+    if (!step_test_entry<zlib_compressor, zlib_decompressor>("zlib", std::string()))
+        return false;
+#endif
+#ifdef HAVE_BZLIB
+    if (!step_test_entry<bzlib_compressor, bzlib_decompressor>("bzlib", original))
+        return false;
+#endif
+#ifdef HAVE_LZMA
+    if (!step_test_entry<lzma_compressor, lzma_decompressor>("lzma", original))
+        return false;
+#endif
+
+    // a failing sink ends the job
+#ifdef HAVE_ZLIB
+    zlib_compressor compressor;
+    comp_decomp_stepper<zlib_compressor> job(compressor);
+    job.begin(original.data(), original.size(), [](const void *, size_t) {
+        return false;
+    });
+    while (!job.done())
+    {
+        job.step(1000);
+    }
+    if (job.step(1000) != COMP_DECOMP_SINK_ERROR)
+    {
+        printf("stepper ignored a failing sink\n");
+        return false;
+    }
+#endif
+    return true;
+}
+
+#endif  // ndef COMP_DECOMP_STEP_HPP_
@@ -0,0 +1,336 @@
+// comp_decomp_stress_test.cpp --- all codecs at once on many threads
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+//
+// comp_decomp_stress_test [--threads 1,2,4,8,16,32,64] [--sizes 0,1,1K,64K,1M,4M]
+//                         [--rounds 1] [--rate 1]
+//
+// Every thread round-trips every input through every codec, each thread
+// starting at another codec than its neighbour, so that all codecs run at
+// the same time. Each result is compared with the input. The throughput
+// is of the input bytes that all the threads round-trip together, and the
+// speedup is against the first thread count. Configure with
+// -DCOMP_DECOMP_TSAN=ON to run it under ThreadSanitizer.
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "comp_decomp.hpp"
+
+namespace cr = std::chrono;
+typedef cr::high_resolution_clock my_clock;
+
+//////////////////////////////////////////////////////////////////////////////
+// inputs
+
+struct xorshift
+{
+    uint64_t state;
+
+    explicit xorshift(uint64_t seed) : state(seed)
+    {
+    }
+
+    uint64_t next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+};
+
+static std::string make_random(size_t size)
+{
+    xorshift rng(0x9E3779B97F4A7C15ULL);
+    std::string ret(size, 0);
+    for (size_t i = 0; i < size; i += 8)
+    {
+        uint64_t r = rng.next();
+        memcpy(&ret[i], &r, (size - i < 8) ? size - i : 8);
+    }
+    return ret;
+}
+
+// Words from a small vocabulary, a line of them at a time.
+static std::string make_text(size_t size)
+{
+    static const char *s_words[] =
+    {
+        "the", "of", "compress", "stream", "buffer", "thread", "data", "and",
+        "block", "window", "a", "decode", "header", "to", "in", "output",
+    };
+    xorshift rng(12345);
+    std::string ret;
+    ret.reserve(size + 16);
+    while (ret.size() < size)
+    {
+        uint64_t r = rng.next();
+        ret += s_words[r % 16];
+        ret += ((r >> 8) % 12) ? ' ' : '\n';
+    }
+    ret.resize(size);
+    return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// round trips
+
+typedef int (*round_trip_t)(std::string& decoded, const std::string& input, int rate);
+
+// Feeds the input to a context in pieces, with a small buffer.
+template <typename T_CODER>
+static int stream_run(T_CODER& coder, std::string& output, const std::string& input)
+{
+    output.clear();
+    comp_decomp_sink sink = [&output](const void *data, size_t size) {
+        output.append((const char *)data, size);
+        return true;
+    };
+    if (int ret = (int)coder.begin(sink, 4096))
+        return ret;
+    for (size_t i = 0; i < input.size(); i += 10000)
+    {
+        size_t size = (input.size() - i < 10000) ? input.size() - i : 10000;
+        if (int ret = (int)coder.write(input.data() + i, size))
+            return ret;
+    }
+    return (int)coder.finish();
+}
+
+template <typename T_COMPRESSOR, typename T_DECOMPRESSOR>
+static int stream_round_trip(std::string& decoded, const std::string& input, int rate)
+{
+    std::string encoded;
+    T_COMPRESSOR compressor(rate);
+    if (int ret = stream_run(compressor, encoded, input))
+        return ret;
+    T_DECOMPRESSOR decompressor;
+    return stream_run(decompressor, decoded, encoded);
+}
+
+#ifdef HAVE_ZLIB
+static int zlib_round_trip(std::string& decoded, const std::string& input, int rate)
+{
+    std::string encoded;
+    if (int ret = zlib_comp(encoded, input.data(), input.size(), rate))
+        return ret;
+    return zlib_decomp(decoded, encoded.data(), encoded.size(), input.size());
+}
+#endif
+
+#ifdef HAVE_BZLIB
+static int bzlib_round_trip(std::string& decoded, const std::string& input, int rate)
+{
+    std::string encoded;
+    if (int ret = bzlib_comp(encoded, input.data(), input.size(), rate))
+        return ret;
+    return bzlib_decomp(decoded, encoded.data(), encoded.size(), input.size());
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int lzma_round_trip(std::string& decoded, const std::string& input, int rate)
+{
+    std::string encoded;
+    if (int ret = lzma_comp(encoded, input.data(), input.size(), rate))
+        return ret;
+    return lzma_decomp(decoded, encoded.data(), encoded.size(), input.size());
+}
+#endif
+
+// auto_comp shares its cache of choices among the threads.
+static int auto_round_trip(std::string& decoded, const std::string& input, int rate)
+{
+    (void)rate;
+    std::string encoded;
+    if (int ret = auto_comp(encoded, input.data(), input.size(), auto_policy(), "stress"))
+        return ret;
+    return auto_decomp(decoded, encoded.data(), encoded.size(), input.size());
+}
+
+struct codec_t
+{
+    const char *name;
+    round_trip_t round_trip;
+};
+
+static const codec_t s_codecs[] =
+{
+#ifdef HAVE_ZLIB
+    { "zlib", zlib_round_trip },
+    { "zlib stream", stream_round_trip<zlib_compressor, zlib_decompressor> },
+#endif
+#ifdef HAVE_BZLIB
+    { "bzlib", bzlib_round_trip },
+    { "bzlib stream", stream_round_trip<bzlib_compressor, bzlib_decompressor> },
+#endif
+#ifdef HAVE_LZMA
+    { "lzma", lzma_round_trip },
+    { "lzma stream", stream_round_trip<lzma_compressor, lzma_decompressor> },
+#endif
+    { "auto", auto_round_trip },
+};
+
+//////////////////////////////////////////////////////////////////////////////
+
+struct stress_t
+{
+    std::vector<std::string> inputs;
+    int rate;
+    unsigned rounds;
+    std::atomic<unsigned> next_id;
+    std::atomic<unsigned> ready;
+    std::atomic<uint64_t> bytes;
+    std::atomic<unsigned> failures;
+};
+
+static void stress_worker(stress_t& stress, unsigned threads)
+{
+    const size_t num_codecs = sizeof(s_codecs) / sizeof(s_codecs[0]);
+    unsigned id = stress.next_id++;
+
+    // start all together
+    ++stress.ready;
+    while (stress.ready < threads)
+        std::this_thread::yield();
+
+    std::string decoded;
+    for (unsigned round = 0; round < stress.rounds; ++round)
+    {
+        for (size_t i = 0; i < stress.inputs.size(); ++i)
+        {
+            const std::string& input = stress.inputs[i];
+            for (size_t k = 0; k < num_codecs; ++k)
+            {
+                const codec_t& codec = s_codecs[(id + k) % num_codecs];
+                int ret = codec.round_trip(decoded, input, stress.rate);
+                if (ret || !(decoded == input))
+                {
+                    printf("%s: %lu bytes failed (%d) on thread %u\n", codec.name,
+                           (unsigned long)input.size(), ret, id);
+                    ++stress.failures;
+                }
+                stress.bytes += input.size();
+            }
+        }
+    }
+}
+
+// "64K" -> 65536
+static size_t parse_size(const std::string& str)
+{
+    char *end;
+    size_t size = (size_t)strtoul(str.c_str(), &end, 10);
+    switch (*end)
+    {
+    case 'K': case 'k': return size << 10;
+    case 'M': case 'm': return size << 20;
+    case 'G': case 'g': return size << 30;
+    }
+    return size;
+}
+
+static std::vector<std::string> split(const char *str)
+{
+    std::vector<std::string> ret;
+    std::string item;
+    for (; *str; ++str)
+    {
+        if (*str == ',')
+        {
+            ret.push_back(item);
+            item.clear();
+        }
+        else
+        {
+            item += *str;
+        }
+    }
+    if (!item.empty())
+        ret.push_back(item);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> threads = split("1,2,4,8,16,32,64");
+    std::vector<std::string> sizes = split("0,1,1K,64K,1M,4M");
+    unsigned rounds = 1;
+    int rate = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "%s: missing value\n", argv[i]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        if (arg == "--threads")
+            threads = split(value);
+        else if (arg == "--sizes")
+            sizes = split(value);
+        else if (arg == "--rounds")
+            rounds = (unsigned)atoi(value);
+        else if (arg == "--rate")
+            rate = atoi(value);
+        else
+        {
+            fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    stress_t stress;
+    stress.rate = rate;
+    stress.rounds = rounds;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        size_t size = parse_size(sizes[i]);
+        stress.inputs.push_back(make_text(size));
+        if (size > 0)
+            stress.inputs.push_back(make_random(size));
+    }
+
+    printf("%u cores, %u codecs, %u inputs, rate %d\n", comp_decomp_threads(0),
+           (unsigned)(sizeof(s_codecs) / sizeof(s_codecs[0])),
+           (unsigned)stress.inputs.size(), rate);
+    printf("threads        MB/s  speedup\n");
+    fflush(stdout);
+
+    double base = 0;
+    bool ok = true;
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        unsigned count = (unsigned)atoi(threads[i].c_str());
+        if (count == 0)
+            continue;
+
+        stress.next_id = 0;
+        stress.ready = 0;
+        stress.bytes = 0;
+        stress.failures = 0;
+
+        my_clock::time_point time1 = my_clock::now();
+        comp_decomp_run_workers(count, [&stress, count]() {
+            stress_worker(stress, count);
+        });
+        double sec = cr::duration<double>(my_clock::now() - time1).count();
+
+        double mb_per_sec = stress.bytes / (sec * 1024 * 1024);
+        if (base == 0)
+            base = mb_per_sec;
+        printf("%7u  %10.1f  %7.2f\n", count, mb_per_sec, mb_per_sec / base);
+        fflush(stdout);
+
+        if (stress.failures)
+        {
+            printf("%u round trips failed on %u threads\n",
+                   (unsigned)stress.failures, count);
+            ok = false;
+        }
+    }
+
+    printf(ok ? "done!\n" : "failed!\n");
+    return ok ? 0 : 1;
+}
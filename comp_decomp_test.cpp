@@ -5,6 +5,7 @@
 #include <chrono>
 #include <ctime>
 #define COMP_DECOMP_BUFFSIZE 100
+#define COMP_DECOMP_MAX_WINDOW 64
 #include "comp_decomp.hpp"
 
 namespace cr = std::chrono;
@@ -117,6 +118,76 @@ int main(void)
     t3.join();
 #endif
 
+    if (file_unittest())
+    {
+        printf("file success\n");
+    }
+    else
+    {
+        printf("file failed\n");
+        g_flag = false;
+    }
+
+    if (auto_unittest())
+    {
+        printf("auto success\n");
+    }
+    else
+    {
+        printf("auto failed\n");
+        g_flag = false;
+    }
+
+    if (batch_unittest())
+    {
+        printf("batch success\n");
+    }
+    else
+    {
+        printf("batch failed\n");
+        g_flag = false;
+    }
+
+    if (pipeline_unittest())
+    {
+        printf("pipeline success\n");
+    }
+    else
+    {
+        printf("pipeline failed\n");
+        g_flag = false;
+    }
+
+    if (verify_unittest())
+    {
+        printf("verify success\n");
+    }
+    else
+    {
+        printf("verify failed\n");
+        g_flag = false;
+    }
+
+    if (probe_unittest())
+    {
+        printf("probe success\n");
+    }
+    else
+    {
+        printf("probe failed\n");
+        g_flag = false;
+    }
+
+    if (step_unittest())
+    {
+        printf("step success\n");
+    }
+    else
+    {
+        printf("step failed\n");
+        g_flag = false;
+    }
+
     fflush(stdout);
 
     if (g_flag)
@@ -0,0 +1,324 @@
+// comp_decomp_verify.hpp
+// Copyright (C) 2019 Katayama Hirofumi MZ <katayama.hirofumi.mz@gmail.com>
+// License: MIT
+#ifndef COMP_DECOMP_VERIFY_HPP_
+#define COMP_DECOMP_VERIFY_HPP_
+
+#include "comp_decomp_file.hpp"
+
+#include <atomic>
+
+// struct comp_decomp_verify_options;
+// struct comp_decomp_verify_result;
+// uint32_t comp_decomp_crc32(uint32_t crc, const void *data, size_t size);
+// int comp_decomp_verify(comp_decomp_codec codec, const void *input, size_t input_size,
+//                        comp_decomp_verify_result& result,
+//                        const comp_decomp_verify_options& options = ...);
+// int verify_file(const char *src, comp_decomp_verify_result& result,
+//                 comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+//                 const comp_decomp_verify_options& options = ...);
+// int verify_files(const std::vector<std::string>& srcs,
+//                  std::vector<comp_decomp_verify_result>& results,
+//                  const comp_decomp_verify_options& options = ...);
+// bool verify_unittest(void);
+
+struct comp_decomp_verify_options
+{
+    bool checksum;      // compute the CRC-32 of the decoded data
+    size_t buffsize;    // the scratch buffer that the decoded data goes through
+    size_t read_size;   // bytes per read from a file
+    unsigned threads;   // files verified at once by verify_files (0 for one per core)
+
+    comp_decomp_verify_options()
+        : checksum(false), buffsize(COMP_DECOMP_BUFFSIZE), read_size(1024 * 1024), threads(0)
+    {
+    }
+};
+
+struct comp_decomp_verify_result
+{
+    int ret;            // 0 if the data decodes to its end, or the error
+    uint64_t size;      // the decoded bytes, up to the error if any
+    uint32_t crc32;     // their CRC-32 if asked for, or 0
+
+    comp_decomp_verify_result() : ret(0), size(0), crc32(0)
+    {
+    }
+};
+
+// Updates the CRC-32 (as of zlib, gzip and xz) crc with size bytes at data.
+// Start with 0. It is the one of zlib or liblzma if either is linked.
+inline uint32_t comp_decomp_crc32(uint32_t crc, const void *data, size_t size)
+{
+#if defined(HAVE_ZLIB)
+    const Bytef *ptr = (const Bytef *)data;
+    while (size > 0)
+    {
+        uInt chunk = (size < 0x40000000) ? (uInt)size : 0x40000000;
+        crc = (uint32_t)crc32(crc, ptr, chunk);
+        ptr += chunk;
+        size -= chunk;
+    }
+    return crc;
+#elif defined(HAVE_LZMA)
+    return lzma_crc32((const uint8_t *)data, size, crc);
+#else
+    struct table_t
+    {
+        uint32_t entries[256];
+        table_t()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t value = i;
+                for (int k = 0; k < 8; ++k)
+                    value = (value >> 1) ^ ((value & 1) ? 0xEDB88320 : 0);
+                entries[i] = value;
+            }
+        }
+    };
+    static const table_t s_table;
+
+    const unsigned char *ptr = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = (crc >> 8) ^ s_table.entries[(crc ^ ptr[i]) & 0xFF];
+    return ~crc;
+#endif
+}
+
+// Feeds a decompressor context with the input in memory or from reader,
+// and keeps only the size and the checksum of what comes out.
+struct comp_decomp_verify_runner
+{
+    const void *input;
+    size_t input_size;
+    comp_decomp_file_reader *reader;
+    const comp_decomp_verify_options& options;
+    comp_decomp_verify_result& result;
+
+    template <typename T_CODER>
+    int operator()(T_CODER& coder)
+    {
+        comp_decomp_sink sink = [this](const void *data, size_t size) {
+            result.size += size;
+            if (options.checksum)
+                result.crc32 = comp_decomp_crc32(result.crc32, data, size);
+            return true;
+        };
+
+        int ret = (int)coder.begin(sink, options.buffsize);
+        if (!ret && !reader)
+            ret = (int)coder.write(input, input_size);
+
+        std::vector<char> buffer(reader ? options.read_size : 0);
+        while (!ret && reader)
+        {
+            size_t got;
+            if (!reader->read(&buffer[0], buffer.size(), got))
+                return COMP_DECOMP_FILE_ERROR;
+            if (got == 0)
+                break;
+            ret = (int)coder.write(&buffer[0], got);
+        }
+        if (!ret)
+            ret = (int)coder.finish();
+        return ret;
+    }
+};
+
+// Decodes the input of codec without keeping the output: it goes through
+// a scratch buffer of options.buffsize bytes, so the memory use does not
+// depend on the decoded size. Returns result.ret.
+inline int comp_decomp_verify(comp_decomp_codec codec, const void *input, size_t input_size,
+                              comp_decomp_verify_result& result,
+                              const comp_decomp_verify_options& options =
+                                  comp_decomp_verify_options())
+{
+    result = comp_decomp_verify_result();
+    comp_decomp_verify_runner runner = { input, input_size, NULL, options, result };
+    result.ret = comp_decomp_with_coder(false, codec, 9, runner);
+    return result.ret;
+}
+
+// The same for the file src, read options.read_size bytes at a time. The
+// codec defaults to the one that the name of src implies.
+inline int verify_file(const char *src, comp_decomp_verify_result& result,
+                       comp_decomp_codec codec = COMP_DECOMP_CODEC_NONE,
+                       const comp_decomp_verify_options& options = comp_decomp_verify_options())
+{
+    result = comp_decomp_verify_result();
+    if (codec == COMP_DECOMP_CODEC_NONE)
+        codec = comp_decomp_codec_from_name(src);
+
+    comp_decomp_file_reader reader;
+    if (!reader.open(src, true))
+    {
+        result.ret = COMP_DECOMP_FILE_ERROR;
+        return result.ret;
+    }
+
+    comp_decomp_verify_runner runner = { NULL, 0, &reader, options, result };
+    result.ret = comp_decomp_with_coder(false, codec, 9, runner);
+    return result.ret;
+}
+
+// Verifies the files srcs on options.threads threads, each file with the
+// codec that its name implies. results[i] is for srcs[i]. Returns 0 if all
+// decode, or else the error of the first one that does not.
+inline int verify_files(const std::vector<std::string>& srcs,
+                        std::vector<comp_decomp_verify_result>& results,
+                        const comp_decomp_verify_options& options = comp_decomp_verify_options())
+{
+    results.assign(srcs.size(), comp_decomp_verify_result());
+
+    unsigned threads = comp_decomp_threads(options.threads);
+    if (threads > srcs.size())
+        threads = (unsigned)srcs.size();
+
+    std::atomic<size_t> next(0);
+    comp_decomp_run_workers(threads, [&]() {
+        for (size_t i = next++; i < srcs.size(); i = next++)
+        {
+            verify_file(srcs[i].c_str(), results[i], COMP_DECOMP_CODEC_NONE, options);
+        }
+    });
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        if (results[i].ret)
+            return results[i].ret;
+    }
+    return 0;
+}
+
+inline bool verify_test_entry(comp_decomp_codec codec, const std::string& original,
+                              const std::string& encoded)
+{
+    comp_decomp_verify_options options;
+    options.checksum = true;
+
+    comp_decomp_verify_result result;
+    if (int ret = comp_decomp_verify(codec, encoded.data(), encoded.size(), result, options))
+    {
+        printf("comp_decomp_verify failed: %s\n", comp_decomp_errmsg(codec, ret));
+        return false;
+    }
+    if (result.size != original.size() ||
+        result.crc32 != comp_decomp_crc32(0, original.data(), original.size()))
+    {
+        printf("comp_decomp_verify got a wrong size or checksum (codec %d)\n", (int)codec);
+        return false;
+    }
+
+    // a truncated stream does not verify
+    if (!original.empty() &&
+        !comp_decomp_verify(codec, encoded.data(), encoded.size() / 2, result, options))
+    {
+        printf("comp_decomp_verify accepted truncated data (codec %d)\n", (int)codec);
+        return false;
+    }
+    return true;
+}
+
+inline bool verify_unittest(void)
+{
+    const char digits[] = "123456789";
+    if (comp_decomp_crc32(0, digits, 9) != 0xCBF43926 ||
+        comp_decomp_crc32(comp_decomp_crc32(0, digits, 4), digits + 4, 5) != 0xCBF43926)
+    {
+        printf("comp_decomp_crc32 failed\n");
+        return false;
+    }
+
+    std::string original;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        original += (char)('a' + std::rand() % 4);
+    }
+
+    std::vector<std::string> names;
+    std::string encoded;
+#ifdef HAVE_ZLIB
+    zlib_comp(encoded, original.data(), original.size());
+    if (!verify_test_entry(COMP_DECOMP_CODEC_ZLIB, original, encoded))
+        return false;
+    names.push_back("comp_decomp_verify_test.zz");
+#endif
+#ifdef HAVE_BZLIB
+    bzlib_comp(encoded, original.data(), original.size());
+    if (!verify_test_entry(COMP_DECOMP_CODEC_BZLIB, original, encoded))
+        return false;
+    names.push_back("comp_decomp_verify_test.bz2");
+#endif
+#ifdef HAVE_LZMA
+    lzma_comp(encoded, original.data(), original.size());
+    if (!verify_test_entry(COMP_DECOMP_CODEC_LZMA, original, encoded))
+        return false;
+    lzma_comp(encoded, "", 0);
+    if (!verify_test_entry(COMP_DECOMP_CODEC_LZMA, std::string(), encoded))
+        return false;
+    lzma_comp(encoded, original.data(), original.size());
+    names.push_back("comp_decomp_verify_test.xz");
+#endif
+
+    // the files of each codec, a corrupt one and a missing one
+    const char *original_name = "comp_decomp_verify_test.dat";
+    FILE *fp = fopen(original_name, "wb");
+    if (!fp)
+        return false;
+    fwrite(original.data(), 1, original.size(), fp);
+    fclose(fp);
+
+    bool ok = true;
+    size_t good = names.size();
+    for (size_t i = 0; i < good; ++i)
+    {
+        ok = ok && !comp_file(original_name, names[i].c_str(), COMP_DECOMP_CODEC_NONE, 6);
+    }
+    if (good > 0)
+    {
+        names.push_back("comp_decomp_verify_test_bad" + names[0].substr(names[0].rfind('.')));
+        if ((fp = fopen(names.back().c_str(), "wb")) != NULL)
+        {
+            fwrite(original.data(), 1, 1000, fp);
+            fclose(fp);
+        }
+        names.push_back("comp_decomp_verify_no_such_file.xz");
+    }
+
+    comp_decomp_verify_options options;
+    options.checksum = true;
+    options.read_size = 4096;
+    options.threads = 4;
+    std::vector<comp_decomp_verify_result> results;
+    int ret = verify_files(names, results, options);
+    if (ok && good > 0 && (ret == 0 || results[good + 1].ret != COMP_DECOMP_FILE_ERROR))
+    {
+        printf("verify_files missed a bad file\n");
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < good; ++i)
+    {
+        if (results[i].ret || results[i].size != original.size() ||
+            results[i].crc32 != comp_decomp_crc32(0, original.data(), original.size()))
+        {
+            printf("verify_files failed on %s\n", names[i].c_str());
+            ok = false;
+        }
+    }
+    if (ok && good > 0 && !results[good].ret)
+    {
+        printf("verify_files accepted a corrupt file\n");
+        ok = false;
+    }
+
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        remove(names[i].c_str());
+    }
+    remove(original_name);
+    return ok;
+}
+
+#endif  // ndef COMP_DECOMP_VERIFY_HPP_
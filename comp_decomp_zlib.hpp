@@ -4,193 +4,1778 @@
 #ifndef COMP_DECOMP_ZLIB_HPP_
 #define COMP_DECOMP_ZLIB_HPP_
 
-#include <cstdlib>
-#include <cstdio>
-#include <cassert>
-#include <cstring>
-#include <string>
-
-#ifndef COMP_DECOMP_BUFFSIZE
-    #define COMP_DECOMP_BUFFSIZE (8 * 1024)
-#endif
+#include "comp_decomp_common.hpp"
+
+// class zlib_compressor;
+// class zlib_decompressor;
+// struct zlib_options;
+// int zlib_comp(T_BUFFER& output, const void *input, size_t input_size, int rate = 9,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, int rate = 9,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+//               const zlib_options& options, comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_comp(void *output, size_t output_size, size_t& written,
+//               const void *input, size_t input_size, const zlib_options& options,
+//               comp_decomp_allocator *allocator = NULL,
+//               const comp_decomp_dict *dict = NULL);
+// int zlib_decomp(T_BUFFER& output, const void *input, size_t input_size,
+//                 size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// int zlib_decomp(void *output, size_t output_size, size_t& written,
+//                 const void *input, size_t input_size,
+//                 comp_decomp_allocator *allocator = NULL,
+//                 const comp_decomp_dict *dict = NULL,
+//                 const comp_decomp_limits *limits = NULL);
+// size_t zlib_comp_bound(size_t input_size);
+// size_t zlib_comp_bound(size_t input_size, const zlib_options& options);
+// size_t zlib_expected_size(const void *input, size_t input_size);
+// int zlib_comp_mt(std::string& output, const void *input, size_t input_size,
+//                  int rate = 9, unsigned threads = 0, size_t block_size = 128 * 1024);
+// int zlib_comp_seekable(std::string& output, const void *input, size_t input_size,
+//                        int rate = 9, size_t block_size = 64 * 1024);
+// int zlib_decomp_range(T_BUFFER& output, const void *input, size_t input_size,
+//                       size_t offset, size_t length);
+// const char *zlib_errmsg(int ret);
+// bool zlib_unittest(void);
+
+#ifdef HAVE_ZLIB
+    #include <zlib.h>
+
+    // The most bytes zlib_comp can write for input_size bytes of input
+    // (compressBound, in size_t).
+    inline size_t zlib_comp_bound(size_t input_size)
+    {
+        return input_size + (input_size >> 12) + (input_size >> 14) +
+               (input_size >> 25) + 13;
+    }
+
+    // Tuning of zlib_compressor beyond the rate (see deflateInit2).
+    // window_bits is 9 to 15 for zlib data, -9 to -15 for raw deflate and
+    // 25 to 31 for gzip. zlib_decompressor tells zlib from gzip data by
+    // itself, but needs set_options() for raw deflate.
+    struct zlib_options
+    {
+        int rate;           // 0 (stored) to 9
+        int strategy;       // Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED
+        int mem_level;      // 1 to 9: the size of the hash and of the block buffer
+        int window_bits;
+
+        explicit zlib_options(int rate_ = 9)
+            : rate(rate_), strategy(Z_DEFAULT_STRATEGY), mem_level(8), window_bits(MAX_WBITS)
+        {
+        }
+
+        // Level 1. Z_RLE and Z_HUFFMAN_ONLY search less, but are slower on
+        // text because they leave more literals to encode.
+        static zlib_options fastest()
+        {
+            return zlib_options(1);
+        }
+
+        // Level 6 in a 4 KB window with a smaller hash: about 32 KB of work
+        // memory to compress and 12 KB to decompress. Smaller settings
+        // flush tiny blocks and get slower as well as worse.
+        static zlib_options low_memory()
+        {
+            zlib_options options(6);
+            options.mem_level = 4;
+            options.window_bits = 12;
+            return options;
+        }
+    };
+
+    // The same for data compressed with options: deflateBound falls back to
+    // a looser bound for a window or a hash of other than the default size,
+    // and the gzip header and trailer are larger.
+    inline size_t zlib_comp_bound(size_t input_size, const zlib_options& options)
+    {
+        int bits = options.window_bits;
+        size_t wrap = 6;
+        if (bits < 0)
+        {
+            bits = -bits;
+            wrap = 0;
+        }
+        else if (bits > MAX_WBITS)
+        {
+            bits -= 16;
+            wrap = 18;
+        }
+        if (bits == MAX_WBITS && options.mem_level == 8)
+            return zlib_comp_bound(input_size) - 6 + wrap;
+        return input_size + ((input_size + 7) >> 3) + ((input_size + 63) >> 6) + 5 + wrap;
+    }
+
+    inline voidpf zlib_allocator_alloc(voidpf opaque, uInt items, uInt size)
+    {
+        return ((comp_decomp_allocator *)opaque)->alloc((size_t)items * size);
+    }
+
+    inline void zlib_allocator_free(voidpf opaque, voidpf ptr)
+    {
+        ((comp_decomp_allocator *)opaque)->free(ptr);
+    }
+
+    // The part of dict that deflate uses: its last 32 KB.
+    inline uInt zlib_dict_tail(const comp_decomp_dict& dict, const Bytef *& data)
+    {
+        data = (const Bytef *)dict.data();
+        size_t size = dict.size();
+        if (size > (1 << MAX_WBITS))
+        {
+            data += size - (1 << MAX_WBITS);
+            size = 1 << MAX_WBITS;
+        }
+        return (uInt)size;
+    }
+
+    // The work memory of inflate besides its window: sizeof(inflate_state),
+    // rounded up.
+    #ifndef COMP_DECOMP_ZLIB_INFLATE_STATE
+        #define COMP_DECOMP_ZLIB_INFLATE_STATE (8 * 1024)
+    #endif
+
+    // The largest window bits (8 to MAX_WBITS) with which inflate fits in
+    // max_memory bytes (0 for no limit), or 0 if none fits.
+    inline int zlib_window_bits(uint64_t max_memory)
+    {
+        if (!max_memory)
+            return MAX_WBITS;
+        for (int bits = MAX_WBITS; bits >= 8; --bits)
+        {
+            if ((uint64_t)((1 << bits) + COMP_DECOMP_ZLIB_INFLATE_STATE) <= max_memory)
+                return bits;
+        }
+        return 0;
+    }
+
+    // The window bits that a zlib header asks for, or 0 for gzip data and
+    // input too short to tell.
+    inline int zlib_header_bits(const void *input, size_t input_size)
+    {
+        const unsigned char *ptr = (const unsigned char *)input;
+        if (input_size < 2 || (ptr[0] & 0x0F) != Z_DEFLATED || ((ptr[0] << 8) | ptr[1]) % 31)
+            return 0;
+        return (ptr[0] >> 4) + 8;
+    }
+
+    // Makes strm take its work memory from allocator, if any.
+    inline void zlib_set_allocator(z_stream& strm, comp_decomp_allocator *allocator)
+    {
+        if (allocator)
+        {
+            strm.zalloc = zlib_allocator_alloc;
+            strm.zfree = zlib_allocator_free;
+            strm.opaque = allocator;
+        }
+    }
+
+    // Owns a z_stream and reuses it across calls with deflateReset.
+    // Use comp() for a whole buffer, or begin()/write()/finish() to stream
+    // the compressed data to a sink in pieces of buffsize bytes.
+    // The work memory comes from allocator, or from malloc if it is NULL.
+    // An object must not be used by two threads at once.
+    class zlib_compressor
+    {
+    public:
+        explicit zlib_compressor(int rate = 9, comp_decomp_allocator *allocator = NULL)
+            : zlib_compressor(zlib_options(rate), allocator)
+        {
+        }
+
+        explicit zlib_compressor(const zlib_options& options,
+                                 comp_decomp_allocator *allocator = NULL)
+            : m_options(options), m_init(false), m_reallocs(0), m_dict(NULL)
+        {
+            assert(0 <= options.rate && options.rate <= 9);
+            memset(&m_strm, 0, sizeof(m_strm));
+            zlib_set_allocator(m_strm, allocator);
+        }
+
+        ~zlib_compressor()
+        {
+            if (m_init)
+                deflateEnd(&m_strm);
+        }
+
+        // The output is reserved once, from deflateBound.
+        template <typename T_BUFFER>
+        int comp(T_BUFFER& output, const void *input, size_t input_size)
+        {
+            output.clear();
+            m_reallocs = 0;
+
+            int ret = reset();
+            if (ret != Z_OK)
+                return ret;
+
+            if ((uLong)input_size == input_size)
+                comp_decomp_reserve(output, deflateBound(&m_strm, (uLong)input_size));
+
+            comp_decomp_output out(output);
+            ret = code(out, input, input_size, Z_FINISH);
+            m_reallocs = out.reallocs();
+            if (ret != Z_STREAM_END)
+            {
+                output.clear();
+                return ret;
+            }
+            out.flush();
+            return Z_OK;
+        }
+
+        // Compresses into the output_size bytes at output. Returns
+        // COMP_DECOMP_SPACE_ERROR if they are not enough, which never
+        // happens with zlib_comp_bound(input_size, options) bytes.
+        int comp(void *output, size_t output_size, size_t& written,
+                 const void *input, size_t input_size)
+        {
+            written = 0;
+            m_reallocs = 0;
+
+            int ret = reset();
+            if (ret != Z_OK)
+                return ret;
+
+            comp_decomp_output out(output, output_size);
+            ret = code(out, input, input_size, Z_FINISH);
+            if (ret != Z_STREAM_END)
+                return ret;
+            if (!out.flush())
+                return out.error();
+            written = out.used();
+            return Z_OK;
+        }
+
+        int begin(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+        {
+            m_out.reset(sink, buffsize);
+            return reset();
+        }
+
+        int write(const void *input, size_t input_size)
+        {
+            return code(m_out, input, input_size, Z_NO_FLUSH);
+        }
+
+        // Compresses the following data against dict (NULL for none), which
+        // must outlive its use. The decompressor needs the same dictionary.
+        void set_dict(const comp_decomp_dict *dict)
+        {
+            m_dict = dict;
+        }
+
+        int finish()
+        {
+            int ret = code(m_out, NULL, 0, Z_FINISH);
+            if (ret != Z_STREAM_END)
+                return ret;
+            return m_out.flush() ? Z_OK : COMP_DECOMP_SINK_ERROR;
+        }
+
+        // How many times the output of the last comp() was reallocated.
+        size_t reallocs() const
+        {
+            return m_reallocs;
+        }
+
+    protected:
+        z_stream m_strm;
+        zlib_options m_options;
+        bool m_init;
+        size_t m_reallocs;
+        const comp_decomp_dict *m_dict;
+        comp_decomp_output m_out;
+
+        int reset()
+        {
+            int ret;
+            if (m_init)
+            {
+                ret = deflateReset(&m_strm);
+            }
+            else
+            {
+                ret = deflateInit2(&m_strm, m_options.rate, Z_DEFLATED, m_options.window_bits,
+                                   m_options.mem_level, m_options.strategy);
+                m_init = (ret == Z_OK);
+            }
+            if (ret != Z_OK || !m_dict || m_dict->empty())
+                return ret;
+
+            const Bytef *data;
+            uInt size = zlib_dict_tail(*m_dict, data);
+            return deflateSetDictionary(&m_strm, data, size);
+        }
+
+        // Deflates the input into out. Returns Z_OK once all the input is
+        // taken, or Z_STREAM_END once Z_FINISH is done.
+        int code(comp_decomp_output& out, const void *input, size_t input_size, int flush)
+        {
+            const Bytef *ptr = (const Bytef *)input;
+            size_t remainder = input_size;
+            m_strm.avail_in = 0;
+
+            for (;;)
+            {
+                if (m_strm.avail_in == 0)
+                {
+                    if (remainder == 0 && flush == Z_NO_FLUSH)
+                        return Z_OK;
+
+                    m_strm.next_in = (Bytef *)ptr;
+                    if (remainder < COMP_DECOMP_MAX_WINDOW)
+                        m_strm.avail_in = (uInt)remainder;
+                    else
+                        m_strm.avail_in = COMP_DECOMP_MAX_WINDOW;
+                    ptr += m_strm.avail_in;
+                    remainder -= m_strm.avail_in;
+                }
+
+                char *next_out;
+                size_t avail;
+                if (!out.space(next_out, avail))
+                    return out.error();
+                if (avail > COMP_DECOMP_MAX_WINDOW)
+                    avail = COMP_DECOMP_MAX_WINDOW;
+                m_strm.next_out = (Bytef *)next_out;
+                m_strm.avail_out = (uInt)avail;
+
+                int ret = deflate(&m_strm, (remainder == 0) ? flush : Z_NO_FLUSH);
+
+                out.commit(avail - m_strm.avail_out);
+                if (ret != Z_OK)
+                    return ret;
+            }
+        }
+
+    private:
+        zlib_compressor(const zlib_compressor&) = delete;
+        zlib_compressor& operator=(const zlib_compressor&) = delete;
+    };
+
+    // Returns the decompressed size that the ISIZE trailer of gzip data
+    // tells, or 0 for zlib data and sizes deflate cannot reach (1032:1).
+    // ISIZE is modulo 4 GiB, so use it as a hint only.
+    inline size_t zlib_expected_size(const void *input, size_t input_size)
+    {
+        const unsigned char *ptr = (const unsigned char *)input;
+        if (input_size < 18 || ptr[0] != 0x1F || ptr[1] != 0x8B || ptr[2] != 8)
+            return 0;
+
+        ptr += input_size - 4;
+        size_t size = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((size_t)ptr[3] << 24);
+        if (size / 1032 > input_size)
+            return 0;
+        return size;
+    }
+
+    // Owns a z_stream and reuses it across calls with inflateReset.
+    // Reads zlib or gzip data (detected from the header). See zlib_compressor
+    // for allocator.
+    // Use decomp() for a whole buffer, or begin()/write()/finish() to stream
+    // the decompressed data to a sink in pieces of buffsize bytes.
+    // An object must not be used by two threads at once.
+    class zlib_decompressor
+    {
+    public:
+        explicit zlib_decompressor(comp_decomp_allocator *allocator = NULL)
+            : m_init(false), m_end(false), m_bits(MAX_WBITS), m_window_bits(MAX_WBITS),
+              m_header_size(0), m_reallocs(0), m_dict(NULL)
+        {
+            memset(&m_strm, 0, sizeof(m_strm));
+            zlib_set_allocator(m_strm, allocator);
+        }
+
+        ~zlib_decompressor()
+        {
+            if (m_init)
+                inflateEnd(&m_strm);
+        }
+
+        // size_hint is the expected decompressed size, if known. Without
+        // it, the gzip ISIZE is used up to comp_decomp_data_hint, or else a
+        // guess.
+        template <typename T_BUFFER>
+        int decomp(T_BUFFER& output, const void *input, size_t input_size,
+                   size_t size_hint = 0)
+        {
+            output.clear();
+            m_reallocs = 0;
+            if (size_hint == 0)
+                size_hint = comp_decomp_data_hint(zlib_expected_size(input, input_size),
+                                                  input_size);
+            if (m_limits.max_output && size_hint > m_limits.max_output)
+                size_hint = m_limits.max_output;
+            if (size_hint)
+                comp_decomp_reserve(output, size_hint);
+            else
+                output.reserve(input_size * 3 / 2);
+
+            int ret = reset();
+            if (ret != Z_OK)
+                return ret;
+
+            comp_decomp_output out(output);
+            out.limit(m_limits.max_output);
+            ret = code(out, input, input_size);
+            m_reallocs = out.reallocs();
+            if (ret != Z_STREAM_END)
+            {
+                output.clear();
+                return (ret == Z_OK) ? Z_BUF_ERROR : ret;
+            }
+            if (!out.flush())
+            {
+                output.clear();
+                return out.error();
+            }
+            return Z_OK;
+        }
+
+        // Decompresses into the output_size bytes at output. Returns
+        // COMP_DECOMP_SPACE_ERROR if they are not enough.
+        int decomp(void *output, size_t output_size, size_t& written,
+                   const void *input, size_t input_size)
+        {
+            written = 0;
+            m_reallocs = 0;
+
+            int ret = reset();
+            if (ret != Z_OK)
+                return ret;
+
+            comp_decomp_output out(output, output_size);
+            out.limit(m_limits.max_output);
+            ret = code(out, input, input_size);
+            if (ret != Z_STREAM_END)
+                return (ret == Z_OK) ? Z_BUF_ERROR : ret;
+            if (!out.flush())
+                return out.error();
+            written = out.used();
+            return Z_OK;
+        }
+
+        int begin(const comp_decomp_sink& sink, size_t buffsize = COMP_DECOMP_BUFFSIZE)
+        {
+            m_out.reset(sink, buffsize);
+            m_out.limit(m_limits.max_output);
+            return reset();
+        }
+
+        // Data after the end of the zlib stream is ignored.
+        int write(const void *input, size_t input_size)
+        {
+            if (m_end)
+                return Z_OK;
+            int ret = code(m_out, input, input_size);
+            return (ret == Z_STREAM_END) ? Z_OK : ret;
+        }
+
+        // The dictionary given when the data asks for one (Z_NEED_DICT
+        // without it). It must outlive its use.
+        void set_dict(const comp_decomp_dict *dict)
+        {
+            m_dict = dict;
+        }
+
+        // Caps the following decompressions. max_memory shrinks the window,
+        // so zlib data with a larger one fails with COMP_DECOMP_MEMORY_ERROR
+        // and gzip data that reaches further back with Z_DATA_ERROR.
+        void set_limits(const comp_decomp_limits& limits)
+        {
+            m_limits = limits;
+        }
+
+        // Reads raw deflate if options.window_bits is negative, in a window
+        // of that size. The rest of options is for the compressor only.
+        void set_options(const zlib_options& options)
+        {
+            m_window_bits = options.window_bits;
+        }
+
+        int finish()
+        {
+            if (!m_end)
+                return Z_BUF_ERROR;
+            return m_out.flush() ? Z_OK : COMP_DECOMP_SINK_ERROR;
+        }
+
+        // How many times the output of the last decomp() was reallocated.
+        size_t reallocs() const
+        {
+            return m_reallocs;
+        }
+
+    protected:
+        z_stream m_strm;
+        bool m_init;
+        bool m_end;
+        int m_bits;
+        int m_window_bits;
+        unsigned char m_header[2];  // the first byte of a zlib header, until the second
+        size_t m_header_size;
+        size_t m_reallocs;
+        const comp_decomp_dict *m_dict;
+        comp_decomp_limits m_limits;
+        comp_decomp_output m_out;
+
+        int reset()
+        {
+            m_end = false;
+            m_header_size = 0;
+            m_strm.next_in = Z_NULL;
+            m_strm.avail_in = 0;
+            m_bits = zlib_window_bits(m_limits.max_memory);
+            if (!m_bits)
+                return COMP_DECOMP_MEMORY_ERROR;
+
+            int bits = m_bits + 32;     // zlib or gzip
+            if (m_window_bits < 0)
+            {
+                if (m_bits < -m_window_bits)
+                    return COMP_DECOMP_MEMORY_ERROR;
+                m_bits = -m_window_bits;
+                bits = m_window_bits;
+            }
+            if (m_init)
+                return inflateReset2(&m_strm, bits);
+
+            int ret = inflateInit2(&m_strm, bits);
+            m_init = (ret == Z_OK);
+            return ret;
+        }
+
+        // Inflates the input into out. Returns Z_OK when more input is
+        // needed, or Z_STREAM_END at the end of the zlib stream.
+        int code(comp_decomp_output& out, const void *input, size_t input_size)
+        {
+            if (m_strm.total_in > 0 || m_window_bits < 0 || m_bits == MAX_WBITS)
+                return code_window(out, input, input_size);
+
+            // check the window of a zlib header against the limits, also
+            // when its two bytes come in separate writes
+            unsigned char header[2];
+            size_t take = 2 - m_header_size;
+            if (take > input_size)
+                take = input_size;
+            memcpy(header, m_header, m_header_size);
+            memcpy(header + m_header_size, input, take);
+            if (m_header_size + take < 2)
+            {
+                memcpy(m_header, header, m_header_size + take);
+                m_header_size += take;
+                return Z_OK;
+            }
+            if (zlib_header_bits(header, 2) > m_bits)
+                return COMP_DECOMP_MEMORY_ERROR;
+            if (m_header_size)
+            {
+                m_header_size = 0;
+                int ret = code_window(out, header, 2);
+                if (ret != Z_OK || take == input_size)
+                    return ret;
+                input = (const Bytef *)input + take;
+                input_size -= take;
+            }
+            return code_window(out, input, input_size);
+        }
+
+        int code_window(comp_decomp_output& out, const void *input, size_t input_size)
+        {
+            const Bytef *ptr = (const Bytef *)input;
+            size_t remainder = input_size;
+            m_strm.avail_in = 0;
+
+            for (;;)
+            {
+                if (m_strm.avail_in == 0 && remainder > 0)
+                {
+                    m_strm.next_in = (Bytef *)ptr;
+                    if (remainder < COMP_DECOMP_MAX_WINDOW)
+                        m_strm.avail_in = (uInt)remainder;
+                    else
+                        m_strm.avail_in = COMP_DECOMP_MAX_WINDOW;
+                    ptr += m_strm.avail_in;
+                    remainder -= m_strm.avail_in;
+                }
+
+                char *next_out;
+                size_t avail;
+                if (!out.space(next_out, avail))
+                    return out.error();
+                if (avail > COMP_DECOMP_MAX_WINDOW)
+                    avail = COMP_DECOMP_MAX_WINDOW;
+                m_strm.next_out = (Bytef *)next_out;
+                m_strm.avail_out = (uInt)avail;
+
+                int ret = inflate(&m_strm, Z_NO_FLUSH);
+                if (ret == Z_NEED_DICT && m_dict)
+                {
+                    const Bytef *data;
+                    uInt size = zlib_dict_tail(*m_dict, data);
+                    ret = inflateSetDictionary(&m_strm, data, size);
+                }
+
+                out.commit(avail - m_strm.avail_out);
+                if (ret == Z_STREAM_END)
+                {
+                    m_end = true;
+                    return ret;
+                }
+                if (m_strm.avail_in == 0 && remainder == 0 &&
+                    (ret == Z_BUF_ERROR || (ret == Z_OK && m_strm.avail_out > 0)))
+                {
+                    return Z_OK;
+                }
+                if (ret != Z_OK)
+                    return ret;
+            }
+        }
+
+    private:
+        zlib_decompressor(const zlib_decompressor&) = delete;
+        zlib_decompressor& operator=(const zlib_decompressor&) = delete;
+    };
+
+    // Pass comp_decomp_thread_pool() or an allocator of your own as
+    // allocator to recycle the work memory between calls, and a preset
+    // dictionary as dict for small messages (see comp_decomp_train_dict).
+    // Input that looks incompressible is stored with rate 0, in deflate
+    // blocks that any inflate reads.
+    template <typename T_BUFFER>
+    inline int zlib_comp(T_BUFFER& output, const void *input, size_t input_size,
+                         const zlib_options& options, comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_ZLIB, true, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        zlib_options stored = options;
+        if (comp_decomp_incompressible(input, input_size))
+            stored.rate = 0;
+        zlib_compressor compressor(stored, allocator);
+        compressor.set_dict(dict);
+        int ret = compressor.comp(output, input, input_size);
+        return COMP_DECOMP_STATS_RESULT(ret, output.size());
+    }
+
+    inline int zlib_comp(void *output, size_t output_size, size_t& written,
+                         const void *input, size_t input_size, const zlib_options& options,
+                         comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_ZLIB, true, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        zlib_options stored = options;
+        if (comp_decomp_incompressible(input, input_size))
+            stored.rate = 0;
+        zlib_compressor compressor(stored, allocator);
+        compressor.set_dict(dict);
+        int ret = compressor.comp(output, output_size, written, input, input_size);
+        return COMP_DECOMP_STATS_RESULT(ret, written);
+    }
+
+    template <typename T_BUFFER>
+    inline int zlib_comp(T_BUFFER& output, const void *input, size_t input_size, int rate = 9,
+                         comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        return zlib_comp(output, input, input_size, zlib_options(rate), allocator, dict);
+    }
+
+    inline int zlib_comp(void *output, size_t output_size, size_t& written,
+                         const void *input, size_t input_size, int rate = 9,
+                         comp_decomp_allocator *allocator = NULL,
+                         const comp_decomp_dict *dict = NULL)
+    {
+        return zlib_comp(output, output_size, written, input, input_size, zlib_options(rate),
+                         allocator, dict);
+    }
+
+    // limits, if not NULL, caps the output and the work memory for data
+    // from untrusted sources.
+    template <typename T_BUFFER>
+    inline int zlib_decomp(T_BUFFER& output, const void *input, size_t input_size,
+                           size_t size_hint = 0, comp_decomp_allocator *allocator = NULL,
+                           const comp_decomp_dict *dict = NULL,
+                           const comp_decomp_limits *limits = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_ZLIB, false, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        zlib_decompressor decompressor(allocator);
+        decompressor.set_dict(dict);
+        if (limits)
+            decompressor.set_limits(*limits);
+        int ret = decompressor.decomp(output, input, input_size, size_hint);
+        return COMP_DECOMP_STATS_RESULT(ret, output.size());
+    }
+
+    inline int zlib_decomp(void *output, size_t output_size, size_t& written,
+                           const void *input, size_t input_size,
+                           comp_decomp_allocator *allocator = NULL,
+                           const comp_decomp_dict *dict = NULL,
+                           const comp_decomp_limits *limits = NULL)
+    {
+        COMP_DECOMP_STATS_SCOPE(COMP_DECOMP_CODEC_ZLIB, false, input_size);
+        COMP_DECOMP_STATS_WATCH(allocator);
+        zlib_decompressor decompressor(allocator);
+        decompressor.set_dict(dict);
+        if (limits)
+            decompressor.set_limits(*limits);
+        int ret = decompressor.decomp(output, output_size, written, input, input_size);
+        return COMP_DECOMP_STATS_RESULT(ret, written);
+    }
+
+    // Compresses blocks of block_size bytes on threads threads (pigz style).
+    // Each block is raw-deflated with the previous 32 KB as its dictionary
+    // and ends with a sync flush, so that the joined blocks make a single
+    // zlib stream that zlib_decomp can read.
+    inline int zlib_comp_mt(std::string& output, const void *input, size_t input_size,
+                            int rate = 9, unsigned threads = 0,
+                            size_t block_size = 128 * 1024)
+    {
+        const size_t dict_size = 32 * 1024;
+        const Bytef *ptr = (const Bytef *)input;
+        assert(1 <= rate && rate <= 9);
+        assert(0 < block_size && block_size <= UINT_MAX);
+
+        output.clear();
+
+        size_t count = (input_size + block_size - 1) / block_size;
+        if (count == 0)
+            count = 1;
+        threads = comp_decomp_threads(threads);
+        if (threads > count)
+            threads = (unsigned)count;
+
+        std::vector<std::string> blocks(count);
+        std::vector<uLong> checks(count);
+        std::atomic<size_t> next(0);
+        std::atomic<int> error(Z_OK);
+
+        comp_decomp_run_workers(threads, [&]() {
+            z_stream strm;
+            memset(&strm, 0, sizeof(strm));
+            int ret = deflateInit2(&strm, rate, Z_DEFLATED, -MAX_WBITS, 8,
+                                   Z_DEFAULT_STRATEGY);
+            if (ret != Z_OK)
+            {
+                error = ret;
+                return;
+            }
+
+            for (size_t i = next++; i < count && error == Z_OK; i = next++)
+            {
+                size_t offset = i * block_size;
+                size_t size = input_size - offset;
+                if (size > block_size)
+                    size = block_size;
+                bool last = (i + 1 == count);
+
+                deflateReset(&strm);
+                if (offset > 0)
+                {
+                    size_t dict = (offset < dict_size) ? offset : dict_size;
+                    deflateSetDictionary(&strm, ptr + offset - dict, (uInt)dict);
+                }
+                checks[i] = adler32(adler32(0, NULL, 0), ptr + offset, (uInt)size);
+
+                std::string& block = blocks[i];
+                block.reserve(deflateBound(&strm, (uLong)size) + 8);
+                strm.next_in = (Bytef *)ptr + offset;
+                strm.avail_in = (uInt)size;
+
+                size_t used = 0;
+                ret = Z_OK;
+                do
+                {
+                    size_t avail = comp_decomp_grow(block, used);
+                    if (avail > COMP_DECOMP_MAX_WINDOW)
+                        avail = COMP_DECOMP_MAX_WINDOW;
+                    strm.next_out = (Bytef *)&block[used];
+                    strm.avail_out = (uInt)avail;
+
+                    ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+
+                    used += avail - strm.avail_out;
+                } while (ret == Z_OK && (last || strm.avail_out == 0));
+                block.resize(used);
+
+                if (last ? (ret != Z_STREAM_END) : (ret != Z_OK))
+                    error = ret;
+            }
+
+            deflateEnd(&strm);
+        });
+
+        if (error != Z_OK)
+            return error;
+
+        size_t total = 2 + 4;
+        for (size_t i = 0; i < count; ++i)
+        {
+            total += blocks[i].size();
+        }
+        output.reserve(total);
+
+        int level = (rate == 1) ? 0 : (rate <= 5) ? 1 : (rate == 6) ? 2 : 3;
+        unsigned header = (0x78 << 8) | (level << 6);
+        header += 31 - header % 31;
+        output += (char)(header >> 8);
+        output += (char)(header & 0xFF);
+
+        uLong check = adler32(0, NULL, 0);
+        for (size_t i = 0; i < count; ++i)
+        {
+            COMP_DECOMP_COPIED(blocks[i].size());
+            output += blocks[i];
+            std::string().swap(blocks[i]);
+
+            size_t size = input_size - i * block_size;
+            if (size > block_size)
+                size = block_size;
+            check = adler32_combine(check, checks[i], (z_off_t)size);
+        }
+
+        output += (char)((check >> 24) & 0xFF);
+        output += (char)((check >> 16) & 0xFF);
+        output += (char)((check >> 8) & 0xFF);
+        output += (char)(check & 0xFF);
+        return Z_OK;
+    }
+
+    // Compresses blocks of block_size bytes that can be inflated on their
+    // own: each ends with a full flush, which empties the window. The output
+    // is one zlib stream that zlib_decomp reads, followed by an index for
+    // zlib_decomp_range: the compressed offsets of the blocks and of the end
+    // of the last one, the block size, the input size and the block count,
+    // each 64-bit little endian, and the magic "CDSK".
+    inline int zlib_comp_seekable(std::string& output, const void *input, size_t input_size,
+                                  int rate = 9, size_t block_size = 64 * 1024)
+    {
+        const Bytef *ptr = (const Bytef *)input;
+        assert(1 <= rate && rate <= 9);
+        assert(0 < block_size && block_size <= UINT_MAX);
+
+        output.clear();
+
+        // a full flush adds an empty stored block of 5 bytes
+        size_t count = (input_size + block_size - 1) / block_size;
+        comp_decomp_reserve(output, zlib_comp_bound(input_size) + count * 5 +
+                                    (count + 4) * 8 + 4);
+
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        int ret = deflateInit(&strm, rate);
+        if (ret != Z_OK)
+            return ret;
+
+        std::vector<uint64_t> offsets;
+        size_t used = 0;
+        for (size_t i = 0; ret == Z_OK && (i < count || i == 0); ++i)
+        {
+            size_t offset = i * block_size;
+            size_t size = (input_size - offset < block_size) ? input_size - offset : block_size;
+            int flush = (i + 1 >= count) ? Z_FINISH : Z_FULL_FLUSH;
+
+            // the first block starts after the 2-byte zlib header
+            if (i < count)
+                offsets.push_back((i == 0) ? 2 : used);
+            strm.next_in = (Bytef *)ptr + offset;
+            strm.avail_in = (uInt)size;
+            for (;;)
+            {
+                size_t avail = comp_decomp_grow(output, used);
+                if (avail > COMP_DECOMP_MAX_WINDOW)
+                    avail = COMP_DECOMP_MAX_WINDOW;
+                strm.next_out = (Bytef *)&output[used];
+                strm.avail_out = (uInt)avail;
+
+                ret = deflate(&strm, flush);
+
+                used += avail - strm.avail_out;
+                // Z_BUF_ERROR: the last call had done the flush exactly
+                if (ret == Z_BUF_ERROR && flush == Z_FULL_FLUSH && strm.avail_in == 0)
+                    ret = Z_OK;
+                if (ret != Z_OK || (strm.avail_in == 0 && strm.avail_out != 0))
+                    break;
+            }
+        }
+        deflateEnd(&strm);
+        if (ret != Z_STREAM_END)
+        {
+            output.clear();
+            return (ret == Z_OK) ? Z_STREAM_ERROR : ret;
+        }
+
+        // the end of the deflate data, before the Adler-32
+        offsets.push_back(used - 4);
+        output.resize(used);
+        for (size_t i = 0; i < offsets.size(); ++i)
+        {
+            comp_decomp_put_le64(output, offsets[i]);
+        }
+        comp_decomp_put_le64(output, block_size);
+        comp_decomp_put_le64(output, input_size);
+        comp_decomp_put_le64(output, count);
+        output += "CDSK";
+        return Z_OK;
+    }
+
+    // Finds the index of zlib_comp_seekable at the end of input. table gets
+    // the count + 1 block offsets.
+    inline bool zlib_find_seek_index(const void *input, size_t input_size,
+                                     size_t& block_size, size_t& total, size_t& count,
+                                     const unsigned char *& table)
+    {
+        const unsigned char *ptr = (const unsigned char *)input;
+        if (input_size < 2 + 4 + 8 + 24 + 4 || memcmp(ptr + input_size - 4, "CDSK", 4) != 0)
+            return false;
+
+        const unsigned char *tail = ptr + input_size - 4 - 24;
+        uint64_t size = comp_decomp_get_le64(tail);
+        uint64_t length = comp_decomp_get_le64(tail + 8);
+        uint64_t blocks = comp_decomp_get_le64(tail + 16);
+        // no more than deflate reaches (1032:1), so that a forged index
+        // cannot make zlib_decomp_range allocate too much
+        if (size == 0 || size > UINT_MAX || blocks >= input_size / 8 ||
+            length / 1032 > input_size ||
+            blocks != (length == 0 ? 0 : (length - 1) / size + 1))
+        {
+            return false;
+        }
+
+        table = tail - (blocks + 1) * 8;
+        if (table < ptr + 2)
+            return false;
+        for (uint64_t i = 0; i <= blocks; ++i)
+        {
+            uint64_t offset = comp_decomp_get_le64(table + i * 8);
+            if (offset > (uint64_t)(table - ptr) ||
+                (i > 0 && offset < comp_decomp_get_le64(table + (i - 1) * 8)))
+            {
+                return false;
+            }
+        }
+
+        block_size = (size_t)size;
+        total = (size_t)length;
+        count = (size_t)blocks;
+        return true;
+    }
+
+    // Decompresses the length bytes at offset of the data. With the index of
+    // zlib_comp_seekable only the blocks of the range are inflated; other
+    // zlib data is inflated from the start. The range is cut at the end of
+    // the data.
+    template <typename T_BUFFER>
+    inline int zlib_decomp_range(T_BUFFER& output, const void *input, size_t input_size,
+                                 size_t offset, size_t length)
+    {
+        output.clear();
+
+        size_t block_size, total, count;
+        const unsigned char *table;
+        if (!zlib_find_seek_index(input, input_size, block_size, total, count, table))
+        {
+            T_BUFFER whole;
+            int ret = zlib_decomp(whole, input, input_size);
+            if (ret != Z_OK)
+                return ret;
+            if (offset < whole.size())
+            {
+                if (length > whole.size() - offset)
+                    length = whole.size() - offset;
+                output.assign(whole.begin() + offset, whole.begin() + offset + length);
+            }
+            return Z_OK;
+        }
+
+        if (offset >= total)
+            return Z_OK;
+        if (length > total - offset)
+            length = total - offset;
+        if (length == 0)
+            return Z_OK;
+
+        size_t first = offset / block_size;
+        size_t last = (offset + length - 1) / block_size;
+        if (last >= count)
+            return Z_DATA_ERROR;
+        const Bytef *ptr = (const Bytef *)input;
+        size_t in_pos = (size_t)comp_decomp_get_le64(table + first * 8);
+        size_t in_end = (size_t)comp_decomp_get_le64(table + (last + 1) * 8);
+        size_t start = first * block_size;
+        size_t end = (last + 1) * block_size;
+        if (end > total)
+            end = total;
+
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        int ret = inflateInit2(&strm, -MAX_WBITS);
+        if (ret != Z_OK)
+            return ret;
+
+        std::string blocks(end - start, 0);
+        size_t out_pos = 0;
+        do
+        {
+            size_t avail_in = in_end - in_pos;
+            if (avail_in > COMP_DECOMP_MAX_WINDOW)
+                avail_in = COMP_DECOMP_MAX_WINDOW;
+            size_t avail_out = blocks.size() - out_pos;
+            if (avail_out > COMP_DECOMP_MAX_WINDOW)
+                avail_out = COMP_DECOMP_MAX_WINDOW;
+            strm.next_in = (Bytef *)ptr + in_pos;
+            strm.avail_in = (uInt)avail_in;
+            strm.next_out = (Bytef *)&blocks[out_pos];
+            strm.avail_out = (uInt)avail_out;
+
+            ret = inflate(&strm, Z_NO_FLUSH);
+
+            in_pos += avail_in - strm.avail_in;
+            out_pos += avail_out - strm.avail_out;
+        } while (ret == Z_OK && out_pos < blocks.size());
+        inflateEnd(&strm);
+
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return ret;
+        if (out_pos != blocks.size())
+            return Z_DATA_ERROR;
+
+        size_t skip = offset - start;
+        output.assign(blocks.begin() + skip, blocks.begin() + skip + length);
+        return Z_OK;
+    }
+
+    inline const char *zlib_errmsg(int ret)
+    {
+        switch (ret)
+        {
+        case Z_OK: return "success (Z_OK)";
+        case Z_NEED_DICT: return "preset dictionary needed (Z_NEED_DICT)";
+        case Z_ERRNO:
+            if (ferror(stdin))
+                return "error reading stdin (Z_ERRNO)";
+            if (ferror(stdout))
+                return "error writing stdout (Z_ERRNO)";
+            return "error writing file (Z_ERRNO)";
+        case Z_STREAM_ERROR: return "invalid compression level (Z_STREAM_ERROR)";
+        case Z_DATA_ERROR: return "invalid or incomplete deflate data (Z_DATA_ERROR)";
+        case Z_MEM_ERROR: return "out of memory (Z_MEM_ERROR)";
+        case Z_BUF_ERROR: return "truncated input or no progress (Z_BUF_ERROR)";
+        case Z_VERSION_ERROR: return "zlib version mismatch! (Z_VERSION_ERROR)";
+        case COMP_DECOMP_SINK_ERROR: return "sink error (COMP_DECOMP_SINK_ERROR)";
+        case COMP_DECOMP_SPACE_ERROR: return "output buffer too small (COMP_DECOMP_SPACE_ERROR)";
+        case COMP_DECOMP_LIMIT_ERROR: return "output over the limit (COMP_DECOMP_LIMIT_ERROR)";
+        case COMP_DECOMP_MEMORY_ERROR: return "memory over the limit (COMP_DECOMP_MEMORY_ERROR)";
+        case COMP_DECOMP_CANCEL_ERROR: return "cancelled (COMP_DECOMP_CANCEL_ERROR)";
+        }
+        return "unknown error";
+    }
+
+    inline bool zlib_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = zlib_comp(encoded, original.c_str(), original.size()))
+        {
+            printf("zlib_comp failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = zlib_decomp(decoded, encoded.c_str(), encoded.size()))
+        {
+            printf("zlib_decomp failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("zlib mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool zlib_test_entry(zlib_compressor& compressor,
+                                zlib_decompressor& decompressor,
+                                const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = compressor.comp(encoded, original.c_str(), original.size()))
+        {
+            printf("zlib_compressor failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = decompressor.decomp(decoded, encoded.c_str(), encoded.size(),
+                                          original.size()))
+        {
+            printf("zlib_decompressor failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("zlib mismatch\n");
+            return false;
+        }
+        if (compressor.reallocs() || decompressor.reallocs())
+        {
+            printf("zlib reallocated\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool zlib_allocator_test_entry(comp_decomp_pool& pool, const std::string& original)
+    {
+        std::string encoded, decoded;
+        size_t allocs = pool.allocs();
+        if (int ret = zlib_comp(encoded, original.data(), original.size(), 9, &pool))
+        {
+            printf("zlib_comp with a pool failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size(), 0, &pool))
+        {
+            printf("zlib_decomp with a pool failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded) || pool.allocs() == allocs)
+        {
+            printf("zlib pool mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    // A forged ISIZE reserves no more than comp_decomp_data_hint allows.
+    inline bool zlib_hint_test_entry(void)
+    {
+        std::string original(128 * 1024, 0), encoded, decoded;
+        for (size_t i = 0; i < original.size(); ++i)
+        {
+            original[i] = (char)(std::rand() & 0xFF);
+        }
+        zlib_options options(1);
+        options.window_bits = MAX_WBITS + 16;
+        if (zlib_comp(encoded, original.data(), original.size(), options))
+            return false;
+
+        const uint32_t forged = 100 * 1024 * 1024;
+        for (int i = 0; i < 4; ++i)
+        {
+            encoded[encoded.size() - 4 + i] = (char)(forged >> (8 * i));
+        }
+        if (zlib_expected_size(encoded.data(), encoded.size()) != forged)
+            return false;
+        int ret = zlib_decomp(decoded, encoded.data(), encoded.size());
+        if (ret != Z_DATA_ERROR || decoded.capacity() > COMP_DECOMP_HINT_MIN + 1)
+        {
+            printf("zlib reserved a forged ISIZE: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        return true;
+    }
+
+    inline bool zlib_gzip_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        encoded.resize(original.size() + 100);
+
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, 9, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        strm.next_in = (Bytef *)original.data();
+        strm.avail_in = (uInt)original.size();
+        strm.next_out = (Bytef *)&encoded[0];
+        strm.avail_out = (uInt)encoded.size();
+        int ret = deflate(&strm, Z_FINISH);
+        encoded.resize(strm.total_out);
+        deflateEnd(&strm);
+        if (ret != Z_STREAM_END)
+            return false;
+
+        zlib_decompressor decompressor;
+        if (zlib_expected_size(encoded.data(), encoded.size()) != original.size())
+        {
+            printf("zlib_expected_size failed\n");
+            return false;
+        }
+        if (int ret = decompressor.decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("zlib_decompressor failed on gzip: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded) || decompressor.reallocs())
+        {
+            printf("zlib gzip mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool zlib_dict_test_entry(const comp_decomp_dict& dict, const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = zlib_comp(encoded, original.data(), original.size(), 9, NULL, &dict))
+        {
+            printf("zlib_comp with a dictionary failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, &dict))
+        {
+            printf("zlib_decomp with a dictionary failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("zlib dictionary mismatch\n");
+            return false;
+        }
+        if (!dict.empty())
+        {
+            std::string wrong;
+            int ret = zlib_decomp(wrong, encoded.data(), encoded.size());
+            if (ret != Z_NEED_DICT)
+            {
+                printf("zlib_decomp without the dictionary: %s\n", zlib_errmsg(ret));
+                return false;
+            }
+        }
+        return true;
+    }
 
-// int zlib_comp(std::string& output, const void *input, uInt input_size, int rate = 9);
-// int zlib_decomp(std::string& output, const void *input, uInt input_size);
-// const char *zlib_errmsg(int ret);
-// bool zlib_unittest(void);
+    // Messages that share most of their text compress better with a
+    // dictionary trained on others like them.
+    inline bool zlib_train_test_entry(void)
+    {
+        std::vector<std::string> samples;
+        char buf[128];
+        for (int i = 0; i < 64; ++i)
+        {
+            sprintf(buf, "{\"user\": \"user%d\", \"action\": \"login\", \"status\": \"ok\"}", i);
+            samples.push_back(buf);
+        }
+        comp_decomp_dict dict = comp_decomp_train_dict(samples);
+        if (dict.empty() || !zlib_dict_test_entry(dict, samples[7]))
+            return false;
 
-#ifdef HAVE_ZLIB
-    #include <zlib.h>
+        std::string plain, trained;
+        zlib_comp(plain, samples[7].data(), samples[7].size());
+        zlib_comp(trained, samples[7].data(), samples[7].size(), 9, NULL, &dict);
+        if (trained.size() >= plain.size())
+        {
+            printf("zlib dictionary did not help: %d >= %d\n",
+                   (int)trained.size(), (int)plain.size());
+            return false;
+        }
+        return true;
+    }
 
-    inline int zlib_comp(std::string& output, const void *input, uInt input_size, int rate = 9)
+    inline bool zlib_mt_test_entry(const std::string& original)
     {
-        const Bytef *ptr = (const Bytef *)input;
-        uInt remainder = input_size;
-        assert(1 <= rate && rate <= 9);
+        std::string encoded, decoded;
+        if (int ret = zlib_comp_mt(encoded, original.c_str(), original.size(), 9, 3, 16))
+        {
+            printf("zlib_comp_mt failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = zlib_decomp(decoded, encoded.c_str(), encoded.size()))
+        {
+            printf("zlib_decomp failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("zlib mt mismatch\n");
+            return false;
+        }
+        return true;
+    }
 
-        output.clear();
-        output.reserve(input_size * 2 / 3);
-        static Bytef inbuf[COMP_DECOMP_BUFFSIZE];
-        static Bytef outbuf[COMP_DECOMP_BUFFSIZE];
+    // Sets the block size, the input size and the block count in the index
+    // of zlib_comp_seekable output.
+    inline void zlib_forge_seek_index(std::string& encoded, uint64_t size, uint64_t length,
+                                      uint64_t blocks)
+    {
+        std::string tail;
+        comp_decomp_put_le64(tail, size);
+        comp_decomp_put_le64(tail, length);
+        comp_decomp_put_le64(tail, blocks);
+        encoded.replace(encoded.size() - 4 - 24, 24, tail);
+    }
 
-        z_stream strm;
-        memset(&strm, 0, sizeof(strm));
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        int ret = deflateInit(&strm, rate);
-        if (ret != Z_OK)
-            return ret;
+    // A forged index is not used: the data is inflated from the start.
+    inline bool zlib_forged_seek_test_entry(const std::string& original)
+    {
+        std::string encoded, forged, decoded;
+        if (int ret = zlib_comp_seekable(encoded, original.data(), original.size(), 9, 16))
+        {
+            printf("zlib_comp_seekable failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        size_t count = (original.size() + 15) / 16;
 
-        strm.next_in = NULL;
-        strm.avail_in = 0;
-        strm.next_out = outbuf;
-        strm.avail_out = sizeof(outbuf);
+        // a block count that wraps around, then 4 GiB blocks
+        forged = encoded;
+        zlib_forge_seek_index(forged, 2, UINT64_MAX, 0);
+        bool ok = !zlib_decomp_range(decoded, forged.data(), forged.size(), 0, 10) &&
+                  decoded == original.substr(0, 10);
+        forged = encoded;
+        zlib_forge_seek_index(forged, UINT_MAX, (uint64_t)UINT_MAX * (count - 1) + 1, count);
+        ok = ok && !zlib_decomp_range(decoded, forged.data(), forged.size(), 0, 10) &&
+             decoded == original.substr(0, 10);
+        if (!ok)
+        {
+            printf("zlib_decomp_range used a forged index\n");
+            return false;
+        }
+        return true;
+    }
 
-        int action = Z_NO_FLUSH;
-        while (ret == Z_OK || ret == Z_BUF_ERROR)
+    inline bool zlib_seekable_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = zlib_comp_seekable(encoded, original.data(), original.size(), 9, 16))
         {
-            if (strm.avail_in == 0)
-            {
-                strm.next_in = inbuf;
-                if (remainder < COMP_DECOMP_BUFFSIZE)
-                    strm.avail_in = remainder;
-                else
-                    strm.avail_in = COMP_DECOMP_BUFFSIZE;
-                memcpy(inbuf, ptr, strm.avail_in);
-                ptr += strm.avail_in;
-                remainder -= strm.avail_in;
+            printf("zlib_comp_seekable failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("zlib_decomp of seekable data failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (!(original == decoded))
+        {
+            printf("zlib seekable mismatch\n");
+            return false;
+        }
 
-                if (remainder == 0)
-                    action = Z_FINISH;
+        // within a block, across blocks, up to and past the end
+        const size_t ranges[][2] =
+        {
+            { 0, 1 }, { 3, 10 }, { 15, 2 }, { 10, 40 }, { 0, 1000 },
+            { original.size() / 2, 1000 }, { original.size(), 1 }, { 5, 0 },
+        };
+        for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i)
+        {
+            size_t offset = ranges[i][0], length = ranges[i][1];
+            if (int ret = zlib_decomp_range(decoded, encoded.data(), encoded.size(),
+                                              offset, length))
+            {
+                printf("zlib_decomp_range failed: %s\n", zlib_errmsg(ret));
+                return false;
+            }
+            std::string expected;
+            if (offset < original.size())
+                expected = original.substr(offset, length);
+            if (!(expected == decoded))
+            {
+                printf("zlib_decomp_range mismatch at %d+%d\n", (int)offset, (int)length);
+                return false;
             }
+        }
+
+        // data without the index is inflated from the start
+        zlib_comp(encoded, original.data(), original.size());
+        zlib_decomp_range(decoded, encoded.data(), encoded.size(), 3, 10);
+        if (!(decoded == original.substr(original.size() < 3 ? original.size() : 3, 10)))
+        {
+            printf("zlib_decomp_range mismatch without an index\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool zlib_span_test_entry(const std::string& original)
+    {
+        std::vector<unsigned char> encoded;
+        if (int ret = zlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("zlib_comp to a vector failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
 
-            ret = deflate(&strm, action);
+        std::vector<char> buffer(zlib_comp_bound(original.size()));
+        size_t written;
+        int ret = zlib_comp(&buffer[0], buffer.size(), written,
+                            original.data(), original.size());
+        if (ret != Z_OK || written != encoded.size() ||
+            memcmp(&buffer[0], &encoded[0], written) != 0)
+        {
+            printf("zlib_comp to a buffer failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
 
-            if (strm.avail_out == 0 || ret == Z_STREAM_END || ret == Z_BUF_ERROR)
+        // exactly as large as needed, then one byte short
+        buffer.assign(original.size() + 1, 0);
+        ret = zlib_decomp(&buffer[0], original.size(), written, &encoded[0], encoded.size());
+        if (ret != Z_OK || written != original.size() ||
+            memcmp(&buffer[0], original.data(), written) != 0)
+        {
+            printf("zlib_decomp to a buffer failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (original.size())
+        {
+            ret = zlib_decomp(&buffer[0], original.size() - 1, written,
+                              &encoded[0], encoded.size());
+            if (ret != COMP_DECOMP_SPACE_ERROR || buffer[original.size() - 1] != original.back())
             {
-                size_t write_size = sizeof(outbuf) - strm.avail_out;
-                output.insert(output.size(), (char *)outbuf, write_size);
-                strm.next_out = outbuf;
-                strm.avail_out = sizeof(outbuf);
+                printf("zlib_decomp overran a buffer: %s\n", zlib_errmsg(ret));
+                return false;
             }
         }
-
-        return deflateEnd(&strm);
+        return true;
     }
 
-    inline int zlib_decomp(std::string& output, const void *input, uInt input_size)
+    inline bool zlib_stream_test_entry(const std::string& original)
     {
-        const Bytef *ptr = (const Bytef *)input;
-        uInt remainder = input_size;
+        std::string encoded, decoded;
+        bool bounded = true;
+        comp_decomp_sink to_encoded = [&](const void *data, size_t size) {
+            bounded = bounded && size <= COMP_DECOMP_BUFFSIZE;
+            encoded.append((const char *)data, size);
+            return true;
+        };
+        comp_decomp_sink to_decoded = [&](const void *data, size_t size) {
+            bounded = bounded && size <= COMP_DECOMP_BUFFSIZE;
+            decoded.append((const char *)data, size);
+            return true;
+        };
 
-        output.clear();
-        output.reserve(input_size * 3 / 2);
-        static Bytef inbuf[COMP_DECOMP_BUFFSIZE];
-        static Bytef outbuf[COMP_DECOMP_BUFFSIZE];
+        zlib_compressor compressor;
+        int ret = compressor.begin(to_encoded);
+        for (size_t i = 0; ret == Z_OK && i < original.size(); i += 7)
+        {
+            size_t size = (original.size() - i < 7) ? original.size() - i : 7;
+            ret = compressor.write(&original[i], size);
+        }
+        if (ret == Z_OK)
+            ret = compressor.finish();
+        if (ret != Z_OK)
+        {
+            printf("zlib_compressor streaming failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
 
-        z_stream strm;
-        memset(&strm, 0, sizeof(strm));
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        int ret = inflateInit(&strm);
+        zlib_decompressor decompressor;
+        ret = decompressor.begin(to_decoded);
+        for (size_t i = 0; ret == Z_OK && i < encoded.size(); i += 5)
+        {
+            size_t size = (encoded.size() - i < 5) ? encoded.size() - i : 5;
+            ret = decompressor.write(&encoded[i], size);
+        }
+        if (ret == Z_OK)
+            ret = decompressor.finish();
         if (ret != Z_OK)
-            return ret;
+        {
+            printf("zlib_decompressor streaming failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+
+        if (!(original == decoded) || !bounded)
+        {
+            printf("zlib streaming mismatch\n");
+            return false;
+        }
+        return true;
+    }
+
+#ifndef COMP_DECOMP_MAX_TEST
+    #define COMP_DECOMP_MAX_TEST 100
+#endif
+#ifndef COMP_DECOMP_TEST_COUNT
+    #define COMP_DECOMP_TEST_COUNT 100
+#endif
 
-        strm.next_in = NULL;
-        strm.avail_in = 0;
-        strm.next_out = outbuf;
-        strm.avail_out = sizeof(outbuf);
+    inline bool zlib_limits_test_entry(const std::string& original)
+    {
+        std::string encoded, decoded;
+        if (int ret = zlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("zlib_comp failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
 
-        int action = Z_NO_FLUSH;
-        while (ret == Z_OK || ret == Z_BUF_ERROR)
+        comp_decomp_limits exact(original.size());
+        if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, NULL, &exact))
         {
-            if (strm.avail_in == 0)
+            printf("zlib_decomp within the limit failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        // 0 would be no limit
+        if (original.size() > 1)
+        {
+            comp_decomp_limits less(original.size() - 1);
+            if (zlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, NULL, &less) !=
+                COMP_DECOMP_LIMIT_ERROR || !decoded.empty())
             {
-                strm.next_in = inbuf;
-                if (remainder < COMP_DECOMP_BUFFSIZE)
-                    strm.avail_in = remainder;
-                else
-                    strm.avail_in = COMP_DECOMP_BUFFSIZE;
-                memcpy(inbuf, ptr, strm.avail_in);
-                ptr += strm.avail_in;
-                remainder -= strm.avail_in;
+                printf("zlib_decomp over the limit did not fail\n");
+                return false;
+            }
 
-                if (remainder == 0)
-                    action = Z_FINISH;
+            // a fixed buffer larger than the limit
+            std::vector<char> buffer(original.size() + 100);
+            size_t written;
+            int ret = zlib_decomp(&buffer[0], buffer.size(), written,
+                                  encoded.data(), encoded.size(), NULL, NULL, &less);
+            if (ret != COMP_DECOMP_LIMIT_ERROR)
+            {
+                printf("zlib_decomp over the limit into a buffer did not fail\n");
+                return false;
             }
+        }
 
-            ret = inflate(&strm, action);
+        // empty data may need no dictionary
+        if (!original.empty())
+        {
+            comp_decomp_limits small(0, (1 << 10) + COMP_DECOMP_ZLIB_INFLATE_STATE);
+            if (zlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, NULL, &small) !=
+                COMP_DECOMP_MEMORY_ERROR)
+            {
+                printf("zlib_decomp over the memory limit did not fail\n");
+                return false;
+            }
+            comp_decomp_limits enough(0, 64 * 1024);
+            if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size(),
+                                      0, NULL, NULL, &enough))
+            {
+                printf("zlib_decomp within the memory limit failed: %s\n", zlib_errmsg(ret));
+                return false;
+            }
 
-            if (strm.avail_out == 0 || ret == Z_STREAM_END || ret == Z_BUF_ERROR)
+            // the two bytes of the header in separate writes
+            std::string split;
+            comp_decomp_sink sink = [&split](const void *data, size_t size) {
+                split.append((const char *)data, size);
+                return true;
+            };
+            zlib_decompressor decompressor;
+            decompressor.set_limits(small);
+            int ret = decompressor.begin(sink);
+            if (ret == Z_OK)
+                ret = decompressor.write(encoded.data(), 1);
+            if (ret == Z_OK)
+                ret = decompressor.write(encoded.data() + 1, encoded.size() - 1);
+            if (ret != COMP_DECOMP_MEMORY_ERROR)
+            {
+                printf("zlib_decompressor over the memory limit did not fail\n");
+                return false;
+            }
+            decompressor.set_limits(enough);
+            ret = decompressor.begin(sink);
+            split.clear();
+            for (size_t i = 0; ret == Z_OK && i < encoded.size(); ++i)
+            {
+                ret = decompressor.write(&encoded[i], 1);
+            }
+            if (ret == Z_OK)
+                ret = decompressor.finish();
+            if (ret != Z_OK || !(split == original))
             {
-                size_t write_size = sizeof(outbuf) - strm.avail_out;
-                output.insert(output.size(), (const char *)outbuf, write_size);
-                strm.next_out = outbuf;
-                strm.avail_out = sizeof(outbuf);
+                printf("zlib_decompressor within the memory limit failed: %s\n",
+                       zlib_errmsg(ret));
+                return false;
             }
         }
+        return original == decoded;
+    }
 
-        return inflateEnd(&strm);
+    inline bool zlib_store_test_entry(const std::string& original)
+    {
+        std::string encoded;
+        if (int ret = zlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("zlib_comp failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        // FLEVEL of the zlib header is 0 for level 0, 2 for the default level
+        bool stored = comp_decomp_incompressible(original.data(), original.size());
+        if (((encoded[1] & 0xFF) >> 6 == 0) != stored)
+        {
+            printf("zlib stored %s input\n", stored ? "not the random" : "the compressible");
+            return false;
+        }
+        return true;
     }
 
-    inline const char *zlib_errmsg(int ret)
+    // Inputs large enough for comp_decomp_incompressible to look at: random
+    // bytes are stored (FLEVEL 0), text is not. Both overloads round-trip.
+    inline bool zlib_store_test_entry(void)
     {
-        switch (ret)
+        std::string random(16 * 1024, 0), text(16 * 1024, 0);
+        for (size_t i = 0; i < random.size(); ++i)
         {
-        case Z_OK: return "success (Z_OK)";
-        case Z_ERRNO:
-            if (ferror(stdin))
-                return "error reading stdin (Z_ERRNO)";
-            if (ferror(stdout))
-                return "error writing stdout (Z_ERRNO)";
-            return "error writing file (Z_ERRNO)";
-        case Z_STREAM_ERROR: return "invalid compression level (Z_STREAM_ERROR)";
-        case Z_DATA_ERROR: return "invalid or incomplete deflate data (Z_DATA_ERROR)";
-        case Z_MEM_ERROR: return "out of memory (Z_MEM_ERROR)";
-        case Z_VERSION_ERROR: return "zlib version mismatch! (Z_VERSION_ERROR)";
+            random[i] = (char)(std::rand() & 0xFF);
+            text[i] = (char)('a' + std::rand() % 4);
         }
-        return "unknown error";
+
+        for (int k = 0; k < 2; ++k)
+        {
+            const std::string& original = k ? text : random;
+            std::string encoded, decoded;
+            std::vector<char> buffer(zlib_comp_bound(original.size()));
+            size_t written;
+            if (zlib_comp(encoded, original.data(), original.size()) ||
+                zlib_comp(&buffer[0], buffer.size(), written, original.data(), original.size()) ||
+                zlib_decomp(decoded, encoded.data(), encoded.size()) || !(original == decoded))
+            {
+                printf("zlib store round trip failed\n");
+                return false;
+            }
+            bool stored = ((encoded[1] & 0xFF) >> 6 == 0);
+            if (stored != !k || ((buffer[1] & 0xFF) >> 6 == 0) != stored)
+            {
+                printf("zlib stored %s input\n", k ? "the text" : "not the random");
+                return false;
+            }
+        }
+        return true;
     }
 
-    inline bool zlib_test_entry(const std::string& original)
+    inline bool zlib_options_test_entry(const zlib_options& options, const std::string& original)
     {
         std::string encoded, decoded;
-        if (int ret = zlib_comp(encoded, original.c_str(), (uInt)original.size()))
+        if (int ret = zlib_comp(encoded, original.data(), original.size(), options))
         {
-            printf("zlib_comp failed: %s\n", zlib_errmsg(ret));
+            printf("zlib_comp with options failed: %s\n", zlib_errmsg(ret));
             return false;
         }
-        if (int ret = zlib_decomp(decoded, encoded.c_str(), (uInt)encoded.size()))
+
+        std::vector<char> buffer(zlib_comp_bound(original.size(), options));
+        size_t written;
+        if (int ret = zlib_comp(&buffer[0], buffer.size(), written,
+                                original.data(), original.size(), options))
         {
-            printf("zlib_decomp failed: %s\n", zlib_errmsg(ret));
+            printf("zlib_comp with options overran zlib_comp_bound: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (options.window_bits > MAX_WBITS && (encoded.size() < 2 || encoded[0] != '\x1F'))
+        {
+            printf("zlib options did not make gzip\n");
+            return false;
+        }
+
+        zlib_decompressor decompressor;
+        decompressor.set_options(options);
+        if (int ret = decompressor.decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("zlib_decompressor with options failed: %s\n", zlib_errmsg(ret));
             return false;
         }
         if (!(original == decoded))
         {
-            printf("zlib mismatch\n");
+            printf("zlib options mismatch\n");
             return false;
         }
         return true;
     }
 
-#ifndef COMP_DECOMP_MAX_TEST
-    #define COMP_DECOMP_MAX_TEST 100
-#endif
-#ifndef COMP_DECOMP_TEST_COUNT
-    #define COMP_DECOMP_TEST_COUNT 100
+    inline bool zlib_options_test_entry(const std::string& original)
+    {
+        zlib_options options[8];
+        options[0] = zlib_options::fastest();
+        options[1] = zlib_options::low_memory();
+        options[2].rate = 0;
+        options[3].strategy = Z_HUFFMAN_ONLY;
+        options[4].strategy = Z_FILTERED;
+        options[5].window_bits = -MAX_WBITS;
+        options[6].window_bits = MAX_WBITS + 16;
+        options[7].window_bits = -9;
+        options[7].mem_level = 9;
+        for (size_t i = 0; i < 8; ++i)
+        {
+            if (!zlib_options_test_entry(options[i], original))
+                return false;
+        }
+
+        // the small window of low_memory fits a small memory limit
+        std::string encoded, decoded;
+        comp_decomp_limits limits(0, 4096 + COMP_DECOMP_ZLIB_INFLATE_STATE);
+        zlib_comp(encoded, original.data(), original.size(), zlib_options::low_memory());
+        if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size(), 0, NULL, NULL, &limits))
+        {
+            printf("zlib low_memory exceeded its limit: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        return original == decoded;
+    }
+
+#ifdef COMP_DECOMP_STATS
+    inline bool zlib_stats_test_entry(const std::string& original)
+    {
+        comp_decomp_set_stats_callback(comp_decomp_stats_test_callback);
+        comp_decomp_stats before = comp_decomp_stats_snapshot(COMP_DECOMP_CODEC_ZLIB, true);
+
+        std::string encoded, decoded;
+        if (int ret = zlib_comp(encoded, original.data(), original.size()))
+        {
+            printf("zlib_comp with stats failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        const comp_decomp_call_stats& call = comp_decomp_stats_test_last();
+        if (call.codec != COMP_DECOMP_CODEC_ZLIB || !call.compress || call.bytes_in != original.size() ||
+            call.bytes_out != encoded.size() || call.iterations == 0 || call.mem_peak == 0)
+        {
+            printf("zlib call stats are wrong\n");
+            return false;
+        }
+
+        comp_decomp_stats after = comp_decomp_stats_snapshot(COMP_DECOMP_CODEC_ZLIB, true);
+        if (after.calls <= before.calls || after.bytes_in < before.bytes_in + original.size())
+        {
+            printf("zlib stats snapshot is wrong\n");
+            return false;
+        }
+
+        if (int ret = zlib_decomp(decoded, encoded.data(), encoded.size()))
+        {
+            printf("zlib_decomp with stats failed: %s\n", zlib_errmsg(ret));
+            return false;
+        }
+        if (call.compress || call.bytes_out != original.size() || call.iterations == 0)
+        {
+            printf("zlib decomp call stats are wrong\n");
+            return false;
+        }
+        return original == decoded;
+    }
 #endif
 
     inline bool zlib_unittest(void)
     {
+        zlib_compressor compressor;
+        zlib_decompressor decompressor;
+        comp_decomp_pool pool;
         std::string original;
         if (!zlib_test_entry(original))
             return false;
 
+        if (!zlib_train_test_entry())
+            return false;
+        if (!zlib_hint_test_entry())
+            return false;
+        if (!zlib_store_test_entry())
+            return false;
+
         original.assign(COMP_DECOMP_MAX_TEST, 'A');
         if (!zlib_test_entry(original))
             return false;
+        if (!zlib_mt_test_entry(original))
+            return false;
+        if (!zlib_span_test_entry(original))
+            return false;
+        if (!zlib_stream_test_entry(original))
+            return false;
+        if (!zlib_forged_seek_test_entry(original))
+            return false;
 
         for (size_t i = 0; i < COMP_DECOMP_TEST_COUNT; ++i)
         {
@@ -202,6 +1787,38 @@
             }
             if (!zlib_test_entry(original))
                 return false;
+            if (!zlib_test_entry(compressor, decompressor, original))
+                return false;
+            if (!zlib_allocator_test_entry(pool, original))
+                return false;
+            if (!zlib_limits_test_entry(original))
+                return false;
+            if (!zlib_store_test_entry(original))
+                return false;
+            if (!zlib_options_test_entry(original))
+                return false;
+#ifdef COMP_DECOMP_STATS
+            if (!zlib_stats_test_entry(original))
+                return false;
+#endif
+            if (!zlib_dict_test_entry(comp_decomp_dict(original.data(), original.size() / 2),
+                                      original))
+                return false;
+            if (!zlib_gzip_test_entry(original))
+                return false;
+            if (!zlib_mt_test_entry(original))
+                return false;
+            if (!zlib_span_test_entry(original))
+                return false;
+            if (!zlib_stream_test_entry(original))
+                return false;
+            if (!zlib_seekable_test_entry(original))
+                return false;
+        }
+        if (pool.reused() == 0)
+        {
+            printf("zlib pool not reused\n");
+            return false;
         }
         return true;
     }